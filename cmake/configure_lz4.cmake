@@ -0,0 +1,24 @@
+find_package(lz4 1.9.4)
+
+if(NOT ${lz4_FOUND})
+    include(FetchContent)
+
+    set(LZ4_BUILD_CLI OFF)
+    set(LZ4_BUILD_LEGACY_LZ4C OFF)
+
+    FetchContent_Declare(lz4
+        GIT_REPOSITORY https://github.com/lz4/lz4.git
+        GIT_TAG v1.9.4
+        SOURCE_SUBDIR build/cmake
+        OVERRIDE_FIND_PACKAGE)
+
+    FetchContent_MakeAvailable(lz4)
+endif()
+
+# installed packages export LZ4::lz4_static, while a sub project only has
+# lz4_static.
+if(TARGET LZ4::lz4_static)
+    set(HYB_lz4_target LZ4::lz4_static)
+else()
+    set(HYB_lz4_target lz4_static)
+endif()
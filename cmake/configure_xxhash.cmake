@@ -0,0 +1,10 @@
+set(xxhash_include_dir ${CMAKE_SOURCE_DIR}/3rdParty/xxHash CACHE PATH "Where to include xxhash.h")
+
+if(EXISTS ${xxhash_include_dir}/xxhash.h)
+    return()
+endif()
+
+file(DOWNLOAD
+    https://raw.githubusercontent.com/Cyan4973/xxHash/v0.8.2/xxhash.h
+    ${xxhash_include_dir}/xxhash.h
+)
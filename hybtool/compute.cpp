@@ -22,19 +22,141 @@ This file is part of Hybractal.
 
 #include "hybtool.h"
 
+namespace {
+
+libHybractal::save_options make_save_options(const task_compute &task) {
+  libHybractal::save_options save_opt;
+  save_opt.tile_rows = task.tile_size;
+  save_opt.tile_cols = task.tile_size;
+  save_opt.compression = task.compression;
+  save_opt.age_filters = libHybractal::parse_filters(task.age_filters).value();
+  save_opt.z_filters = libHybractal::parse_filters(task.z_filters).value();
+  save_opt.z_tolerance = task.z_tolerance;
+  save_opt.pyramid_levels = task.pyramid_levels;
+  return save_opt;
+}
+
+// Compute a row of tiles at a time and write it before computing the next, so
+// that only one band of the matrices is in memory.
+bool run_compute_out_of_core(const task_compute &task) noexcept {
+  if (task.gpu || !task.coordinator.empty()) {
+    std::cerr << "Out-of-core computing can't be done by cuda or by workers."
+              << std::endl;
+    return false;
+  }
+  const auto afmt = libHybractal::age_format_for_maxit(task.info.maxit);
+  std::string err;
+  auto writer = libHybractal::hybf_band_writer::open(
+      task.filename, task.info, task.save_mat_z, task.z_fmt, afmt,
+      make_save_options(task), &err);
+  if (writer == nullptr) {
+    std::cerr << fmt::format("Failed to save {}: {}", task.filename, err)
+              << std::endl;
+    return false;
+  }
+
+  const size_t band_rows = std::min(writer->band_rows(), task.info.rows);
+  fractal_utils::fractal_map band_age(band_rows, task.info.cols,
+                                      libHybractal::age_element_bytes(afmt));
+  std::optional<fractal_utils::fractal_map> band_z;
+  if (task.save_mat_z) {
+    band_z.emplace(band_rows, task.info.cols,
+                   libHybractal::z_element_bytes(task.z_fmt));
+  }
+
+  auto stats = libHybractal::frame_stats::make(task.info.maxit);
+  double compute_time = 0;
+  double export_time = 0;
+  const double begin = omp_get_wtime();
+  while (!writer->complete()) {
+    const size_t r = writer->next_row();
+    const size_t rows = std::min(band_rows, task.info.rows - r);
+    // the last band is shorter
+    fractal_utils::fractal_map age{rows, task.info.cols, band_age.element_bytes,
+                                   band_age.data};
+    std::optional<fractal_utils::fractal_map> z;
+    if (band_z.has_value()) {
+      z.emplace(rows, task.info.cols, band_z->element_bytes, band_z->data);
+    }
+
+    double wtime = omp_get_wtime();
+    libHybractal::compute_tile_by_precision(
+        task.info.window_base(), task.info.precision(), task.info.maxit,
+        task.info.rows, task.info.cols, {r, r + rows, 0, task.info.cols}, age,
+        z.has_value() ? &z.value() : nullptr);
+    stats.merge(libHybractal::make_frame_stats(age, task.info.maxit));
+    compute_time += omp_get_wtime() - wtime;
+
+    wtime = omp_get_wtime();
+    if (!writer->write_band(age, z.has_value() ? &z.value() : nullptr, &err)) {
+      std::cerr << fmt::format("Failed to save {}: {}", task.filename, err)
+                << std::endl;
+      return false;
+    }
+    export_time += omp_get_wtime() - wtime;
+  }
+  stats.wall_time = omp_get_wtime() - begin;
+
+  const double wtime = omp_get_wtime();
+  if (!writer->finish(stats, &err)) {
+    std::cerr << fmt::format("Failed to save {}: {}", task.filename, err)
+              << std::endl;
+    return false;
+  }
+  export_time += omp_get_wtime() - wtime;
+
+  if (task.bechmark) {
+    std::cout << fmt::format("Computation cost {} seconds.\n", compute_time);
+    std::cout << fmt::format("Export cost {} seconds.\n", export_time);
+  }
+  return true;
+}
+
+}  // namespace
+
 bool run_compute(const task_compute &task) noexcept {
   omp_set_num_threads(task.threads);
 
+  {
+    // such as --z-tolerance with --z-format other than f64
+    std::string err;
+    if (!libHybractal::hybf_archive::check_save_options(
+            make_save_options(task), task.save_mat_z, task.z_fmt,
+            libHybractal::age_format_for_maxit(task.info.maxit), &err)) {
+      std::cerr << fmt::format("Invalid options to save: {}", err)
+                << std::endl;
+      return false;
+    }
+  }
+
+  if (task.out_of_core) {
+    return run_compute_out_of_core(task);
+  }
+
   libHybractal::hybf_archive file(task.info.rows, task.info.cols,
-                                  task.save_mat_z);
+                                  task.save_mat_z, task.z_fmt,
+                                  libHybractal::age_format_for_maxit(
+                                      task.info.maxit));
 
   file.metainfo() = task.info;
   fractal_utils::fractal_map mat_age = file.map_age();
   fractal_utils::fractal_map mat_z = file.map_z();
 
+  libHybractal::frame_stats stats;
   double wtime;
   wtime = omp_get_wtime();
-  if (task.gpu) {
+  if (!task.coordinator.empty()) {
+    if (task.gpu) {
+      std::cerr << "Workers can't compute by cuda." << std::endl;
+      return false;
+    }
+    if (!compute_by_workers(task, mat_age,
+                            file.have_mat_z() ? &mat_z : nullptr)) {
+      return false;
+    }
+    stats = libHybractal::make_frame_stats(mat_age, file.metainfo().maxit);
+    stats.wall_time = omp_get_wtime() - wtime;
+  } else if (task.gpu) {
     libHybractal::cubractal_resource gpu_rcs{task.info.rows, task.info.cols};
     const std::string err = libHybractal::compute_frame_cuda(
         file.metainfo().window_base(), file.metainfo().precision(),
@@ -46,19 +168,24 @@ bool run_compute(const task_compute &task) noexcept {
                 << std::endl;
       return false;
     }
+    // the kernel doesn't count ages, so they are counted afterwards
+    stats = libHybractal::make_frame_stats(mat_age, file.metainfo().maxit);
+    stats.wall_time = omp_get_wtime() - wtime;
   } else {
     libHybractal::compute_frame_by_precision(
         file.metainfo().window_base(), file.metainfo().precision(),
-        file.metainfo().maxit, mat_age, file.have_mat_z() ? &mat_z : nullptr);
+        file.metainfo().maxit, mat_age, file.have_mat_z() ? &mat_z : nullptr,
+        &stats);
   }
   wtime = omp_get_wtime() - wtime;
+  file.stats() = std::move(stats);
 
   if (task.bechmark) {
     std::cout << fmt::format("Computation cost {} seconds.\n", wtime);
   }
 
   wtime = omp_get_wtime();
-  auto ret = file.save(task.filename);
+  auto ret = file.save(task.filename, make_save_options(task));
   wtime = omp_get_wtime() - wtime;
 
   if (task.bechmark) {
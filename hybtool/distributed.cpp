@@ -0,0 +1,757 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fmt/format.h>
+#include <omp.h>
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <struct_pack/struct_pack.hpp>
+#include <thread>
+#include <vector>
+
+#include "hybtool.h"
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+using std::cout, std::cerr, std::endl;
+
+// The coordinator splits a frame into tiles and hands them out to workers that
+// connect to it. Each worker has at most tiles_per_worker tiles in flight, so
+// that it computes the next tile while the result of the last one is sent.
+// Tiles of a worker that disconnects, or that are in flight longer than
+// tile_timeout, are handed out again, and the first result of a tile wins.
+//
+// Every message is a msg_header followed by its payload. Both sides are
+// expected to have the same endianness.
+namespace {
+
+constexpr uint32_t protocol_magic = 0x48594231;  // "HYB1"
+constexpr int tiles_per_worker = 2;
+
+enum class msg_type : uint32_t {
+  // worker to coordinator: hello_msg
+  hello = 1,
+  // coordinator to worker: job_msg and the serialized metainfo
+  job = 2,
+  // coordinator to worker: tile_msg
+  tile = 3,
+  // worker to coordinator: tile_msg, ages and z of the tile
+  result = 4,
+  // coordinator to worker: no tiles are left
+  done = 5,
+};
+
+struct msg_header {
+  uint32_t magic;
+  msg_type type;
+  uint64_t bytes;
+};
+
+struct hello_msg {
+  uint64_t sequence_bin;
+  uint64_t sequence_len;
+  uint32_t threads;
+  uint32_t reserved{0};
+};
+
+struct job_msg {
+  uint8_t have_z;
+  uint8_t z_fmt;
+  uint8_t reserved[6]{};
+};
+
+struct tile_msg {
+  uint64_t id;
+  std::array<uint64_t, 4> block;
+};
+
+#ifndef _WIN32
+
+struct endpoint {
+  bool unix_socket;
+  // socket path, or host
+  std::string address;
+  std::string port;
+};
+
+// unix:<path> or tcp:<host>:<port>, host may be * for the coordinator
+std::optional<endpoint> parse_endpoint(std::string_view str,
+                                       std::string &err) noexcept {
+  if (str.starts_with("unix:") && str.size() > 5) {
+    return endpoint{true, std::string{str.substr(5)}, ""};
+  }
+  if (str.starts_with("tcp:")) {
+    const auto rest = str.substr(4);
+    const size_t colon = rest.rfind(':');
+    if (colon != rest.npos && colon + 1 < rest.size()) {
+      return endpoint{false, std::string{rest.substr(0, colon)},
+                      std::string{rest.substr(colon + 1)}};
+    }
+  }
+  err = fmt::format(
+      "Invalid endpoint \"{}\", expected unix:<path> or tcp:<host>:<port>.",
+      str);
+  return std::nullopt;
+}
+
+class socket_fd {
+ private:
+  int m_fd{-1};
+
+ public:
+  socket_fd() = default;
+  explicit socket_fd(int fd) : m_fd{fd} {}
+  socket_fd(socket_fd &&src) noexcept : m_fd{src.m_fd} { src.m_fd = -1; }
+  socket_fd &operator=(socket_fd &&src) noexcept {
+    std::swap(this->m_fd, src.m_fd);
+    return *this;
+  }
+  ~socket_fd() {
+    if (this->m_fd >= 0) {
+      ::close(this->m_fd);
+    }
+  }
+
+  int fd() const noexcept { return this->m_fd; }
+  bool ok() const noexcept { return this->m_fd >= 0; }
+
+  bool send_all(const void *data, size_t bytes) const noexcept {
+    const char *p = reinterpret_cast<const char *>(data);
+    while (bytes > 0) {
+      const ssize_t n = ::send(this->m_fd, p, bytes, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      bytes -= n;
+    }
+    return true;
+  }
+
+  bool recv_all(void *data, size_t bytes) const noexcept {
+    char *p = reinterpret_cast<char *>(data);
+    while (bytes > 0) {
+      const ssize_t n = ::recv(this->m_fd, p, bytes, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      bytes -= n;
+    }
+    return true;
+  }
+
+  // payloads are concatenated
+  bool send_msg(msg_type type,
+                std::initializer_list<std::pair<const void *, size_t>> parts)
+      const noexcept {
+    msg_header header{protocol_magic, type, 0};
+    for (const auto &part : parts) {
+      header.bytes += part.second;
+    }
+    if (!this->send_all(&header, sizeof(header))) {
+      return false;
+    }
+    for (const auto &part : parts) {
+      if (!this->send_all(part.first, part.second)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool recv_msg(msg_header &header, std::vector<uint8_t> &payload,
+                uint64_t max_bytes) const noexcept {
+    if (!this->recv_all(&header, sizeof(header))) {
+      return false;
+    }
+    if (header.magic != protocol_magic || header.bytes > max_bytes) {
+      return false;
+    }
+    payload.resize(header.bytes);
+    return this->recv_all(payload.data(), payload.size());
+  }
+};
+
+socket_fd listen_on(const endpoint &ep, std::string &err) noexcept {
+  if (ep.unix_socket) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (ep.address.size() >= sizeof(addr.sun_path)) {
+      err = fmt::format("Socket path {} is too long.", ep.address);
+      return {};
+    }
+    std::strcpy(addr.sun_path, ep.address.c_str());
+    // left by a previous coordinator
+    ::unlink(ep.address.c_str());
+    socket_fd sock{::socket(AF_UNIX, SOCK_STREAM, 0)};
+    if (!sock.ok() ||
+        ::bind(sock.fd(), reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+            0 ||
+        ::listen(sock.fd(), 64) != 0) {
+      err = fmt::format("Failed to listen on {}: {}", ep.address,
+                        strerror(errno));
+      return {};
+    }
+    return sock;
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo *res = nullptr;
+  const char *host = (ep.address.empty() || ep.address == "*")
+                         ? nullptr
+                         : ep.address.c_str();
+  if (const int code = ::getaddrinfo(host, ep.port.c_str(), &hints, &res);
+      code != 0) {
+    err = fmt::format("Failed to resolve {}: {}", ep.address,
+                      gai_strerror(code));
+    return {};
+  }
+  socket_fd ret;
+  for (addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+    socket_fd sock{::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)};
+    if (!sock.ok()) {
+      continue;
+    }
+    const int one = 1;
+    ::setsockopt(sock.fd(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (::bind(sock.fd(), ai->ai_addr, ai->ai_addrlen) == 0 &&
+        ::listen(sock.fd(), 64) == 0) {
+      ret = std::move(sock);
+      break;
+    }
+  }
+  ::freeaddrinfo(res);
+  if (!ret.ok()) {
+    err = fmt::format("Failed to listen on {}:{}: {}", ep.address, ep.port,
+                      strerror(errno));
+  }
+  return ret;
+}
+
+socket_fd connect_to(const endpoint &ep, std::string &err) noexcept {
+  if (ep.unix_socket) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (ep.address.size() >= sizeof(addr.sun_path)) {
+      err = fmt::format("Socket path {} is too long.", ep.address);
+      return {};
+    }
+    std::strcpy(addr.sun_path, ep.address.c_str());
+    socket_fd sock{::socket(AF_UNIX, SOCK_STREAM, 0)};
+    if (!sock.ok() || ::connect(sock.fd(), reinterpret_cast<sockaddr *>(&addr),
+                                sizeof(addr)) != 0) {
+      err = fmt::format("Failed to connect to {}: {}", ep.address,
+                        strerror(errno));
+      return {};
+    }
+    return sock;
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *res = nullptr;
+  if (const int code = ::getaddrinfo(ep.address.c_str(), ep.port.c_str(),
+                                     &hints, &res);
+      code != 0) {
+    err = fmt::format("Failed to resolve {}: {}", ep.address,
+                      gai_strerror(code));
+    return {};
+  }
+  socket_fd ret;
+  for (addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+    socket_fd sock{::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)};
+    if (sock.ok() && ::connect(sock.fd(), ai->ai_addr, ai->ai_addrlen) == 0) {
+      ret = std::move(sock);
+      break;
+    }
+  }
+  ::freeaddrinfo(res);
+  if (!ret.ok()) {
+    err = fmt::format("Failed to connect to {}:{}: {}", ep.address, ep.port,
+                      strerror(errno));
+    return ret;
+  }
+  // find dead coordinators or workers behind broken networks
+  const int one = 1;
+  ::setsockopt(ret.fd(), SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+  return ret;
+}
+
+size_t tile_bytes(const tile_msg &tile, size_t element_bytes) noexcept {
+  return (tile.block[1] - tile.block[0]) * (tile.block[3] - tile.block[2]) *
+         element_bytes;
+}
+
+struct worker_conn {
+  socket_fd sock;
+  std::string name;
+  bool greeted{false};
+  // received bytes of an incomplete message
+  std::vector<uint8_t> buffer;
+  std::vector<uint64_t> in_flight;
+};
+
+class coordinator {
+ private:
+  const task_compute &m_task;
+  fractal_utils::fractal_map &m_age;
+  fractal_utils::fractal_map *const m_z;
+
+  std::vector<tile_msg> m_tiles;
+  std::vector<uint8_t> m_done;
+  std::vector<uint8_t> m_queued;
+  std::vector<std::chrono::steady_clock::time_point> m_dispatched;
+  std::deque<uint64_t> m_pending;
+  size_t m_remaining;
+  size_t m_retried{0};
+  // payload of the result of the largest tile
+  uint64_t m_max_payload;
+
+  std::vector<char> m_job;
+  socket_fd m_listener;
+  std::vector<std::unique_ptr<worker_conn>> m_workers;
+  int m_connections{0};
+
+ public:
+  coordinator(const task_compute &task, fractal_utils::fractal_map &age,
+              fractal_utils::fractal_map *z)
+      : m_task{task}, m_age{age}, m_z{z} {
+    const size_t edge = (task.tile_size > 0) ? task.tile_size : 256;
+    for (size_t r = 0; r < age.rows; r += edge) {
+      for (size_t c = 0; c < age.cols; c += edge) {
+        const uint64_t id = this->m_tiles.size();
+        this->m_tiles.emplace_back(tile_msg{
+            id, {r, std::min(r + edge, age.rows), c,
+                 std::min(c + edge, age.cols)}});
+        this->m_pending.emplace_back(id);
+      }
+    }
+    this->m_remaining = this->m_tiles.size();
+    this->m_max_payload =
+        sizeof(tile_msg) +
+        edge * edge *
+            (age.element_bytes + ((z != nullptr) ? z->element_bytes : 0));
+    this->m_done.resize(this->m_tiles.size(), false);
+    this->m_queued.resize(this->m_tiles.size(), true);
+    this->m_dispatched.resize(this->m_tiles.size());
+
+    const job_msg job{uint8_t(z != nullptr), uint8_t(task.z_fmt)};
+    const auto info = struct_pack::serialize(task.info.to_ir());
+    this->m_job.resize(sizeof(job));
+    std::memcpy(this->m_job.data(), &job, sizeof(job));
+    this->m_job.insert(this->m_job.end(), info.begin(), info.end());
+  }
+
+  bool run(const endpoint &ep) noexcept {
+    std::string err;
+    this->m_listener = listen_on(ep, err);
+    if (!this->m_listener.ok()) {
+      cerr << err << endl;
+      return false;
+    }
+    cout << fmt::format("Waiting for workers on {}, {} tiles to compute.",
+                        this->m_task.coordinator, this->m_tiles.size())
+         << endl;
+
+    size_t reported = 0;
+    while (this->m_remaining > 0) {
+      std::vector<pollfd> fds;
+      fds.emplace_back(pollfd{this->m_listener.fd(), POLLIN, 0});
+      for (const auto &w : this->m_workers) {
+        fds.emplace_back(pollfd{w->sock.fd(), POLLIN, 0});
+      }
+      if (::poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+        cerr << fmt::format("poll failed: {}", strerror(errno)) << endl;
+        return false;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        this->accept_worker();
+      }
+      for (size_t i = 1; i < fds.size(); i++) {
+        if (fds[i].revents == 0) {
+          continue;
+        }
+        auto &w = *this->m_workers[i - 1];
+        if (!this->receive(w)) {
+          this->drop(w);
+        }
+      }
+      std::erase_if(this->m_workers,
+                    [](const auto &w) { return !w->sock.ok(); });
+
+      this->requeue_timeouts();
+      for (auto &w : this->m_workers) {
+        this->feed(*w);
+      }
+
+      const size_t finished = this->m_tiles.size() - this->m_remaining;
+      if (finished * 10 / this->m_tiles.size() > reported) {
+        reported = finished * 10 / this->m_tiles.size();
+        cout << fmt::format("[{:^6.1f}% : {} / {} tiles], {} workers",
+                            100.0 * finished / this->m_tiles.size(), finished,
+                            this->m_tiles.size(), this->m_workers.size())
+             << endl;
+      }
+    }
+
+    for (auto &w : this->m_workers) {
+      w->sock.send_msg(msg_type::done, {});
+    }
+    if (ep.unix_socket) {
+      ::unlink(ep.address.c_str());
+    }
+    cout << fmt::format("All tiles are computed by {} workers, {} tiles were "
+                        "handed out again.",
+                        this->m_connections, this->m_retried)
+         << endl;
+    return true;
+  }
+
+ private:
+  void accept_worker() noexcept {
+    socket_fd sock{::accept(this->m_listener.fd(), nullptr, nullptr)};
+    if (!sock.ok()) {
+      return;
+    }
+    const int one = 1;
+    ::setsockopt(sock.fd(), SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    auto w = std::make_unique<worker_conn>();
+    w->sock = std::move(sock);
+    w->name = fmt::format("worker {}", this->m_connections++);
+    this->m_workers.emplace_back(std::move(w));
+  }
+
+  // read what is available and handle complete messages
+  bool receive(worker_conn &w) noexcept {
+    uint8_t chunk[1 << 16];
+    const ssize_t n = ::recv(w.sock.fd(), chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return (n < 0 && errno == EINTR);
+    }
+    w.buffer.insert(w.buffer.end(), chunk, chunk + n);
+
+    while (w.buffer.size() >= sizeof(msg_header)) {
+      msg_header header;
+      std::memcpy(&header, w.buffer.data(), sizeof(header));
+      if (header.magic != protocol_magic) {
+        cerr << fmt::format("Invalid message from {}", w.name) << endl;
+        return false;
+      }
+      // checked before buffering the payload, a broken or hostile peer can't
+      // make the coordinator allocate more than a tile
+      if (header.bytes > this->m_max_payload) {
+        cerr << fmt::format("Message of {} bytes from {} is too large.",
+                            header.bytes, w.name)
+             << endl;
+        return false;
+      }
+      if (w.buffer.size() < sizeof(header) + header.bytes) {
+        break;
+      }
+      const uint8_t *payload = w.buffer.data() + sizeof(header);
+      if (!this->handle(w, header, payload)) {
+        return false;
+      }
+      w.buffer.erase(w.buffer.begin(),
+                     w.buffer.begin() + sizeof(header) + header.bytes);
+    }
+    return true;
+  }
+
+  bool handle(worker_conn &w, const msg_header &header,
+              const uint8_t *payload) noexcept {
+    if (header.type == msg_type::hello) {
+      hello_msg hello;
+      if (header.bytes != sizeof(hello)) {
+        return false;
+      }
+      std::memcpy(&hello, payload, sizeof(hello));
+      if (hello.sequence_bin != this->m_task.info.sequence_bin ||
+          hello.sequence_len != this->m_task.info.sequence_len) {
+        cerr << fmt::format(
+                    "{} is rejected, its sequence mismatches with this "
+                    "program's configuration({}).",
+                    w.name, HYBRACTAL_SEQUENCE_STR)
+             << endl;
+        return false;
+      }
+      w.greeted = true;
+      cout << fmt::format("{} connected with {} threads.", w.name,
+                          hello.threads)
+           << endl;
+      return w.sock.send_msg(msg_type::job,
+                             {{this->m_job.data(), this->m_job.size()}});
+    }
+
+    if (header.type != msg_type::result || !w.greeted ||
+        header.bytes < sizeof(tile_msg)) {
+      return false;
+    }
+    tile_msg tile;
+    std::memcpy(&tile, payload, sizeof(tile));
+    if (tile.id >= this->m_tiles.size() ||
+        tile.block != this->m_tiles[tile.id].block) {
+      return false;
+    }
+    const size_t age_bytes = tile_bytes(tile, this->m_age.element_bytes);
+    const size_t z_bytes =
+        (this->m_z != nullptr) ? tile_bytes(tile, this->m_z->element_bytes) : 0;
+    if (header.bytes != sizeof(tile) + age_bytes + z_bytes) {
+      return false;
+    }
+    std::erase(w.in_flight, tile.id);
+    if (this->m_done[tile.id]) {
+      // a retried tile finished twice
+      return true;
+    }
+
+    this->stitch(tile, this->m_age, payload + sizeof(tile));
+    if (this->m_z != nullptr) {
+      this->stitch(tile, *this->m_z, payload + sizeof(tile) + age_bytes);
+    }
+    this->m_done[tile.id] = true;
+    this->m_remaining--;
+    return true;
+  }
+
+  static void stitch(const tile_msg &tile, fractal_utils::fractal_map &dst,
+                     const uint8_t *src) noexcept {
+    const size_t row_bytes = (tile.block[3] - tile.block[2]) * dst.element_bytes;
+    for (size_t r = tile.block[0]; r < tile.block[1]; r++) {
+      uint8_t *dst_row = reinterpret_cast<uint8_t *>(dst.data) +
+                         (r * dst.cols + tile.block[2]) * dst.element_bytes;
+      std::memcpy(dst_row, src, row_bytes);
+      src += row_bytes;
+    }
+  }
+
+  void drop(worker_conn &w) noexcept {
+    for (uint64_t id : w.in_flight) {
+      this->requeue(id);
+    }
+    if (!w.in_flight.empty()) {
+      cout << fmt::format("{} is lost, {} tiles are handed out again.", w.name,
+                          w.in_flight.size())
+           << endl;
+    }
+    w.in_flight.clear();
+    w.sock = socket_fd{};
+  }
+
+  void requeue(uint64_t id) noexcept {
+    if (this->m_done[id] || this->m_queued[id]) {
+      return;
+    }
+    this->m_queued[id] = true;
+    this->m_retried++;
+    this->m_pending.emplace_front(id);
+  }
+
+  void requeue_timeouts() noexcept {
+    if (this->m_task.tile_timeout <= 0) {
+      return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    for (const auto &w : this->m_workers) {
+      for (uint64_t id : w->in_flight) {
+        const std::chrono::duration<double> age = now - this->m_dispatched[id];
+        if (age.count() > this->m_task.tile_timeout) {
+          this->requeue(id);
+        }
+      }
+    }
+  }
+
+  void feed(worker_conn &w) noexcept {
+    while (w.greeted && w.in_flight.size() < tiles_per_worker &&
+           !this->m_pending.empty()) {
+      const uint64_t id = this->m_pending.front();
+      this->m_pending.pop_front();
+      this->m_queued[id] = false;
+      if (this->m_done[id]) {
+        continue;
+      }
+      const tile_msg &tile = this->m_tiles[id];
+      if (!w.sock.send_msg(msg_type::tile, {{&tile, sizeof(tile)}})) {
+        this->requeue(id);
+        this->drop(w);
+        return;
+      }
+      this->m_dispatched[id] = std::chrono::steady_clock::now();
+      w.in_flight.emplace_back(id);
+    }
+  }
+};
+
+#endif  // _WIN32
+
+}  // namespace
+
+bool compute_by_workers(const task_compute &task,
+                        fractal_utils::fractal_map &mat_age,
+                        fractal_utils::fractal_map *mat_z) noexcept {
+#ifdef _WIN32
+  cerr << "Distributed computing is not supported on Windows." << endl;
+  return false;
+#else
+  std::string err;
+  const auto ep = parse_endpoint(task.coordinator, err);
+  if (!ep.has_value()) {
+    cerr << err << endl;
+    return false;
+  }
+  // a worker that disconnects must not kill the coordinator
+  ::signal(SIGPIPE, SIG_IGN);
+  coordinator coord{task, mat_age, mat_z};
+  return coord.run(ep.value());
+#endif
+}
+
+bool run_worker(const task_worker &task) noexcept {
+#ifdef _WIN32
+  cerr << "Distributed computing is not supported on Windows." << endl;
+  return false;
+#else
+  std::string err;
+  const auto ep = parse_endpoint(task.endpoint, err);
+  if (!ep.has_value()) {
+    cerr << err << endl;
+    return false;
+  }
+  ::signal(SIGPIPE, SIG_IGN);
+  omp_set_num_threads(task.threads);
+
+  // the coordinator may start later than workers
+  socket_fd sock;
+  const auto begin = std::chrono::steady_clock::now();
+  while (true) {
+    sock = connect_to(ep.value(), err);
+    if (sock.ok()) {
+      break;
+    }
+    const std::chrono::duration<double> waited =
+        std::chrono::steady_clock::now() - begin;
+    if (waited.count() > task.connect_timeout) {
+      cerr << err << endl;
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{200});
+  }
+
+  const hello_msg hello{libHybractal::global_sequence_bin,
+                        libHybractal::global_sequence_len,
+                        uint32_t(task.threads)};
+  if (!sock.send_msg(msg_type::hello, {{&hello, sizeof(hello)}})) {
+    cerr << "Failed to greet the coordinator." << endl;
+    return false;
+  }
+
+  msg_header header;
+  std::vector<uint8_t> payload;
+  if (!sock.recv_msg(header, payload, 1 << 20) || header.type != msg_type::job ||
+      payload.size() < sizeof(job_msg)) {
+    cerr << "The coordinator rejected this worker or hung up." << endl;
+    return false;
+  }
+  job_msg job;
+  std::memcpy(&job, payload.data(), sizeof(job));
+  const auto info = libHybractal::hybf_metainfo_new::parse_metainfo_gen1(
+      payload.data() + sizeof(job), payload.size() - sizeof(job), err);
+  if (!err.empty()) {
+    cerr << fmt::format("Failed to parse the job. Detail: {}", err) << endl;
+    return false;
+  }
+  const size_t age_element =
+      libHybractal::age_element_bytes(libHybractal::age_format_for_maxit(
+          info.maxit));
+  const auto z_fmt = libHybractal::z_format(job.z_fmt);
+  const size_t z_element = libHybractal::z_element_bytes(z_fmt);
+  cout << fmt::format(
+              "Computing tiles of a {} x {} frame, precision = {}, maxit = {}",
+              info.rows, info.cols, info.precision(), info.maxit)
+       << endl;
+
+  int computed = 0;
+  while (true) {
+    if (!sock.recv_msg(header, payload, sizeof(tile_msg)) ||
+        header.type == msg_type::done) {
+      break;
+    }
+    tile_msg tile;
+    if (header.type != msg_type::tile || payload.size() != sizeof(tile)) {
+      cerr << "Invalid message from the coordinator." << endl;
+      return false;
+    }
+    std::memcpy(&tile, payload.data(), sizeof(tile));
+    const libHybractal::pixel_block block{tile.block[0], tile.block[1],
+                                          tile.block[2], tile.block[3]};
+    fractal_utils::fractal_map age(block[1] - block[0], block[3] - block[2],
+                                   age_element);
+    std::optional<fractal_utils::fractal_map> z;
+    if (job.have_z) {
+      z.emplace(age.rows, age.cols, z_element);
+    }
+    libHybractal::compute_tile_by_precision(
+        info.window_base(), info.precision(), info.maxit, info.rows, info.cols,
+        block, age, z.has_value() ? &z.value() : nullptr);
+
+    const size_t age_bytes = tile_bytes(tile, age_element);
+    const size_t z_bytes = job.have_z ? tile_bytes(tile, z_element) : 0;
+    if (!sock.send_msg(msg_type::result,
+                       {{&tile, sizeof(tile)},
+                        {age.data, age_bytes},
+                        {z.has_value() ? z->data : nullptr, z_bytes}})) {
+      cerr << "Lost the coordinator." << endl;
+      return false;
+    }
+    computed++;
+    if (task.max_tiles > 0 && computed >= task.max_tiles) {
+      cout << fmt::format("Leaving after {} tiles.", computed) << endl;
+      return true;
+    }
+  }
+  cout << fmt::format("Finished, {} tiles computed.", computed) << endl;
+  return true;
+#endif
+}
@@ -21,6 +21,7 @@ This file is part of Hybractal.
 
 #include <CLI11.hpp>
 #include <float_encode.hpp>
+#include <map>
 #include <thread>
 #include <variant>
 
@@ -64,7 +65,7 @@ int main(int argc, char **argv) {
       ->check(CLI::PositiveNumber);
   compute->add_option("--maxit", task_c.info.maxit, "Max iteration")
       ->default_val(1024)
-      ->check(CLI::Range(uint16_t(1), libHybractal::maxit_max));
+      ->check(CLI::Range(1, libHybractal::maxit_max_wide));
   compute->add_flag("--gpu", task_c.gpu, "Compute by cuda.")
       ->default_val(false);
 
@@ -102,10 +103,94 @@ int main(int argc, char **argv) {
       ->check(CLI::PositiveNumber);
   compute->add_flag("--mat-z", task_c.save_mat_z, "Whether to save z matrix.")
       ->default_val(false);
+  compute
+      ->add_option("--z-format", task_c.z_fmt,
+                   "Storage of z matrix. f32 takes half of the memory and "
+                   "norm-angle takes a quarter.")
+      ->default_val("f64")
+      ->transform(CLI::CheckedTransformer(
+          std::map<std::string, libHybractal::z_format>{
+              {"f64", libHybractal::z_format::f64},
+              {"f32", libHybractal::z_format::f32},
+              {"norm-angle", libHybractal::z_format::norm_angle_u16}},
+          CLI::ignore_case));
+  compute
+      ->add_option("--tile", task_c.tile_size,
+                   "Edge length of tiles that are compressed independently. 0 "
+                   "means no tiles.")
+      ->default_val(256);
+  compute
+      ->add_option("--codec", task_c.compression.codec,
+                   "Compression codec of data blocks.")
+      ->default_val("zstd")
+      ->transform(CLI::CheckedTransformer(
+          std::map<std::string, libHybractal::hybf_codec>{
+              {"store", libHybractal::hybf_codec::store},
+              {"zstd", libHybractal::hybf_codec::zstd},
+              {"lz4", libHybractal::hybf_codec::lz4}},
+          CLI::ignore_case));
+  compute
+      ->add_option("--compress-level", task_c.compression.level,
+                   "Compression level, 0 means the default of codec.")
+      ->default_val(0);
+  compute
+      ->add_option("--zstd-workers", task_c.compression.zstd_workers,
+                   "Threads that zstd uses for each block of untiled files "
+                   "(--tile 0). Ignored for tiled files, whose tiles are "
+                   "already compressed in parallel.")
+      ->default_val(0)
+      ->check(CLI::NonNegativeNumber);
+  CLI::Validator is_filters(
+      [](std::string &str) -> std::string {
+        if (libHybractal::parse_filters(str).has_value()) {
+          return "";
+        }
+        return "Expected comma separated rle, paeth, planar-xor, shuffle or "
+               "none.";
+      },
+      "Is filters");
+  compute
+      ->add_option("--age-filters", task_c.age_filters,
+                   "Pre-filters of mat_age, such as \"rle,shuffle\".")
+      ->default_val("rle,shuffle")
+      ->check(is_filters);
+  compute
+      ->add_option("--z-filters", task_c.z_filters,
+                   "Pre-filters of mat_z, such as \"planar-xor,shuffle\".")
+      ->default_val("planar-xor,shuffle")
+      ->check(is_filters);
+  compute
+      ->add_option("--z-tolerance", task_c.z_tolerance,
+                   "Store mat_z lossily, with at most this absolute error in "
+                   "real and imag parts. 0 means lossless. Requires tiles.")
+      ->default_val(0)
+      ->check(CLI::NonNegativeNumber);
+  compute
+      ->add_option("--pyramid", task_c.pyramid_levels,
+                   "Downsampled levels saved for thumbnails, each halves rows "
+                   "and cols. Requires tiles.")
+      ->default_val(0)
+      ->check(CLI::Range(0, 16));
   compute
       ->add_flag("--benchmark,--bench", task_c.bechmark,
                  "Show time costing for benchmark.")
       ->default_val(false);
+  compute
+      ->add_flag("--out-of-core,--ooc", task_c.out_of_core,
+                 "Compute and save a row of tiles at a time, for frames larger "
+                 "than memory. Requires tiles, and no pyramid.")
+      ->default_val(false);
+  compute
+      ->add_option("--coordinator", task_c.coordinator,
+                   "Hand out tiles to workers that connect to this endpoint, "
+                   "unix:<path> or tcp:<host>:<port>.")
+      ->default_val("");
+  compute
+      ->add_option("--tile-timeout", task_c.tile_timeout,
+                   "Seconds before a tile is handed out to another worker. 0 "
+                   "means waiting until its worker is lost.")
+      ->default_val(0)
+      ->check(CLI::NonNegativeNumber);
 
   //////////////////////////////////////
 
@@ -136,6 +221,11 @@ int main(int argc, char **argv) {
 
   render->add_option("-o", task_r.png_file, "Generated png file.")
       ->default_val("out.png");
+  render
+      ->add_option("--png-level", task_r.png_level,
+                   "Zlib compression level of png.")
+      ->default_val(6)
+      ->check(CLI::Range(0, 9));
   render
       ->add_flag("--benchmark,--bench", task_r.bechmark,
                  "Show time costing for benchmark.")
@@ -171,6 +261,12 @@ int main(int argc, char **argv) {
   look->add_flag("--generation,--gen", task_l.show_generation,
                  "Show format generation of this file.")
       ->default_val(false);
+  look->add_flag("--stats", task_l.show_stats,
+                 "Show age histogram and statistics recorded by compute.")
+      ->default_val(false);
+  look->add_flag("--verify", task_l.verify,
+                 "Fail if any block mismatches its checksum.")
+      ->default_val(false);
 
   CLI::Validator is_zst{[](std::string &input) -> std::string {
                           if (input.ends_with(".zst")) {
@@ -197,6 +293,32 @@ int main(int argc, char **argv) {
                    "Extract z matrix.")
       ->check(!CLI::ExistingFile);
 
+  CLI::Option *const look_render_json =
+      look->add_option("--render-json,--rj", task_l.render_json,
+                       "Renderer config json file of the thumbnail.")
+          ->check(CLI::ExistingFile & is_json);
+  look->add_option("--thumbnail", task_l.thumbnail,
+                   "Render a png from the smallest pyramid level that is "
+                   "large enough.")
+      ->needs(look_render_json);
+  look->add_option("--thumbnail-size", task_l.thumbnail_size,
+                   "Minimum length of the longer edge of the thumbnail.")
+      ->default_val(256)
+      ->check(CLI::PositiveNumber);
+  look->add_option("--compare", task_l.compare_file,
+                   "Fail if ages differ from those of this file, or z differs "
+                   "by more than --tolerance.")
+      ->check(CLI::ExistingFile & is_hybf);
+  look->add_option("--tolerance", task_l.compare_tolerance,
+                   "Absolute error of real and imag parts of z allowed by "
+                   "--compare.")
+      ->default_val(0)
+      ->check(CLI::NonNegativeNumber);
+  look->add_option("--region", task_l.region,
+                   "Load the region of row_begin, col_begin, rows and cols "
+                   "alone, and fail if it differs from the whole file.")
+      ->expected(4);
+
   //////////////////////////////////////
 
   task_update task_u;
@@ -207,6 +329,41 @@ int main(int argc, char **argv) {
       ->required();
   update->add_flag("--keep,-k", task_u.keep, "Keep the original file.")
       ->default_val(false);
+  update
+      ->add_flag("--no-mapping", task_u.no_mapping,
+                 "Read files without mapping them into memory.")
+      ->default_val(false);
+  update
+      ->add_option("--threads,-j", task_u.threads,
+                   "Files that are updated at the same time.")
+      ->default_val(std::thread::hardware_concurrency())
+      ->check(CLI::PositiveNumber);
+
+  //////////////////////////////////////
+
+  task_worker task_w;
+
+  CLI::App *const worker = app.add_subcommand(
+      "worker", "Compute tiles handed out by hybtool compute --coordinator.");
+  worker
+      ->add_option("endpoint", task_w.endpoint,
+                   "Endpoint of the coordinator, unix:<path> or "
+                   "tcp:<host>:<port>.")
+      ->required();
+  worker->add_option("--threads,-j", task_w.threads, "Threads used to compute.")
+      ->default_val(std::thread::hardware_concurrency())
+      ->check(CLI::PositiveNumber);
+  worker
+      ->add_option("--connect-timeout", task_w.connect_timeout,
+                   "Seconds to wait for the coordinator.")
+      ->default_val(60)
+      ->check(CLI::NonNegativeNumber);
+  worker
+      ->add_option("--max-tiles", task_w.max_tiles,
+                   "Leave after computing this number of tiles. 0 means no "
+                   "limit.")
+      ->default_val(0)
+      ->check(CLI::NonNegativeNumber);
 
   //////////////////////////////////////
   CLI11_PARSE(app, argc, argv);
@@ -263,6 +420,13 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (worker->count() > 0) {
+    if (!run_worker(task_w)) {
+      std::cout << "Worker failed." << std::endl;
+      return 1;
+    }
+  }
+
   std::cout << "Success" << std::endl;
 
   return 0;
@@ -26,9 +26,27 @@ struct task_compute {
   libHybractal::hybf_metainfo_new info;
   std::string filename;
   uint16_t threads{1};
+  // edge length of compressed tiles, 0 for untiled gen 1 files.
+  uint32_t tile_size{256};
+  libHybractal::compress_options compression{};
+  std::string age_filters{"rle,shuffle"};
+  std::string z_filters{"planar-xor,shuffle"};
+  // absolute error bound of lossy mat_z, 0 means lossless
+  double z_tolerance{0};
+  // downsampled levels saved after the matrices, only for tiled files.
+  int pyramid_levels{0};
   bool save_mat_z{false};
+  libHybractal::z_format z_fmt{libHybractal::z_format::f64};
   bool bechmark{false};
   bool gpu{false};
+  // compute and save a row of tiles at a time, so that memory is bounded by
+  // tile_size * cols pixels
+  bool out_of_core{false};
+  // endpoint that workers connect to, empty to compute locally
+  std::string coordinator{""};
+  // seconds before a tile is handed out again, 0 means tiles are only handed
+  // out again when their worker is lost
+  double tile_timeout{0};
   void override_x_span() noexcept {
     const double rows = info.rows;
     const double cols = info.cols;
@@ -44,11 +62,28 @@ struct task_compute {
 };
 
 bool run_compute(const task_compute &task) noexcept;
+// compute tiles of the frame by workers connected to task.coordinator
+bool compute_by_workers(const task_compute &task,
+                        fractal_utils::fractal_map &mat_age,
+                        fractal_utils::fractal_map *mat_z) noexcept;
+
+struct task_worker {
+  // unix:<path> or tcp:<host>:<port>
+  std::string endpoint;
+  int threads{1};
+  // seconds to wait for the coordinator
+  double connect_timeout{60};
+  // leave after computing this number of tiles, 0 means no limit
+  int max_tiles{0};
+};
+
+bool run_worker(const task_worker &task) noexcept;
 
 struct task_render {
   std::string json_file;
   std::string png_file;
   std::string hybf_file;
+  int png_level{6};
   bool bechmark{false};
 };
 
@@ -65,10 +100,25 @@ struct task_look {
   bool show_maxit{false};
   bool show_precision{false};
   bool show_generation{false};
+  bool show_stats{false};
+  // compare blocks with the checksums in the file before loading
+  bool verify{false};
   std::string extract_age_compressed{""};
   std::string extract_age_decompress{""};
   std::string extract_z_compressed{""};
   std::string extract_z_decompress{""};
+  // png rendered from the smallest pyramid level whose longer edge is at least
+  // thumbnail_size.
+  std::string thumbnail{""};
+  std::string render_json{""};
+  int thumbnail_size{256};
+  // Fail if ages differ from those of compare_file, or z differs by more than
+  // compare_tolerance in real or imag part.
+  std::string compare_file{""};
+  double compare_tolerance{0};
+  // {row_begin, col_begin, rows, cols}, fail if load_region() of it differs
+  // from the crop of the whole file
+  std::vector<size_t> region;
 };
 
 bool run_look(const task_look &task) noexcept;
@@ -76,6 +126,9 @@ bool run_look(const task_look &task) noexcept;
 struct task_update {
   std::vector<std::string> files;
   bool keep{false};
+  // read files by fractal_utils instead of mapping them
+  bool no_mapping{false};
+  int threads{1};
 };
 
 bool run_update(const task_update &task) noexcept;
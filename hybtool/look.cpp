@@ -19,22 +19,53 @@ This file is part of Hybractal.
 #include <fmt/format.h>
 #include <hex_convert.h>
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 
 #include "hybtool.h"
+#include "libRender.h"
 
 using std::cout, std::cerr, std::endl;
 
 bool export_bin_file(std::string_view filename, const void *data,
                      size_t bytes) noexcept;
 
+bool export_thumbnail(const task_look &task) noexcept;
+
+bool compare_archive(const task_look &task,
+                     const libHybractal::hybf_archive &archive) noexcept;
+
+bool check_region(const task_look &task,
+                  const libHybractal::hybf_archive &archive) noexcept;
+
 bool run_look(const task_look &task) noexcept {
+  if (task.verify) {
+    std::string err;
+    bool has_checksums = false;
+    if (!libHybractal::hybf_archive::verify(task.file, &err, &has_checksums)) {
+      cerr << fmt::format("Failed to verify hybf file \"{}\". Detail: {}",
+                          task.file, err)
+           << endl;
+      return false;
+    }
+    cout << (has_checksums ? "Checksums: ok\n"
+                           : "Checksums: not recorded, nothing is verified\n")
+         << endl;
+  }
+
   libHybractal::load_options opt;
 
   fractal_utils::binfile binfile;
+  libHybractal::hybf_tile_index tile_index{};
 
   opt.binfile = &binfile;
+  opt.tile_index = &tile_index;
+  // matrices are decompressed only to be extracted
+  const bool decode = !task.compare_file.empty() || !task.region.empty();
+  opt.skip_age = task.extract_age_decompress.empty() && !decode;
+  opt.skip_z = task.extract_z_decompress.empty() && !decode;
 
   std::string err{""};
 
@@ -55,6 +86,21 @@ bool run_look(const task_look &task) noexcept {
       cout << fmt::format("    Block {}: tag = {}, size = {}, offset = {}\n",
                           idx, blk.tag, blk.bytes, blk.file_offset);
     }
+    if (archive.metainfo().generation() >= 2) {
+      cout << fmt::format(
+          "Tiles: size = [{}, {}], num = {}, codec = {}, age filters = {}, z "
+          "filters = {}, z tolerance = {}, z format = {}, age format = {}\n",
+          tile_index.tile_rows, tile_index.tile_cols,
+          tile_index.age_tile_bytes.size(),
+          libHybractal::codec_name(libHybractal::hybf_codec(tile_index.codec)),
+          libHybractal::filter_names(tile_index.age_filters),
+          libHybractal::filter_names(tile_index.z_filters),
+          tile_index.z_tolerance,
+          libHybractal::z_format_name(
+              libHybractal::z_format(tile_index.z_format)),
+          libHybractal::age_format_name(
+              libHybractal::age_format(tile_index.age_format)));
+    }
     cout << endl;
   }
 
@@ -106,6 +152,32 @@ bool run_look(const task_look &task) noexcept {
     cout << endl;
   }
 
+  if (task.show_stats || task.show_all) {
+    if (!archive.stats().has_value()) {
+      cout << "Statistics: not recorded\n";
+    } else {
+      const auto &stats = archive.stats().value();
+      const uint64_t pixels = stats.escaped + stats.inside;
+      cout << fmt::format(
+          "Statistics: escaped = {}, inside = {}, escaped ratio = {:.2f}%\n",
+          stats.escaped, stats.inside,
+          100.0 * stats.escaped / std::max<uint64_t>(pixels, 1));
+      cout << fmt::format(
+          "    total iterations = {}, mean iterations = {:.1f}, wall time = "
+          "{} seconds\n",
+          stats.total_iterations,
+          double(stats.total_iterations) / std::max<uint64_t>(pixels, 1),
+          stats.wall_time);
+      cout << fmt::format(
+          "    escaping ages: bins = {}, bin width = {}, p1 = {}, median = {}, "
+          "p99 = {}\n",
+          stats.age_histogram.size(), stats.bin_width,
+          stats.age_quantile(0.01), stats.age_quantile(0.5),
+          stats.age_quantile(0.99));
+    }
+    cout << endl;
+  }
+
   const auto blk_age =
       binfile.find_block_single(libHybractal::hybf_archive::seg_id::id_mat_age);
 
@@ -162,6 +234,198 @@ bool run_look(const task_look &task) noexcept {
     }
   }
 
+  if (!task.thumbnail.empty()) {
+    if (!export_thumbnail(task)) {
+      return false;
+    }
+  }
+
+  if (!task.compare_file.empty()) {
+    if (!compare_archive(task, archive)) {
+      return false;
+    }
+  }
+
+  if (!task.region.empty()) {
+    if (!check_region(task, archive)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool check_region(const task_look &task,
+                  const libHybractal::hybf_archive &archive) noexcept {
+  const size_t r0 = task.region[0], c0 = task.region[1];
+  const size_t rows = task.region[2], cols = task.region[3];
+  if (rows == 0 || cols == 0) {
+    cerr << "The region is empty." << endl;
+    return false;
+  }
+  std::string err;
+  const auto region = libHybractal::hybf_archive::load_region(
+      task.file, r0, c0, rows, cols, &err);
+  if (!err.empty()) {
+    cerr << fmt::format("Failed to load region of \"{}\". Detail: {}",
+                        task.file, err)
+         << endl;
+    return false;
+  }
+  if (region.rows() != rows || region.cols() != cols ||
+      region.have_mat_z() != archive.have_mat_z() ||
+      region.mat_age_format() != archive.mat_age_format() ||
+      (archive.have_mat_z() &&
+       region.mat_z_format() != archive.mat_z_format())) {
+    cerr << "The region mismatches with the file in size or in formats."
+         << endl;
+    return false;
+  }
+
+  // element by element, so that matrices of any format are compared
+  auto same_crop = [&](std::span<const uint8_t> full,
+                       std::span<const uint8_t> part) {
+    const size_t ele_bytes = part.size() / (rows * cols);
+    for (size_t r = 0; r < rows; r++) {
+      const size_t src = ((r0 + r) * archive.cols() + c0) * ele_bytes;
+      if (!std::equal(part.begin() + r * cols * ele_bytes,
+                      part.begin() + (r + 1) * cols * ele_bytes,
+                      full.begin() + src)) {
+        return false;
+      }
+    }
+    return true;
+  };
+  const bool age_ok = same_crop(archive.mat_age_data(), region.mat_age_data());
+  const bool z_ok = !archive.have_mat_z() ||
+                    same_crop(archive.mat_z_data(), region.mat_z_data());
+  cout << fmt::format(
+              "Region [{}, {}) x [{}, {}): age {}, z {}\n", r0, r0 + rows, c0,
+              c0 + cols, age_ok ? "matches" : "mismatches",
+              archive.have_mat_z() ? (z_ok ? "matches" : "mismatches")
+                                   : "not saved");
+  return age_ok && z_ok;
+}
+
+bool compare_archive(const task_look &task,
+                     const libHybractal::hybf_archive &archive) noexcept {
+  std::string err;
+  const auto ref = libHybractal::hybf_archive::load(task.compare_file, &err);
+  if (!err.empty()) {
+    cerr << fmt::format("Failed to load hybf file \"{}\". Detail: {}",
+                        task.compare_file, err)
+         << endl;
+    return false;
+  }
+  if (ref.rows() != archive.rows() || ref.cols() != archive.cols() ||
+      ref.have_mat_z() != archive.have_mat_z()) {
+    cerr << fmt::format(
+                "{} and {} mismatch in size or in whether mat_z is saved.",
+                task.file, task.compare_file)
+         << endl;
+    return false;
+  }
+
+  const size_t pixels = archive.rows() * archive.cols();
+  size_t age_diff = 0;
+  double z_error = 0;
+  for (size_t i = 0; i < pixels; i++) {
+    if (libHybractal::load_age(archive.mat_age_data().data(), i,
+                               archive.mat_age_format()) !=
+        libHybractal::load_age(ref.mat_age_data().data(), i,
+                               ref.mat_age_format())) {
+      age_diff++;
+    }
+    if (!archive.have_mat_z()) {
+      continue;
+    }
+    double re, im, ref_re, ref_im;
+    libHybractal::load_z(archive.mat_z_data().data(), i,
+                         archive.mat_z_format(), re, im);
+    libHybractal::load_z(ref.mat_z_data().data(), i, ref.mat_z_format(),
+                         ref_re, ref_im);
+    // equal infinities or nans have no error
+    auto error = [](double a, double b) -> double {
+      if (a == b || (std::isnan(a) && std::isnan(b))) {
+        return 0;
+      }
+      return std::abs(a - b);
+    };
+    for (const double e : {error(re, ref_re), error(im, ref_im)}) {
+      if (!(e <= z_error)) {
+        z_error = e;
+      }
+    }
+  }
+
+  cout << fmt::format(
+              "Compared with {}: {} ages differ, max error of z = {}\n",
+              task.compare_file, age_diff, z_error);
+  if (age_diff > 0 || !(z_error <= task.compare_tolerance)) {
+    cerr << fmt::format("{} mismatches with {} beyond tolerance {}.",
+                        task.file, task.compare_file, task.compare_tolerance)
+         << endl;
+    return false;
+  }
+  return true;
+}
+
+bool export_thumbnail(const task_look &task) noexcept {
+  std::string err;
+  const auto sizes = libHybractal::hybf_archive::level_sizes(task.file, &err);
+  if (!err.empty()) {
+    cerr << fmt::format("Failed to find pyramid levels of {}. Detail: {}",
+                        task.file, err)
+         << endl;
+    return false;
+  }
+  // sizes are decreasing, take the last one that is large enough
+  int level = 0;
+  for (size_t l = 0; l < sizes.size(); l++) {
+    if (std::max(sizes[l][0], sizes[l][1]) >= size_t(task.thumbnail_size)) {
+      level = int(l);
+    }
+  }
+
+  auto src = libHybractal::hybf_archive::load_level(task.file, level, &err);
+  if (!err.empty()) {
+    cerr << fmt::format("Failed to load level {} of {}. Detail: {}", level,
+                        task.file, err)
+         << endl;
+    return false;
+  }
+  if (!src.have_mat_z()) {
+    cerr << "Trying to render a thumbnail, but the file doesn't contain mat_z."
+         << endl;
+    return false;
+  }
+
+  auto render_opt =
+      libHybractal::hsv_render_option::load_from_file(task.render_json);
+  if (!render_opt.has_value()) {
+    cerr << "Failed to load render option file" << endl;
+    return false;
+  }
+
+  libHybractal::gpu_resource gpu_rcs(src.rows(), src.cols());
+  if (!gpu_rcs.ok()) {
+    cerr << "Failed to initialize gpu resource." << endl;
+    return false;
+  }
+
+  fractal_utils::fractal_map img_u8c3(src.rows(), src.cols(), 3);
+  libHybractal::render_hsv(src.map_age(), src.map_z(), img_u8c3,
+                           render_opt.value(), gpu_rcs);
+
+  if (!libHybractal::write_image_u8c3(task.thumbnail.c_str(),
+                                      libHybractal::image_format::png,
+                                      img_u8c3, 6)) {
+    cerr << fmt::format("Failed to export thumbnail {}", task.thumbnail)
+         << endl;
+    return false;
+  }
+  cout << fmt::format("Thumbnail rendered from level {}, rows = {}, cols = {}\n",
+                      level, src.rows(), src.cols());
   return true;
 }
 
@@ -35,7 +35,7 @@ bool run_render(const task_render &task) noexcept {
 
   if (!src.have_mat_z()) {
     std::cout << "Source file doesn\'t contains mat-z.\n";
-    std::cout << fmt::format("rows = {}, cols = {}, size of vector = {}",
+    std::cout << fmt::format("rows = {}, cols = {}, bytes of mat_z = {}",
                              src.rows(), src.cols(), src.mat_z_data().size())
               << std::endl;
     ;
@@ -70,8 +70,9 @@ bool run_render(const task_render &task) noexcept {
   }
 
   wtime = omp_get_wtime();
-  const bool ok = fractal_utils::write_png(
-      task.png_file.c_str(), fractal_utils::color_space::u8c3, img_u8c3);
+  const bool ok = libHybractal::write_image_u8c3(
+      task.png_file.c_str(), libHybractal::image_format::png, img_u8c3,
+      task.png_level);
   wtime = omp_get_wtime() - wtime;
 
   if (!ok) {
@@ -0,0 +1,31 @@
+#!/bin/sh
+# A byte in the middle of the largest block is flipped, and look --verify must
+# find it.
+# usage: test_checksum.sh <hybtool>
+set -e
+hybtool=$1
+flags="--rows 720 --cols 1080 --maxit 50 --center 0.1 0.2 --precision 2"
+
+rm -rf checksum
+mkdir -p checksum
+"$hybtool" compute $flags --mat-z -o checksum/good.hybf > /dev/null
+"$hybtool" look checksum/good.hybf --verify > /dev/null
+
+pos=$("$hybtool" look checksum/good.hybf --blocks |
+  awk -F '[=,]' '/Block/ && $4 + 0 > size { size = $4 + 0; offset = $6 + 0 }
+    END { print offset + int(size / 2) }')
+test "$pos" -gt 0
+cp checksum/good.hybf checksum/bad.hybf
+byte=$(od -An -tu1 -j "$pos" -N1 checksum/bad.hybf | tr -d ' ')
+printf "\\$(printf '%03o' $((byte ^ 255)))" |
+  dd of=checksum/bad.hybf bs=1 seek="$pos" conv=notrunc 2> /dev/null
+if cmp -s checksum/good.hybf checksum/bad.hybf; then
+  echo "failed to corrupt the file"
+  exit 1
+fi
+
+if "$hybtool" look checksum/bad.hybf --verify > checksum/look.log 2>&1; then
+  echo "look --verify accepted a corrupted file"
+  exit 1
+fi
+grep -q "mismatch" checksum/look.log
@@ -0,0 +1,41 @@
+#!/bin/sh
+# A coordinator hands out tiles to workers on a unix socket, one worker leaves
+# early so that its tiles are handed out again. The stitched frame must equal
+# the one computed locally.
+# usage: test_distributed.sh <hybtool>
+set -e
+hybtool=$1
+flags="--rows 720 --cols 1080 --maxit 50 --center 0.1 0.2 --precision 2 --mat-z --tile 128"
+
+rm -rf distributed
+mkdir -p distributed
+socket="unix:$(pwd)/distributed/coordinator.sock"
+
+"$hybtool" compute $flags -o distributed/local.hybf > distributed/local.log
+
+"$hybtool" compute $flags --coordinator "$socket" -o distributed/remote.hybf \
+  > distributed/coordinator.log 2>&1 &
+coordinator=$!
+
+# workers wait until the coordinator listens
+"$hybtool" worker "$socket" -j 1 --max-tiles 1 > distributed/worker-0.log 2>&1
+pids=""
+for i in 1 2; do
+  "$hybtool" worker "$socket" -j 2 --connect-timeout 10 \
+    > "distributed/worker-$i.log" 2>&1 &
+  pids="$pids $!"
+done
+wait "$coordinator"
+# a worker that arrives after all tiles are computed fails to connect
+for pid in $pids; do
+  wait "$pid" || true
+done
+
+grep -q "Leaving after 1 tiles" distributed/worker-0.log
+grep -q "is lost" distributed/coordinator.log
+
+for f in local remote; do
+  "$hybtool" look distributed/$f.hybf --ea distributed/$f.age --ez distributed/$f.z > /dev/null
+done
+cmp distributed/local.age distributed/remote.age
+cmp distributed/local.z distributed/remote.z
@@ -0,0 +1,25 @@
+#!/bin/sh
+# A gen 0 file is updated to gen 1 while it is read without mapping, so that
+# its blocks own their data. The matrices must be kept.
+# usage: test_update.sh <hybtool>
+set -e
+hybtool=$1
+flags="--rows 720 --cols 1080 --maxit 50 --center 0.1 0.2 --precision 2"
+
+rm -rf update
+mkdir -p update
+"$hybtool" compute $flags --tile 0 -o update/gen1.hybf > /dev/null
+"$hybtool" compute $flags -o update/gen2.hybf > /dev/null
+
+# the only byte of the headers that differs is the generation
+offset=$(cmp -l update/gen1.hybf update/gen2.hybf | awk '$2 == 1 && $3 == 2 { print $1; exit }')
+test -n "$offset"
+cp update/gen1.hybf update/gen0.hybf
+printf '\000' | dd of=update/gen0.hybf bs=1 seek=$((offset - 1)) conv=notrunc 2> /dev/null
+
+"$hybtool" update --no-mapping --keep -j 1 update/gen0.hybf > update/update.log
+grep -q "1 of 1 files are updated" update/update.log
+
+"$hybtool" look update/gen1.hybf --ea update/gen1.age > /dev/null
+"$hybtool" look update/gen0_new.hybf --generation --ea update/gen0_new.age > update/look.log
+cmp update/gen1.age update/gen0_new.age
@@ -30,8 +30,13 @@ using std::cout, std::endl;
 
 bool run_update(const task_update &task) noexcept {
   int fail_counter = 0;
+  int update_counter = 0;
 
-  for (const auto &src_name : task.files) {
+  // Only metainfo is rewritten, so files are mostly io bound.
+#pragma omp parallel for schedule(dynamic) num_threads(task.threads) \
+    reduction(+ : fail_counter, update_counter)
+  for (int64_t idx = 0; idx < int64_t(task.files.size()); idx++) {
+    const std::string &src_name = task.files[idx];
     std::string dst_path = src_name;
 
     if (task.keep) {
@@ -48,26 +53,22 @@ bool run_update(const task_update &task) noexcept {
     }
 
     std::string err;
+    bool updated = false;
 
-    libHybractal::hybf_archive archive =
-        libHybractal::hybf_archive::load(src_name, &err);
-
-    if (!err.empty()) {
-      cout << fmt::format("Failed to load {}, detail: {}\n", src_name, err);
+    if (!libHybractal::hybf_archive::update_file(src_name, dst_path, &updated,
+                                                 &err, !task.no_mapping)) {
+      cout << fmt::format("Failed to update {} to {}, detail: {}\n", src_name,
+                          dst_path, err);
       fail_counter++;
       continue;
     }
-
-    if (archive.metainfo().generation() == 1) {
-      continue;
-    }
-
-    if (!archive.save(dst_path)) {
-      cout << fmt::format("Failed to save {} to {}.\n", src_name, dst_path);
-      fail_counter++;
-      continue;
+    if (updated) {
+      update_counter++;
     }
   }
 
+  cout << fmt::format("{} of {} files are updated.", update_counter,
+                      task.files.size())
+       << endl;
   return (fail_counter == 0);
-}
\ No newline at end of file
+}
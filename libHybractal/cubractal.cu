@@ -14,7 +14,8 @@ libHybractal::cubractal_resource::cubractal_resource(size_t __rows,
     return;
   }
   cudaError_t err;
-  err = cudaMalloc(&this->gpu_age, elements * sizeof(uint16_t));
+  // large enough for uint32 ages
+  err = cudaMalloc(&this->gpu_age, elements * sizeof(uint32_t));
   if (err != cudaSuccess) {
     return;
   }
@@ -61,8 +62,9 @@ struct cuda_wind {
 
 template <typename flt_t>
 void __global__ compute_by_block(std::array<int, 2> size_rc, cuda_wind wind,
-                                 uint16_t maxit, uint16_t *age_ptr,
-                                 cuDoubleComplex *z_ptr) {
+                                 int maxit, void *age_ptr,
+                                 libHybractal::age_format afmt, void *z_ptr,
+                                 libHybractal::z_format zfmt) {
   // x+ <=> c+
   // y+ <=> r+
 
@@ -79,71 +81,66 @@ void __global__ compute_by_block(std::array<int, 2> size_rc, cuda_wind wind,
 
   cplx_t z{0, 0};
 
-  int age = DECLARE_HYBRACTAL_SEQUENCE(
+  const int age = DECLARE_HYBRACTAL_SEQUENCE(
       HYBRACTAL_SEQUENCE_STR)::compute_age<float_t, cplx_t>(z, C, maxit);
-  if (age < 0) {
-    age = UINT16_MAX;
-  }
 
   const int global_idx = r * size_rc[1] + c;
-  age_ptr[global_idx] = age;
+  libHybractal::store_age(age_ptr, global_idx, afmt, age);
   if (z_ptr != nullptr) {
-    z_ptr[global_idx] = {z.real(), z.imag()};
+    libHybractal::store_z(z_ptr, global_idx, zfmt, double(z.real()),
+                          double(z.imag()));
   }
   // cudaErrorAssert(r >= 0 && r < size_rc[0]);
 }
 
 template <typename float_t>
 void compute_and_store(const std::complex<float_t> &C, std::array<int, 2> rc,
-                       const uint16_t maxit,
-                       fractal_utils::fractal_map &map_age_u16,
+                       const int maxit,
+                       fractal_utils::fractal_map &map_age,
                        fractal_utils::fractal_map *map_z) noexcept {
   using namespace libHybractal;
   std::complex<float_t> z{0, 0};
-  int age = DECLARE_HYBRACTAL_SEQUENCE(
+  const int age = DECLARE_HYBRACTAL_SEQUENCE(
       HYBRACTAL_SEQUENCE_STR)::compute_age<float_t>(z, C, maxit);
 
-  if (age < 0) {
-    age = UINT16_MAX;
-  }
   const int r = rc[0];
   const int c = rc[1];
-  map_age_u16.at<uint16_t>(r, c) = static_cast<uint16_t>(age);
+  store_age(map_age.data, r * map_age.cols + c,
+            age_format_of(map_age.element_bytes).value(), age);
   if (map_z != nullptr) {
-    map_z->at<std::complex<hybf_store_t>>(r, c).real(double(z.real()));
-    map_z->at<std::complex<hybf_store_t>>(r, c).imag(double(z.imag()));
+    store_z(*map_z, r, c, double(z.real()), double(z.imag()));
   }
 }
 
 template <typename float_t>
 void compute_rest(const fractal_utils::center_wind<float_t> &wind_C,
-                  const uint16_t maxit, fractal_utils::fractal_map &map_age_u16,
+                  const int maxit, fractal_utils::fractal_map &map_age,
                   fractal_utils::fractal_map *map_z_nullable,
                   std::array<int, 2> rest_rc_start) noexcept {
 
   const std::complex<float_t> left_top{wind_C.left_top_corner()[0],
                                        wind_C.left_top_corner()[1]};
-  const float_t r_unit = -wind_C.y_span / map_age_u16.rows;
-  const float_t c_unit = wind_C.x_span / map_age_u16.cols;
+  const float_t r_unit = -wind_C.y_span / map_age.rows;
+  const float_t c_unit = wind_C.x_span / map_age.cols;
 
 #pragma omp parallel for schedule(dynamic)
-  for (int r = 0; r < map_age_u16.rows; r++) {
-    for (int c = rest_rc_start[1]; c < map_age_u16.cols; c++) {
+  for (int r = 0; r < map_age.rows; r++) {
+    for (int c = rest_rc_start[1]; c < map_age.cols; c++) {
       const float_t real = left_top.real() + c * c_unit;
       const float_t imag = left_top.imag() + r * r_unit;
 
-      compute_and_store<float_t>({real, imag}, {r, c}, maxit, map_age_u16,
+      compute_and_store<float_t>({real, imag}, {r, c}, maxit, map_age,
                                  map_z_nullable);
     }
   }
 
 #pragma omp parallel for schedule(dynamic)
   for (int c = 0; c < rest_rc_start[1]; c++) {
-    for (int r = rest_rc_start[0]; r < map_age_u16.rows; r++) {
+    for (int r = rest_rc_start[0]; r < map_age.rows; r++) {
       const float_t real = left_top.real() + c * c_unit;
       const float_t imag = left_top.imag() + r * r_unit;
 
-      compute_and_store<float_t>({real, imag}, {r, c}, maxit, map_age_u16,
+      compute_and_store<float_t>({real, imag}, {r, c}, maxit, map_age,
                                  map_z_nullable);
     }
   }
@@ -151,8 +148,8 @@ void compute_rest(const fractal_utils::center_wind<float_t> &wind_C,
 
 std::string
 libHybractal::compute_frame_cuda(const fractal_utils::wind_base &wind_C,
-                                 int precision, const uint16_t maxit,
-                                 fractal_utils::fractal_map &map_age_u16,
+                                 int precision, const int maxit,
+                                 fractal_utils::fractal_map &map_age,
                                  fractal_utils::fractal_map *map_z_nullable,
                                  cubractal_resource &gpu_rcs) noexcept {
 
@@ -165,20 +162,34 @@ libHybractal::compute_frame_cuda(const fractal_utils::wind_base &wind_C,
     return fmt::format("gpu_rcs is invalid");
   }
 
-  if (map_age_u16.rows != gpu_rcs.rows() ||
-      map_age_u16.cols != gpu_rcs.cols()) {
-    return fmt::format("Size mismatch. Size of map_age_u16 is [{}, {}], but "
+  if (map_age.rows != gpu_rcs.rows() ||
+      map_age.cols != gpu_rcs.cols()) {
+    return fmt::format("Size mismatch. Size of map_age is [{}, {}], but "
                        "size of gpu_rcs is [{}, {}]",
-                       map_age_u16.rows, map_age_u16.cols, gpu_rcs.rows(),
+                       map_age.rows, map_age.cols, gpu_rcs.rows(),
                        gpu_rcs.cols());
   }
 
+  const auto afmt = libHybractal::age_format_of(map_age.element_bytes);
+  if (!afmt.has_value() ||
+      libHybractal::age_format_for_maxit(maxit) > afmt.value()) {
+    return fmt::format("maxit {} doesn't fit in ages of {} bytes.", maxit,
+                       map_age.element_bytes);
+  }
+
+  libHybractal::z_format zfmt = libHybractal::z_format::f64;
   if (map_z_nullable != nullptr) {
-    if (map_age_u16.rows != map_z_nullable->rows ||
-        map_age_u16.cols != map_z_nullable->cols) {
-      return fmt::format("Size mismatch. Size of map_age_u16 is [{}, {}], but "
+    auto temp = libHybractal::z_format_of(map_z_nullable->element_bytes);
+    if (!temp.has_value()) {
+      return fmt::format("Invalid element bytes {} of map_z.",
+                         map_z_nullable->element_bytes);
+    }
+    zfmt = temp.value();
+    if (map_age.rows != map_z_nullable->rows ||
+        map_age.cols != map_z_nullable->cols) {
+      return fmt::format("Size mismatch. Size of map_age is [{}, {}], but "
                          "size of map_z is [{}, {}]",
-                         map_age_u16.rows, map_age_u16.cols,
+                         map_age.rows, map_age.cols,
                          map_z_nullable->rows, map_z_nullable->cols);
     }
   }
@@ -186,35 +197,36 @@ libHybractal::compute_frame_cuda(const fractal_utils::wind_base &wind_C,
   constexpr int blk_rows = 8;
   constexpr int blk_cols = 8;
 
-  const int row_num = map_age_u16.rows / blk_rows;
-  const int col_num = map_age_u16.cols / blk_cols;
+  const int row_num = map_age.rows / blk_rows;
+  const int col_num = map_age.cols / blk_cols;
 
-  const double r_unit = -wind_C.displayed_y_span() / map_age_u16.rows;
-  const double c_unit = wind_C.displayed_x_span() / map_age_u16.cols;
+  const double r_unit = -wind_C.displayed_y_span() / map_age.rows;
+  const double c_unit = wind_C.displayed_x_span() / map_age.cols;
 
   cuda_complex_t<double> left_top{wind_C.displayed_left_top_corner()[0],
                                   wind_C.displayed_left_top_corner()[1]};
-  std::array<int, 2> size_rc{(int)map_age_u16.rows, (int)map_age_u16.cols};
-  cuDoubleComplex *const gpu_ptr_z =
-      (cuDoubleComplex *)((map_z_nullable != nullptr) ? (gpu_rcs.data_z_gpu())
-                                                      : (nullptr));
+  std::array<int, 2> size_rc{(int)map_age.rows, (int)map_age.cols};
+  // The kernel stores z in the format of map_z directly, so compact formats
+  // also take less bytes to copy back.
+  void *const gpu_ptr_z =
+      (map_z_nullable != nullptr) ? (gpu_rcs.data_z_gpu()) : (nullptr);
   if (precision == 1) {
     compute_by_block<float>
         <<<dim3(col_num, row_num), dim3(blk_cols, blk_rows)>>>(
             size_rc, {left_top, r_unit, c_unit}, maxit, gpu_rcs.data_age_gpu(),
-            gpu_ptr_z);
+            afmt.value(), gpu_ptr_z, zfmt);
   } else {
 
     compute_by_block<double>
         <<<dim3(col_num, row_num), dim3(blk_cols, blk_rows)>>>(
             size_rc, {left_top, r_unit, c_unit}, maxit, gpu_rcs.data_age_gpu(),
-            gpu_ptr_z);
+            afmt.value(), gpu_ptr_z, zfmt);
   }
 
   cudaError_t err;
 
-  err = cudaMemcpy(map_age_u16.data, gpu_rcs.data_age_gpu(),
-                   map_age_u16.byte_count(),
+  err = cudaMemcpy(map_age.data, gpu_rcs.data_age_gpu(),
+                   map_age.byte_count(),
                    cudaMemcpyKind::cudaMemcpyDeviceToHost);
   if (err != cudaSuccess) {
     return fmt::format("cudaMemcpy failed to copy map_age with error code {}",
@@ -232,17 +244,17 @@ libHybractal::compute_frame_cuda(const fractal_utils::wind_base &wind_C,
     }
   }
 
-  const int rest_row_start = map_age_u16.rows - row_num * blk_rows;
-  const int rest_col_start = map_age_u16.cols - col_num * blk_cols;
+  const int rest_row_start = map_age.rows - row_num * blk_rows;
+  const int rest_col_start = map_age.cols - col_num * blk_cols;
 
   if (precision == 1) {
     compute_rest<float>(
         dynamic_cast<const fractal_utils::center_wind<float> &>(wind_C), maxit,
-        map_age_u16, map_z_nullable, {rest_row_start, rest_col_start});
+        map_age, map_z_nullable, {rest_row_start, rest_col_start});
   } else {
     compute_rest<double>(
         dynamic_cast<const fractal_utils::center_wind<double> &>(wind_C), maxit,
-        map_age_u16, map_z_nullable, {rest_row_start, rest_col_start});
+        map_age, map_z_nullable, {rest_row_start, rest_col_start});
   }
 
   return {};
@@ -8,7 +8,8 @@ class cubractal_resource {
  private:
   size_t _rows{0};
   size_t _cols{0};
-  uint16_t *gpu_age{nullptr};
+  // uint16 or uint32 ages
+  void *gpu_age{nullptr};
   std::complex<double> *gpu_z{nullptr};
 
  public:
@@ -16,8 +17,8 @@ class cubractal_resource {
   inline size_t cols() const noexcept { return this->_cols; }
   inline size_t size() const noexcept { return this->_rows * this->_cols; }
 
-  inline uint16_t *data_age_gpu() noexcept { return this->gpu_age; }
-  inline const uint16_t *data_age_gpu() const noexcept { return this->gpu_age; }
+  inline void *data_age_gpu() noexcept { return this->gpu_age; }
+  inline const void *data_age_gpu() const noexcept { return this->gpu_age; }
 
   inline std::complex<double> *data_z_gpu() noexcept { return this->gpu_z; }
   inline const std::complex<double> *data_z_gpu() const noexcept {
@@ -40,8 +41,8 @@ class cubractal_resource {
 };
 
 std::string compute_frame_cuda(const fractal_utils::wind_base &wind_C,
-                               int precision, const uint16_t maxit,
-                               fractal_utils::fractal_map &map_age_u16,
+                               int precision, const int maxit,
+                               fractal_utils::fractal_map &map_age,
                                fractal_utils::fractal_map *map_z_nullable,
                                cubractal_resource &gpu_rcs) noexcept;
 }  // namespace libHybractal
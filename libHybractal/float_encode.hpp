@@ -301,7 +301,9 @@ std::optional<size_t> encode_array2(const std::array<flt_t, 2> &src, void *dst,
                                     size_t capacity) noexcept {
   try {
     auto first_bytes = encode_float(src[0], dst, capacity).value();
-    auto next_bytes = encode_float(src[1], dst, capacity - first_bytes).value();
+    auto next_bytes = encode_float(src[1], (uint8_t *)dst + first_bytes,
+                                   capacity - first_bytes)
+                          .value();
     return first_bytes + next_bytes;
   } catch (...) {
     return std::nullopt;
@@ -0,0 +1,488 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fmt/format.h>
+
+#include <cmath>
+#include <cstring>
+
+#include "libHybfile.h"
+
+namespace {
+
+inline int paeth_predict(int a, int b, int c) noexcept {
+  const int p = a + b - c;
+  const int pa = std::abs(p - a);
+  const int pb = std::abs(p - b);
+  const int pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  if (pb <= pc) {
+    return b;
+  }
+  return c;
+}
+
+// Residuals wrap around, so the transform is exactly reversible.
+void paeth_encode(const uint16_t *src, size_t rows, size_t cols,
+                  uint16_t *dst) noexcept {
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t c = 0; c < cols; c++) {
+      const int a = (c > 0) ? src[r * cols + c - 1] : 0;
+      const int b = (r > 0) ? src[(r - 1) * cols + c] : 0;
+      const int d = (r > 0 && c > 0) ? src[(r - 1) * cols + c - 1] : 0;
+      dst[r * cols + c] = uint16_t(src[r * cols + c] - paeth_predict(a, b, d));
+    }
+  }
+}
+
+void paeth_decode(uint16_t *data, size_t rows, size_t cols) noexcept {
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t c = 0; c < cols; c++) {
+      const int a = (c > 0) ? data[r * cols + c - 1] : 0;
+      const int b = (r > 0) ? data[(r - 1) * cols + c] : 0;
+      const int d = (r > 0 && c > 0) ? data[(r - 1) * cols + c - 1] : 0;
+      data[r * cols + c] = uint16_t(data[r * cols + c] + paeth_predict(a, b, d));
+    }
+  }
+}
+
+// A run of UINT16_MAX (pixels that never escaped) becomes {UINT16_MAX,
+// length}, other values are kept.
+void rle_encode(const uint16_t *src, size_t count,
+                std::vector<uint16_t> &dst) noexcept {
+  dst.clear();
+  dst.reserve(count);
+  for (size_t i = 0; i < count;) {
+    if (src[i] != UINT16_MAX) {
+      dst.emplace_back(src[i]);
+      i++;
+      continue;
+    }
+    size_t len = 0;
+    while (i + len < count && src[i + len] == UINT16_MAX &&
+           len < UINT16_MAX) {
+      len++;
+    }
+    dst.emplace_back(UINT16_MAX);
+    dst.emplace_back(uint16_t(len));
+    i += len;
+  }
+}
+
+bool rle_decode(const uint16_t *src, size_t src_count, uint16_t *dst,
+                size_t count) noexcept {
+  size_t out = 0;
+  for (size_t i = 0; i < src_count; i++) {
+    if (src[i] != UINT16_MAX) {
+      if (out >= count) {
+        return false;
+      }
+      dst[out++] = src[i];
+      continue;
+    }
+    if (i + 1 >= src_count) {
+      return false;
+    }
+    const size_t len = src[++i];
+    if (out + len > count) {
+      return false;
+    }
+    std::fill_n(dst + out, len, UINT16_MAX);
+    out += len;
+  }
+  return out == count;
+}
+
+// Split complex numbers into a plane of real and a plane of imag parts, and
+// xor every value with its left neighbor in the same plane. Neighbors share
+// the sign, exponent and leading mantissa bits, which then become zeros.
+// word_t is half of an element, so z_norm_angle is split into norm and angle.
+template <typename word_t>
+void planar_xor_encode(const uint8_t *src, size_t count,
+                       uint8_t *dst) noexcept {
+  word_t *const re = reinterpret_cast<word_t *>(dst);
+  word_t *const im = re + count;
+  word_t prev_re = 0, prev_im = 0;
+  for (size_t i = 0; i < count; i++) {
+    word_t val[2];
+    memcpy(val, src + i * sizeof(val), sizeof(val));
+    re[i] = val[0] ^ prev_re;
+    im[i] = val[1] ^ prev_im;
+    prev_re = val[0];
+    prev_im = val[1];
+  }
+}
+
+template <typename word_t>
+void planar_xor_decode(const uint8_t *src, size_t count,
+                       uint8_t *dst) noexcept {
+  const word_t *const re = reinterpret_cast<const word_t *>(src);
+  const word_t *const im = re + count;
+  word_t prev_re = 0, prev_im = 0;
+  for (size_t i = 0; i < count; i++) {
+    prev_re ^= re[i];
+    prev_im ^= im[i];
+    const word_t val[2]{prev_re, prev_im};
+    memcpy(dst + i * sizeof(val), val, sizeof(val));
+  }
+}
+
+void planar_xor_encode(const uint8_t *src, size_t count, size_t element_bytes,
+                       uint8_t *dst) noexcept {
+  switch (element_bytes) {
+    case 4:
+      planar_xor_encode<uint16_t>(src, count, dst);
+      break;
+    case 8:
+      planar_xor_encode<uint32_t>(src, count, dst);
+      break;
+    default:
+      planar_xor_encode<uint64_t>(src, count, dst);
+  }
+}
+
+void planar_xor_decode(const uint8_t *src, size_t count, size_t element_bytes,
+                       uint8_t *dst) noexcept {
+  switch (element_bytes) {
+    case 4:
+      planar_xor_decode<uint16_t>(src, count, dst);
+      break;
+    case 8:
+      planar_xor_decode<uint32_t>(src, count, dst);
+      break;
+    default:
+      planar_xor_decode<uint64_t>(src, count, dst);
+  }
+}
+
+constexpr uint32_t quantize_escape = UINT32_MAX;
+
+// SZ-style error-bounded quantization. Each value is predicted by the
+// reconstructed left neighbor (the upper one at column 0), and the residual is
+// quantized with a bin of 2*tolerance, so the reconstructed value differs by
+// at most tolerance. Codes are zigzag encoded. Values that can't be
+// quantized, such as inf, nan or very large residuals, are escaped and
+// appended as raw doubles.
+void quantize_encode(const uint8_t *src, size_t rows, size_t cols,
+                     double tolerance, std::vector<uint8_t> &dst) noexcept {
+  const size_t count = rows * cols;
+  const double bin = 2 * tolerance;
+  thread_local std::vector<double> recon;
+  thread_local std::vector<double> outliers;
+  recon.resize(count);
+  outliers.clear();
+  dst.resize(2 * count * sizeof(uint32_t));
+  uint32_t *const codes = reinterpret_cast<uint32_t *>(dst.data());
+
+  for (size_t part = 0; part < 2; part++) {
+    for (size_t i = 0; i < count; i++) {
+      double val;
+      memcpy(&val, src + (2 * i + part) * sizeof(double), sizeof(double));
+
+      double pred = 0;
+      if (i % cols != 0) {
+        pred = recon[i - 1];
+      } else if (i >= cols) {
+        pred = recon[i - cols];
+      }
+
+      const double q = std::round((val - pred) / bin);
+      uint32_t code = quantize_escape;
+      if (std::isfinite(q) && std::abs(q) < double(1 << 30)) {
+        const int32_t qi = int32_t(q);
+        const double r = pred + qi * bin;
+        if (std::abs(r - val) <= tolerance) {
+          code = (uint32_t(qi) << 1) ^ uint32_t(qi >> 31);
+          recon[i] = r;
+        }
+      }
+      if (code == quantize_escape) {
+        outliers.emplace_back(val);
+        recon[i] = val;
+      }
+      codes[part * count + i] = code;
+    }
+  }
+
+  const size_t code_bytes = dst.size();
+  dst.resize(code_bytes + outliers.size() * sizeof(double));
+  memcpy(dst.data() + code_bytes, outliers.data(),
+         outliers.size() * sizeof(double));
+}
+
+bool quantize_decode(const uint8_t *src, size_t src_bytes, size_t rows,
+                     size_t cols, double tolerance, uint8_t *dst) noexcept {
+  const size_t count = rows * cols;
+  const size_t code_bytes = 2 * count * sizeof(uint32_t);
+  if (src_bytes < code_bytes || (src_bytes - code_bytes) % sizeof(double)) {
+    return false;
+  }
+  const double bin = 2 * tolerance;
+  const uint8_t *outlier = src + code_bytes;
+  const uint8_t *const outlier_end = src + src_bytes;
+  thread_local std::vector<double> recon;
+  recon.resize(count);
+
+  for (size_t part = 0; part < 2; part++) {
+    for (size_t i = 0; i < count; i++) {
+      uint32_t code;
+      memcpy(&code, src + (part * count + i) * sizeof(uint32_t),
+             sizeof(code));
+      if (code == quantize_escape) {
+        if (outlier >= outlier_end) {
+          return false;
+        }
+        memcpy(&recon[i], outlier, sizeof(double));
+        outlier += sizeof(double);
+      } else {
+        double pred = 0;
+        if (i % cols != 0) {
+          pred = recon[i - 1];
+        } else if (i >= cols) {
+          pred = recon[i - cols];
+        }
+        const int32_t qi = int32_t(code >> 1) ^ -int32_t(code & 1);
+        recon[i] = pred + qi * bin;
+      }
+      memcpy(dst + (2 * i + part) * sizeof(double), &recon[i],
+             sizeof(double));
+    }
+  }
+  return outlier == outlier_end;
+}
+
+// Group the k-th byte of every word together.
+void shuffle(const uint8_t *src, size_t bytes, size_t word_bytes,
+             uint8_t *dst) noexcept {
+  const size_t words = bytes / word_bytes;
+  for (size_t b = 0; b < word_bytes; b++) {
+    for (size_t i = 0; i < words; i++) {
+      dst[b * words + i] = src[i * word_bytes + b];
+    }
+  }
+  // a tail that is not a whole word is kept
+  memcpy(dst + words * word_bytes, src + words * word_bytes,
+         bytes - words * word_bytes);
+}
+
+void unshuffle(const uint8_t *src, size_t bytes, size_t word_bytes,
+               uint8_t *dst) noexcept {
+  const size_t words = bytes / word_bytes;
+  for (size_t b = 0; b < word_bytes; b++) {
+    for (size_t i = 0; i < words; i++) {
+      dst[i * word_bytes + b] = src[b * words + i];
+    }
+  }
+  memcpy(dst + words * word_bytes, src + words * word_bytes,
+         bytes - words * word_bytes);
+}
+
+}  // namespace
+
+std::string libHybractal::filter_names(uint8_t filters) noexcept {
+  std::string ret;
+  for (auto [flag, name] : {std::make_pair(filter_rle, "rle"),
+                            std::make_pair(filter_paeth, "paeth"),
+                            std::make_pair(filter_planar_xor, "planar-xor"),
+                            std::make_pair(filter_quantize, "quantize"),
+                            std::make_pair(filter_shuffle, "shuffle")}) {
+    if (filters & flag) {
+      if (!ret.empty()) {
+        ret += ',';
+      }
+      ret += name;
+    }
+  }
+  if (ret.empty()) {
+    ret = "none";
+  }
+  return ret;
+}
+
+std::optional<uint8_t> libHybractal::parse_filters(
+    std::string_view names) noexcept {
+  uint8_t ret = 0;
+  while (!names.empty()) {
+    const size_t pos = names.find(',');
+    const std::string_view name = names.substr(0, pos);
+    if (name == "rle") {
+      ret |= filter_rle;
+    } else if (name == "paeth") {
+      ret |= filter_paeth;
+    } else if (name == "planar-xor") {
+      ret |= filter_planar_xor;
+    } else if (name == "shuffle") {
+      ret |= filter_shuffle;
+    } else if (name != "none") {
+      return std::nullopt;
+    }
+    if (pos == names.npos) {
+      break;
+    }
+    names.remove_prefix(pos + 1);
+  }
+  return ret;
+}
+
+bool libHybractal::check_filters(uint8_t filters, size_t element_bytes,
+                                 std::string &err) noexcept {
+  if (filters & ~uint8_t(filter_rle | filter_paeth | filter_planar_xor |
+                         filter_quantize | filter_shuffle)) {
+    err = fmt::format("Unknown filter flags {:#x}.", filters);
+    return false;
+  }
+  if ((filters & (filter_rle | filter_paeth)) && element_bytes != 2) {
+    err = "rle and paeth only apply to uint16 matrices.";
+    return false;
+  }
+  if ((filters & filter_rle) && (filters & filter_paeth)) {
+    err = "rle and paeth can not be used together.";
+    return false;
+  }
+  if ((filters & filter_planar_xor) && element_bytes != 16 &&
+      element_bytes != 8 && element_bytes != 4) {
+    err = "planar-xor only applies to z matrices.";
+    return false;
+  }
+  if ((filters & filter_quantize) && element_bytes != 16) {
+    err = "quantize only applies to complex<double> matrices.";
+    return false;
+  }
+  if ((filters & filter_quantize) && (filters & filter_planar_xor)) {
+    err = "quantize and planar-xor can not be used together.";
+    return false;
+  }
+  return true;
+}
+
+size_t libHybractal::filtered_bytes_bound(uint8_t filters,
+                                          size_t raw_bytes) noexcept {
+  if (filters & filter_rle) {
+    // every UINT16_MAX may turn into 2 values
+    return 2 * raw_bytes;
+  }
+  if (filters & filter_quantize) {
+    // 8 bytes of codes for each element, and 16 more if both parts escape
+    return raw_bytes * 3 / 2;
+  }
+  return raw_bytes;
+}
+
+void libHybractal::encode_filters(const void *src, size_t rows, size_t cols,
+                                  size_t element_bytes, uint8_t filters,
+                                  double tolerance,
+                                  std::vector<uint8_t> &dst) noexcept {
+  const size_t count = rows * cols;
+  thread_local std::vector<uint8_t> temp;
+  thread_local std::vector<uint16_t> rle;
+
+  const uint8_t *cur = reinterpret_cast<const uint8_t *>(src);
+  size_t cur_bytes = count * element_bytes;
+
+  if (filters & filter_rle) {
+    rle_encode(reinterpret_cast<const uint16_t *>(cur), count, rle);
+    cur = reinterpret_cast<const uint8_t *>(rle.data());
+    cur_bytes = rle.size() * sizeof(uint16_t);
+  }
+
+  if (filters & filter_paeth) {
+    temp.resize(cur_bytes);
+    paeth_encode(reinterpret_cast<const uint16_t *>(cur), rows, cols,
+                 reinterpret_cast<uint16_t *>(temp.data()));
+    cur = temp.data();
+  }
+
+  size_t word_bytes = element_bytes;
+  if (filters & filter_planar_xor) {
+    temp.resize(cur_bytes);
+    planar_xor_encode(cur, count, element_bytes, temp.data());
+    cur = temp.data();
+    word_bytes = element_bytes / 2;
+  }
+
+  if (filters & filter_quantize) {
+    quantize_encode(cur, rows, cols, tolerance, temp);
+    cur = temp.data();
+    cur_bytes = temp.size();
+    word_bytes = sizeof(uint32_t);
+  }
+
+  dst.resize(cur_bytes);
+  if (filters & filter_shuffle) {
+    shuffle(cur, cur_bytes, word_bytes, dst.data());
+  } else {
+    memcpy(dst.data(), cur, cur_bytes);
+  }
+}
+
+bool libHybractal::decode_filters(const void *src, size_t src_bytes,
+                                  size_t rows, size_t cols,
+                                  size_t element_bytes, uint8_t filters,
+                                  double tolerance, void *dst) noexcept {
+  const size_t count = rows * cols;
+  const size_t raw_bytes = count * element_bytes;
+  thread_local std::vector<uint8_t> temp;
+
+  if (!(filters & (filter_rle | filter_quantize)) && src_bytes != raw_bytes) {
+    return false;
+  }
+
+  const uint8_t *cur = reinterpret_cast<const uint8_t *>(src);
+  if (filters & filter_shuffle) {
+    size_t word_bytes = element_bytes;
+    if (filters & filter_planar_xor) {
+      word_bytes = element_bytes / 2;
+    }
+    if (filters & filter_quantize) {
+      word_bytes = sizeof(uint32_t);
+    }
+    temp.resize(src_bytes);
+    unshuffle(cur, src_bytes, word_bytes, temp.data());
+    cur = temp.data();
+  }
+
+  if (filters & filter_quantize) {
+    return quantize_decode(cur, src_bytes, rows, cols, tolerance,
+                           reinterpret_cast<uint8_t *>(dst));
+  }
+
+  if (filters & filter_planar_xor) {
+    planar_xor_decode(cur, count, element_bytes,
+                      reinterpret_cast<uint8_t *>(dst));
+    return true;
+  }
+
+  if (filters & filter_rle) {
+    if (src_bytes % sizeof(uint16_t) != 0) {
+      return false;
+    }
+    return rle_decode(reinterpret_cast<const uint16_t *>(cur),
+                      src_bytes / sizeof(uint16_t),
+                      reinterpret_cast<uint16_t *>(dst), count);
+  }
+
+  if (cur != dst) {
+    memcpy(dst, cur, raw_bytes);
+  }
+  if (filters & filter_paeth) {
+    paeth_decode(reinterpret_cast<uint16_t *>(dst), rows, cols);
+  }
+  return true;
+}
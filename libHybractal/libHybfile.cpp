@@ -19,41 +19,193 @@ This file is part of Hybractal.
 #include <fmt/format.h>
 #include <hex_convert.h>
 
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 
 #include "float_encode.hpp"
 #include "libHybfile.h"
 
 libHybractal::hybf_archive::hybf_archive(size_t rows, size_t cols,
-                                         bool have_z) {
+                                         bool have_z, z_format zfmt,
+                                         age_format afmt)
+    : age_fmt(afmt), z_fmt(zfmt) {
   this->m_info.rows = rows;
   this->m_info.cols = cols;
-  this->data_age.resize(rows * cols);
+  this->data_age.resize(rows * cols * age_element_bytes(afmt));
   if (have_z) {
-    this->data_z.resize(rows * cols);
+    this->data_z.resize(rows * cols * z_element_bytes(zfmt));
+  }
+}
+
+libHybractal::hybf_archive::hybf_archive(const hybf_archive &src)
+    : m_info(src.m_info),
+      data_age(src.data_age),
+      age_fmt(src.age_fmt),
+      data_z(src.data_z),
+      z_fmt(src.z_fmt),
+      m_stats(src.m_stats),
+      mapping(src.mapping),
+      mapped_age(src.mapped_age),
+      mapped_z(src.mapped_z) {
+  this->detach_mapping();
+}
+
+libHybractal::hybf_archive &libHybractal::hybf_archive::operator=(
+    const hybf_archive &src) {
+  if (this != &src) {
+    *this = hybf_archive{src};
+  }
+  return *this;
+}
+
+void libHybractal::hybf_archive::detach_mapping() noexcept {
+  if (this->mapping == nullptr) {
+    return;
+  }
+  if (this->mapped_age != nullptr) {
+    const auto age = this->age_storage();
+    this->data_age.assign(age.begin(), age.end());
+    this->mapped_age = nullptr;
+  }
+  if (this->mapped_z != nullptr) {
+    const auto z = this->z_storage();
+    this->data_z.assign(z.begin(), z.end());
+    this->mapped_z = nullptr;
   }
+  this->mapping.reset();
 }
 
+#include <lz4.h>
+#include <lz4hc.h>
 #include <zstd.h>
 
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+#include <memory>
+
+namespace {
+
+// Contexts are expensive to create, keep one for each thread.
+ZSTD_CCtx *thread_zstd_cctx() noexcept {
+  thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx{
+      ZSTD_createCCtx(), &ZSTD_freeCCtx};
+  return cctx.get();
+}
+
+ZSTD_DCtx *thread_zstd_dctx() noexcept {
+  thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx{
+      ZSTD_createDCtx(), &ZSTD_freeDCtx};
+  return dctx.get();
+}
+
+void *thread_lz4_state(bool hc) noexcept {
+  thread_local std::vector<uint8_t> state;
+  thread_local std::vector<uint8_t> state_hc;
+  auto &ret = hc ? state_hc : state;
+  if (ret.empty()) {
+    ret.resize(hc ? LZ4_sizeofStateHC() : LZ4_sizeofState());
+  }
+  return ret.data();
+}
+
+}  // namespace
+
+std::string_view libHybractal::codec_name(hybf_codec codec) noexcept {
+  switch (codec) {
+    case hybf_codec::store:
+      return "store";
+    case hybf_codec::zstd:
+      return "zstd";
+    case hybf_codec::lz4:
+      return "lz4";
+  }
+  return "unknown";
+}
+
+std::optional<libHybractal::hybf_codec> libHybractal::parse_codec(
+    std::string_view name) noexcept {
+  for (auto codec : {hybf_codec::store, hybf_codec::zstd, hybf_codec::lz4}) {
+    if (name == codec_name(codec)) {
+      return codec;
+    }
+  }
+  return std::nullopt;
+}
+
 void libHybractal::compress(const void *src, size_t bytes,
                             std::vector<uint8_t> &dest) noexcept {
+  compress(src, bytes, dest, compress_options{});
+}
+
+void libHybractal::compress(const void *src, size_t bytes,
+                            std::vector<uint8_t> &dest,
+                            const compress_options &opt) noexcept {
   dest.clear();
-  dest.resize(ZSTD_compressBound(bytes) + 128);
+  switch (opt.codec) {
+    case hybf_codec::store:
+      dest.resize(bytes);
+      memcpy(dest.data(), src, bytes);
+      return;
 
-  const size_t size =
-      ZSTD_compress(dest.data(), dest.size(), src, bytes, ZSTD_defaultCLevel());
+    case hybf_codec::zstd: {
+      dest.resize(ZSTD_compressBound(bytes) + 128);
+      ZSTD_CCtx *const cctx = thread_zstd_cctx();
+      ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+      ZSTD_CCtx_setParameter(
+          cctx, ZSTD_c_compressionLevel,
+          (opt.level == 0) ? ZSTD_defaultCLevel() : opt.level);
+      // fails if zstd is built without multithread support, then it simply
+      // compresses on this thread.
+      ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, opt.zstd_workers);
+
+      const size_t size =
+          ZSTD_compress2(cctx, dest.data(), dest.size(), src, bytes);
+
+      if (ZSTD_isError(size) || size > dest.capacity()) {
+        std::cerr << fmt::format(
+                         "compress failed. error code = {}, error name = {}.",
+                         size, ZSTD_getErrorName(size))
+                  << std::endl;
+        abort();
+        return;
+      }
+      dest.resize(size);
+      return;
+    }
 
-  if (ZSTD_isError(size) || size > dest.capacity()) {
-    std::cerr << fmt::format(
-                     "compress failed. error code = {}, error name = {}.", size,
-                     ZSTD_getErrorName(size))
-              << std::endl;
-    abort();
-    return;
+    case hybf_codec::lz4: {
+      if (bytes > LZ4_MAX_INPUT_SIZE) {
+        std::cerr << fmt::format(
+                         "compress failed. lz4 can not compress {} bytes at "
+                         "once.",
+                         bytes)
+                  << std::endl;
+        abort();
+        return;
+      }
+      dest.resize(LZ4_compressBound(int(bytes)));
+      int size;
+      if (opt.level > 1) {
+        size = LZ4_compress_HC_extStateHC(thread_lz4_state(true), (const char *)src,
+                                          (char *)dest.data(), int(bytes),
+                                          int(dest.size()), opt.level);
+      } else {
+        size = LZ4_compress_fast_extState(thread_lz4_state(false),
+                                          (const char *)src,
+                                          (char *)dest.data(), int(bytes),
+                                          int(dest.size()), 1);
+      }
+      if (size <= 0 && bytes > 0) {
+        std::cerr << "compress failed. lz4 returned " << size << std::endl;
+        abort();
+        return;
+      }
+      dest.resize(size);
+      return;
+    }
   }
-
-  dest.resize(size);
 }
 
 void libHybractal::decompress(const void *src, size_t src_bytes,
@@ -61,7 +213,8 @@ void libHybractal::decompress(const void *src, size_t src_bytes,
   const size_t dst_bytes = ZSTD_getDecompressedSize(src, src_bytes);
   dest.resize(dst_bytes);
   const size_t capacity = dest.size();
-  const size_t ret = ZSTD_decompress(dest.data(), capacity, src, src_bytes);
+  const size_t ret = ZSTD_decompressDCtx(thread_zstd_dctx(), dest.data(),
+                                         capacity, src, src_bytes);
   if (ZSTD_isError(ret) || ret > capacity) {
     std::cerr << fmt::format(
                      "compress failed. error code = {}, error name = {}.", ret,
@@ -76,6 +229,43 @@ void libHybractal::decompress(const void *src, size_t src_bytes,
   dest.resize(ret);
 }
 
+std::optional<size_t> libHybractal::decompress(hybf_codec codec,
+                                               const void *src,
+                                               size_t src_bytes, void *dst,
+                                               size_t capacity) noexcept {
+  switch (codec) {
+    case hybf_codec::store:
+      if (src_bytes > capacity) {
+        return std::nullopt;
+      }
+      memcpy(dst, src, src_bytes);
+      return src_bytes;
+
+    case hybf_codec::zstd: {
+      const size_t ret = ZSTD_decompressDCtx(thread_zstd_dctx(), dst, capacity,
+                                             src, src_bytes);
+      if (ZSTD_isError(ret)) {
+        return std::nullopt;
+      }
+      return ret;
+    }
+
+    case hybf_codec::lz4: {
+      if (src_bytes > LZ4_MAX_INPUT_SIZE) {
+        return std::nullopt;
+      }
+      const int ret =
+          LZ4_decompress_safe((const char *)src, (char *)dst, int(src_bytes),
+                              int(std::min<size_t>(capacity, INT32_MAX)));
+      if (ret < 0) {
+        return std::nullopt;
+      }
+      return size_t(ret);
+    }
+  }
+  return std::nullopt;
+}
+
 std::vector<uint8_t> libHybractal::compress(const void *src,
                                             size_t bytes) noexcept {
   std::vector<uint8_t> result;
@@ -85,6 +275,7 @@ std::vector<uint8_t> libHybractal::compress(const void *src,
 
 #include <fractal_binfile.h>
 
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <struct_pack/struct_pack.hpp>
@@ -250,6 +441,7 @@ libHybractal::center_wind_variant_t libHybractal::make_center_wind_variant(
       err = fmt::format("Failed to decode center hex.");
       return;
     }
+    wind.center = temp.value();
     wind.x_span = flt_t(x_span);
     wind.y_span = flt_t(y_span);
   };
@@ -357,6 +549,17 @@ libHybractal::hybf_metainfo_new::parse_metainfo_gen1(
   return ret;
 }
 
+libHybractal::hybf_metainfo_new
+libHybractal::hybf_metainfo_new::parse_metainfo_gen2(
+    const void *src, size_t bytes, std::string &err) noexcept {
+  auto ret = parse_metainfo_gen1(src, bytes, err);
+  if (!err.empty()) {
+    return {};
+  }
+  ret.file_genration = 2;
+  return ret;
+}
+
 fractal_utils::wind_base *libHybractal::extract_wind_base(
     center_wind_variant_t &var) noexcept {
   switch (var.index()) {
@@ -443,60 +646,732 @@ libHybractal::hybf_ir_new libHybractal::hybf_metainfo_new::to_ir()
   return ir;
 }
 
-libHybractal::hybf_archive libHybractal::hybf_archive::load(
-    std::string_view filename, std::vector<uint8_t> &buffer, std::string *err,
-    const load_options &opt) noexcept {
-  fractal_utils::binfile bfile;
+namespace {
 
-  if (!bfile.parse_from_file(filename.data())) {
-    err->assign(fmt::format("Failed to parse {}.", filename));
-    return {};
+struct tile_rect {
+  size_t row_begin;
+  size_t col_begin;
+  size_t rows;
+  size_t cols;
+};
+
+struct tile_grid {
+  size_t rows;
+  size_t cols;
+  size_t tile_rows;
+  size_t tile_cols;
+
+  size_t tiles_per_row() const noexcept {
+    return (this->cols + this->tile_cols - 1) / this->tile_cols;
+  }
+  size_t tiles_per_col() const noexcept {
+    return (this->rows + this->tile_rows - 1) / this->tile_rows;
+  }
+  size_t tile_count() const noexcept {
+    return this->tiles_per_row() * this->tiles_per_col();
   }
 
-  const int8_t version_in_file_header = bfile.header.custom_part()[0];
+  tile_rect tile(size_t idx) const noexcept {
+    const size_t tr = idx / this->tiles_per_row();
+    const size_t tc = idx % this->tiles_per_row();
+    tile_rect ret;
+    ret.row_begin = tr * this->tile_rows;
+    ret.col_begin = tc * this->tile_cols;
+    ret.rows = std::min(this->tile_rows, this->rows - ret.row_begin);
+    ret.cols = std::min(this->tile_cols, this->cols - ret.col_begin);
+    return ret;
+  }
+};
+
+struct tiled_matrix {
+  const void *data;
+  size_t element_bytes;
+  uint8_t filters;
+  double tolerance;
+  std::vector<uint8_t> *dest;
+  std::vector<uint64_t> *tile_bytes;
+  // only for uint32 ages, see hybf_tile_index::age_tile_base
+  std::vector<uint32_t> *tile_base{nullptr};
+};
+
+// Convert a tile of uint32 ages to uint16 offsets in place, returns the base
+// or age_tile_raw if the ages span too much.
+uint32_t narrow_age_tile(std::vector<uint8_t> &tile) noexcept {
+  const size_t count = tile.size() / sizeof(uint32_t);
+  const uint32_t *const src = reinterpret_cast<const uint32_t *>(tile.data());
+  uint32_t min = UINT32_MAX, max = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (src[i] == UINT32_MAX) {
+      continue;
+    }
+    min = std::min(min, src[i]);
+    max = std::max(max, src[i]);
+  }
+  if (min == UINT32_MAX) {
+    // every pixel is inside
+    min = max = 0;
+  }
+  if (max - min >= UINT16_MAX) {
+    return libHybractal::hybf_tile_index::age_tile_raw;
+  }
 
-  hybf_archive result;
+  // the i-th offset never overwrites the j-th age with j > i
+  for (size_t i = 0; i < count; i++) {
+    uint32_t age;
+    memcpy(&age, tile.data() + i * sizeof(age), sizeof(age));
+    const uint16_t offset =
+        (age == UINT32_MAX) ? UINT16_MAX : uint16_t(age - min);
+    memcpy(tile.data() + i * sizeof(offset), &offset, sizeof(offset));
+  }
+  tile.resize(count * sizeof(uint16_t));
+  return min;
+}
+
+void widen_age_tile(const uint16_t *src, size_t count, uint32_t base,
+                    uint32_t *dst) noexcept {
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = (src[i] == UINT16_MAX) ? UINT32_MAX : base + src[i];
+  }
+}
+
+// Compress every tile of all matrices in one parallel loop, so that age and z
+// are compressed concurrently. Tiles of each matrix are concatenated into its
+// dest.
+void compress_tiles(const std::vector<tiled_matrix> &matrices,
+                    const tile_grid &grid,
+                    const libHybractal::compress_options &opt) noexcept {
+  const size_t tile_num = grid.tile_count();
+  std::vector<std::vector<uint8_t>> tiles(tile_num * matrices.size());
+  for (const auto &mat : matrices) {
+    if (mat.tile_base != nullptr) {
+      mat.tile_base->resize(tile_num);
+    }
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int64_t job = 0; job < int64_t(tiles.size()); job++) {
+    const tiled_matrix &mat = matrices[job / tile_num];
+    const size_t idx = job % tile_num;
+    thread_local std::vector<uint8_t> raw;
+    const tile_rect t = grid.tile(idx);
+    const size_t row_bytes = t.cols * mat.element_bytes;
+    raw.resize(t.rows * row_bytes);
+    for (size_t r = 0; r < t.rows; r++) {
+      const size_t src_offset =
+          ((t.row_begin + r) * grid.cols + t.col_begin) * mat.element_bytes;
+      memcpy(raw.data() + r * row_bytes,
+             reinterpret_cast<const uint8_t *>(mat.data) + src_offset,
+             row_bytes);
+    }
+    size_t element_bytes = mat.element_bytes;
+    uint8_t filters = mat.filters;
+    if (mat.tile_base != nullptr) {
+      const uint32_t base = narrow_age_tile(raw);
+      (*mat.tile_base)[idx] = base;
+      if (base != libHybractal::hybf_tile_index::age_tile_raw) {
+        element_bytes = sizeof(uint16_t);
+      } else {
+        filters &= libHybractal::filter_shuffle;
+      }
+    }
+    if (filters == 0) {
+      libHybractal::compress(raw.data(), raw.size(), tiles[job], opt);
+    } else {
+      thread_local std::vector<uint8_t> filtered;
+      libHybractal::encode_filters(raw.data(), t.rows, t.cols, element_bytes,
+                                   filters, mat.tolerance, filtered);
+      libHybractal::compress(filtered.data(), filtered.size(), tiles[job], opt);
+    }
+  }
+
+  for (size_t m = 0; m < matrices.size(); m++) {
+    auto &dest = *matrices[m].dest;
+    auto &tile_bytes = *matrices[m].tile_bytes;
+    size_t total_bytes = 0;
+    tile_bytes.resize(tile_num);
+    for (size_t idx = 0; idx < tile_num; idx++) {
+      tile_bytes[idx] = tiles[m * tile_num + idx].size();
+      total_bytes += tile_bytes[idx];
+    }
+
+    dest.clear();
+    dest.reserve(total_bytes);
+    for (size_t idx = 0; idx < tile_num; idx++) {
+      auto &tile = tiles[m * tile_num + idx];
+      dest.insert(dest.end(), tile.begin(), tile.end());
+      tile = {};
+    }
+  }
+}
+
+// Decompress the tiles that overlap with region, and copy the overlapped part
+// into dst, whose size is region.rows * region.cols.
+bool decompress_tiles(const void *src, size_t src_bytes,
+                      const std::vector<uint64_t> &tile_bytes,
+                      libHybractal::hybf_codec codec, uint8_t filters,
+                      double tolerance, const tile_grid &grid,
+                      size_t element_bytes,
+                      const tile_rect &region, void *dst,
+                      std::string &err,
+                      const std::vector<uint32_t> *tile_base = nullptr) noexcept {
+  if (tile_bytes.size() != grid.tile_count()) {
+    err = fmt::format("Expected {} tiles, but the tile index has {}.",
+                      grid.tile_count(), tile_bytes.size());
+    return false;
+  }
+  if (tile_base != nullptr && tile_base->size() != grid.tile_count()) {
+    err = fmt::format("Expected {} tile bases, but the tile index has {}.",
+                      grid.tile_count(), tile_base->size());
+    return false;
+  }
+
+  std::vector<size_t> offsets(tile_bytes.size() + 1);
+  offsets[0] = 0;
+  for (size_t idx = 0; idx < tile_bytes.size(); idx++) {
+    offsets[idx + 1] = offsets[idx] + tile_bytes[idx];
+  }
+  if (offsets.back() != src_bytes) {
+    err = fmt::format("Tiles take {} bytes, but the data block has {} bytes.",
+                      offsets.back(), src_bytes);
+    return false;
+  }
+
+  if (region.rows == 0 || region.cols == 0) {
+    return true;
+  }
+
+  std::vector<size_t> tiles_needed;
   {
-    auto blkp_meta = bfile.find_block_single(id_metainfo);
-    if (blkp_meta == nullptr) {
-      err->assign("metadata not found.");
-      return {};
+    const size_t tr_begin = region.row_begin / grid.tile_rows;
+    const size_t tr_end =
+        (region.row_begin + region.rows - 1) / grid.tile_rows + 1;
+    const size_t tc_begin = region.col_begin / grid.tile_cols;
+    const size_t tc_end =
+        (region.col_begin + region.cols - 1) / grid.tile_cols + 1;
+    for (size_t tr = tr_begin; tr < tr_end; tr++) {
+      for (size_t tc = tc_begin; tc < tc_end; tc++) {
+        tiles_needed.emplace_back(tr * grid.tiles_per_row() + tc);
+      }
     }
+  }
 
-    switch (version_in_file_header) {
-      case 0:  // The first generation, two possible formats
-      {
-        result.metainfo() = hybf_metainfo_new::parse_metainfo_gen0(
-            blkp_meta->data, blkp_meta->bytes, *err);
-        if (!err->empty()) {
-          *err = fmt::format("Failed to parse metainfo of gen 0. Detail: {}",
-                             *err);
-          return {};
-        }
-      } break;
+  std::atomic<int> fail_counter{0};
+#pragma omp parallel for schedule(dynamic)
+  for (int64_t i = 0; i < int64_t(tiles_needed.size()); i++) {
+    const size_t idx = tiles_needed[i];
+    const tile_rect t = grid.tile(idx);
+    const size_t count = t.rows * t.cols;
+
+    // narrowed uint32 ages are stored as uint16
+    size_t stored_element_bytes = element_bytes;
+    uint8_t tile_filters = filters;
+    uint32_t base = libHybractal::hybf_tile_index::age_tile_raw;
+    if (tile_base != nullptr) {
+      base = (*tile_base)[idx];
+      if (base != libHybractal::hybf_tile_index::age_tile_raw) {
+        stored_element_bytes = sizeof(uint16_t);
+      } else {
+        tile_filters &= libHybractal::filter_shuffle;
+      }
+    }
+    const size_t expected_bytes = count * stored_element_bytes;
+
+    thread_local std::vector<uint8_t> raw;
+    thread_local std::vector<uint8_t> filtered;
+    thread_local std::vector<uint8_t> narrow;
+    auto &decoded = (stored_element_bytes == element_bytes) ? raw : narrow;
+    raw.resize(count * element_bytes);
+    decoded.resize(expected_bytes);
+    const uint8_t *const tile_src =
+        reinterpret_cast<const uint8_t *>(src) + offsets[idx];
+    if (tile_filters == 0) {
+      auto bytes = libHybractal::decompress(codec, tile_src, tile_bytes[idx],
+                                            decoded.data(), decoded.size());
+      if (bytes != expected_bytes) {
+        fail_counter++;
+        continue;
+      }
+    } else {
+      filtered.resize(
+          libHybractal::filtered_bytes_bound(tile_filters, expected_bytes));
+      auto bytes = libHybractal::decompress(codec, tile_src, tile_bytes[idx],
+                                            filtered.data(), filtered.size());
+      if (!bytes.has_value() ||
+          !libHybractal::decode_filters(filtered.data(), bytes.value(), t.rows,
+                                        t.cols, stored_element_bytes,
+                                        tile_filters, tolerance,
+                                        decoded.data())) {
+        fail_counter++;
+        continue;
+      }
+    }
+    if (&decoded != &raw) {
+      widen_age_tile(reinterpret_cast<const uint16_t *>(narrow.data()), count,
+                     base, reinterpret_cast<uint32_t *>(raw.data()));
+    }
+
+    // intersection of tile and region
+    const size_t r_begin = std::max(t.row_begin, region.row_begin);
+    const size_t r_end = std::min(t.row_begin + t.rows,
+                                  region.row_begin + region.rows);
+    const size_t c_begin = std::max(t.col_begin, region.col_begin);
+    const size_t c_end = std::min(t.col_begin + t.cols,
+                                  region.col_begin + region.cols);
+    const size_t copy_bytes = (c_end - c_begin) * element_bytes;
+    for (size_t r = r_begin; r < r_end; r++) {
+      const size_t src_offset =
+          ((r - t.row_begin) * t.cols + (c_begin - t.col_begin)) *
+          element_bytes;
+      const size_t dst_offset =
+          ((r - region.row_begin) * region.cols + (c_begin - region.col_begin)) *
+          element_bytes;
+      memcpy(reinterpret_cast<uint8_t *>(dst) + dst_offset,
+             raw.data() + src_offset, copy_bytes);
+    }
+  }
+
+  if (fail_counter > 0) {
+    err = fmt::format("Failed to decompress {} tiles.", fail_counter.load());
+    return false;
+  }
+  return true;
+}
+
+bool decode_tile_index(const fractal_utils::binfile &bfile, int64_t tag,
+                       libHybractal::hybf_tile_index &index,
+                       std::string &err) noexcept {
+  auto blkp = bfile.find_block_single(tag);
+  if (blkp == nullptr) {
+    err = "tile index not found.";
+    return false;
+  }
+
+  auto code = struct_pack::deserialize_to(index, (const char *)blkp->data,
+                                          blkp->bytes);
+  if (code != struct_pack::errc::ok) {
+    err = fmt::format("Failed to deserialize tile index, detail: {}",
+                      int64_t(code));
+    return false;
+  }
+
+  if (index.tile_rows == 0 || index.tile_cols == 0) {
+    err = fmt::format("Invalid tile size [{}, {}].", index.tile_rows,
+                      index.tile_cols);
+    return false;
+  }
+  return true;
+}
+
+// A binfile is a file_header followed by blocks, each block is its tag, its
+// size and its data.
+constexpr size_t block_head_bytes = sizeof(int64_t) + sizeof(uint64_t);
+// alignment of stored matrices in the file
+constexpr size_t plain_alignment = 64;
+
+// {rows, cols} of a pyramid level
+std::array<size_t, 2> level_size(size_t rows, size_t cols,
+                                 int level) noexcept {
+  for (int l = 0; l < level; l++) {
+    rows = (rows + 1) / 2;
+    cols = (cols + 1) / 2;
+  }
+  return {rows, cols};
+}
+
+// Make bfile refer to the blocks in src without copying them, src must outlive
+// bfile. Returns false if src is not laid out as a binfile.
+bool parse_blocks(uint8_t *src, size_t bytes,
+                  fractal_utils::binfile &bfile) noexcept {
+  if (bytes < sizeof(fractal_utils::file_header)) {
+    return false;
+  }
+  memcpy(static_cast<void *>(&bfile.header), src,
+         sizeof(fractal_utils::file_header));
+  bfile.blocks.clear();
+
+  size_t offset = sizeof(fractal_utils::file_header);
+  while (offset < bytes) {
+    if (bytes - offset < block_head_bytes) {
+      return false;
+    }
+    int64_t tag;
+    uint64_t blk_bytes;
+    memcpy(&tag, src + offset, sizeof(tag));
+    memcpy(&blk_bytes, src + offset + sizeof(tag), sizeof(blk_bytes));
+    offset += block_head_bytes;
+    if (blk_bytes > bytes - offset) {
+      return false;
+    }
+    bfile.blocks.emplace_back(
+        fractal_utils::data_block{tag, blk_bytes, offset, src + offset, false});
+    offset += blk_bytes;
+  }
+  return true;
+}
 
-      case 1:  // The second generation, ir is employed, and floating points are
-        // encoded in ieee
-        result.metainfo() = hybf_metainfo_new::parse_metainfo_gen1(
-            blkp_meta->data, blkp_meta->bytes, *err);
+// Offset of the data of the next block appended to bfile.
+size_t next_block_data_offset(const fractal_utils::binfile &bfile) noexcept {
+  size_t offset = sizeof(fractal_utils::file_header);
+  for (const auto &blk : bfile.blocks) {
+    offset += block_head_bytes + blk.bytes;
+  }
+  return offset + block_head_bytes;
+}
 
-        if (!err->empty()) {
-          *err = fmt::format("Failed to parse metainfo of gen 1. Detail: {}",
-                             *err);
-          return {};
+// Blocks of bfile refer to mapping, or to buffer if the file can not be
+// mapped. If neither of them is laid out as expected, the file is parsed by
+// fractal_utils and the blocks own their data.
+bool read_blocks(std::string_view filename, bool allow_mapping,
+                 std::vector<uint8_t> &buffer, fractal_utils::binfile &bfile,
+                 std::shared_ptr<libHybractal::mapped_file> &mapping,
+                 std::string &err) noexcept {
+  mapping.reset();
+  if (allow_mapping) {
+    std::string map_err;
+    mapping = libHybractal::mapped_file::open(filename, map_err);
+    if (mapping != nullptr) {
+      if (parse_blocks(mapping->data(), mapping->size(), bfile)) {
+        return true;
+      }
+      mapping.reset();
+    } else {
+      std::ifstream ifs{std::string{filename}, std::ios::binary | std::ios::ate};
+      if (ifs) {
+        buffer.resize(size_t(ifs.tellg()));
+        ifs.seekg(0, std::ios::beg);
+        ifs.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+        if (ifs && parse_blocks(buffer.data(), buffer.size(), bfile)) {
+          return true;
         }
-        break;
-      default:
+      }
+    }
+  }
 
-        err->assign(fmt::format("Unknown generation number {} in file header.",
-                                int(version_in_file_header)));
-        return {};
+  bfile = fractal_utils::binfile{};
+  if (!bfile.parse_from_file(std::string{filename}.c_str())) {
+    err = fmt::format("Failed to parse {}.", filename);
+    return false;
+  }
+  return true;
+}
+
+// Append the checksums of all blocks in bfile as the last block. storage
+// holds the block until bfile is saved.
+void add_checksum_block(fractal_utils::binfile &bfile,
+                        std::vector<char> &storage) noexcept {
+  libHybractal::hybf_checksums checksums;
+  for (const auto &blk : bfile.blocks) {
+    if (blk.tag == libHybractal::hybf_archive::id_padding) {
+      continue;
+    }
+    checksums.tags.emplace_back(blk.tag);
+    checksums.hashes.emplace_back(XXH3_64bits(blk.data, blk.bytes));
+  }
+  storage = struct_pack::serialize(checksums);
+  bfile.blocks.emplace_back(fractal_utils::data_block{
+      libHybractal::hybf_archive::id_checksum, storage.size(), 0,
+      storage.data(), false});
+}
+
+void add_stats_block(fractal_utils::binfile &bfile,
+                     const std::optional<libHybractal::frame_stats> &stats,
+                     std::vector<char> &storage) noexcept {
+  if (!stats.has_value()) {
+    return;
+  }
+  storage = struct_pack::serialize(stats.value());
+  bfile.blocks.emplace_back(fractal_utils::data_block{
+      libHybractal::hybf_archive::id_stats, storage.size(), 0, storage.data(),
+      false});
+}
+
+// stats is empty if the file has no statistics
+bool decode_stats(const fractal_utils::binfile &bfile,
+                  std::optional<libHybractal::frame_stats> &stats,
+                  std::string &err) noexcept {
+  stats.reset();
+  auto blkp = bfile.find_block_single(libHybractal::hybf_archive::id_stats);
+  if (blkp == nullptr) {
+    return true;
+  }
+  libHybractal::frame_stats temp;
+  auto code = struct_pack::deserialize_to(temp, (const char *)blkp->data,
+                                          blkp->bytes);
+  if (code != struct_pack::errc::ok) {
+    err = fmt::format("Failed to deserialize statistics, detail: {}",
+                      int64_t(code));
+    return false;
+  }
+  if (temp.bin_width == 0) {
+    err = "Invalid bin width 0 of statistics.";
+    return false;
+  }
+  stats = std::move(temp);
+  return true;
+}
+
+// Whether blk is exactly the row major matrix, so it can be used in place. It
+// requires codec store, no filters, tiles of whole rows and alignment.
+bool is_plain_block(const fractal_utils::data_block &blk,
+                    const libHybractal::hybf_tile_index &index,
+                    uint8_t filters, size_t rows, size_t cols,
+                    size_t element_bytes) noexcept {
+  if (libHybractal::hybf_codec(index.codec) != libHybractal::hybf_codec::store ||
+      filters != 0 || index.tile_cols < cols) {
+    return false;
+  }
+  if (blk.bytes != rows * cols * element_bytes) {
+    return false;
+  }
+  return reinterpret_cast<uintptr_t>(blk.data) % element_bytes == 0;
+}
+
+// Settings of the tile index shared by all levels of a tiled file. Tile bytes
+// are filled while the matrices are compressed.
+bool make_base_index(const libHybractal::save_options &opt, bool have_z,
+                     libHybractal::z_format zfmt, libHybractal::age_format afmt,
+                     double z_tol, libHybractal::hybf_tile_index &index,
+                     std::string &err) noexcept {
+  using namespace libHybractal;
+  index = hybf_tile_index{};
+  index.tile_rows = opt.tile_rows;
+  index.tile_cols = opt.tile_cols;
+
+  index.codec = uint8_t(opt.compression.codec);
+  index.age_filters = opt.age_filters;
+  index.z_filters = have_z ? opt.z_filters : 0;
+  index.z_format = uint8_t(zfmt);
+  index.age_format = uint8_t(afmt);
+  // errors of a lossy archive that is saved again accumulate
+  index.z_tolerance = z_tol;
+  if (have_z && opt.z_tolerance > 0) {
+    index.z_filters =
+        (index.z_filters & ~uint8_t(filter_planar_xor)) | filter_quantize;
+    index.z_tolerance += opt.z_tolerance;
+  }
+  if ((opt.z_filters & filter_quantize) && !(opt.z_tolerance > 0)) {
+    err = "quantize requires a positive z_tolerance.";
+    return false;
+  }
+  return check_filters(index.age_filters, sizeof(uint16_t), err) &&
+         check_filters(index.z_filters, z_element_bytes(zfmt), err);
+}
+
+}  // namespace
+
+libHybractal::hybf_metainfo_new libHybractal::hybf_archive::parse_metainfo(
+    const fractal_utils::binfile &bfile, std::string &err) noexcept {
+  err.clear();
+  const int8_t version_in_file_header = bfile.header.custom_part()[0];
+
+  auto blkp_meta = bfile.find_block_single(id_metainfo);
+  if (blkp_meta == nullptr) {
+    err.assign("metadata not found.");
+    return {};
+  }
+
+  hybf_metainfo_new result;
+  switch (version_in_file_header) {
+    case 0:  // The first generation, two possible formats
+      result = hybf_metainfo_new::parse_metainfo_gen0(blkp_meta->data,
+                                                      blkp_meta->bytes, err);
+      break;
+    case 1:  // The second generation, ir is employed, and floating points are
+             // encoded in ieee
+      result = hybf_metainfo_new::parse_metainfo_gen1(blkp_meta->data,
+                                                      blkp_meta->bytes, err);
+      break;
+    case 2:  // The third generation, matrices are stored in tiles
+      result = hybf_metainfo_new::parse_metainfo_gen2(blkp_meta->data,
+                                                      blkp_meta->bytes, err);
+      break;
+    default:
+      err.assign(fmt::format("Unknown generation number {} in file header.",
+                             int(version_in_file_header)));
+      return {};
+  }
+
+  if (!err.empty()) {
+    err = fmt::format("Failed to parse metainfo of gen {}. Detail: {}",
+                      int(version_in_file_header), err);
+    return {};
+  }
+  return result;
+}
+
+libHybractal::hybf_metainfo_new libHybractal::hybf_archive::probe(
+    std::string_view filename, std::string *err) noexcept {
+  fractal_utils::binfile bfile;
+  std::shared_ptr<mapped_file> mapping;
+  std::vector<uint8_t> buffer;
+
+  if (!read_blocks(filename, true, buffer, bfile, mapping, *err)) {
+    return {};
+  }
+  return parse_metainfo(bfile, *err);
+}
+
+bool libHybractal::hybf_archive::verify(std::string_view filename,
+                                        std::string *err,
+                                        bool *has_checksums) noexcept {
+  if (has_checksums != nullptr) {
+    *has_checksums = false;
+  }
+  fractal_utils::binfile bfile;
+  std::shared_ptr<mapped_file> mapping;
+  std::vector<uint8_t> buffer;
+
+  if (!read_blocks(filename, true, buffer, bfile, mapping, *err)) {
+    return false;
+  }
+
+  auto blkp = bfile.find_block_single(id_checksum);
+  if (blkp == nullptr) {
+    return true;
+  }
+  if (has_checksums != nullptr) {
+    *has_checksums = true;
+  }
+  hybf_checksums checksums;
+  auto code = struct_pack::deserialize_to(checksums, (const char *)blkp->data,
+                                          blkp->bytes);
+  if (code != struct_pack::errc::ok ||
+      checksums.tags.size() != checksums.hashes.size()) {
+    *err = fmt::format("Failed to deserialize checksums, detail: {}",
+                       int64_t(code));
+    return false;
+  }
+
+  size_t checked = 0;
+  for (const auto &blk : bfile.blocks) {
+    if (blk.tag == id_checksum || blk.tag == id_padding) {
+      continue;
+    }
+    auto it = std::find(checksums.tags.begin(), checksums.tags.end(), blk.tag);
+    if (it == checksums.tags.end()) {
+      *err = fmt::format("Block {} has no checksum.", blk.tag);
+      return false;
+    }
+    const uint64_t expected = checksums.hashes[it - checksums.tags.begin()];
+    const uint64_t hash = XXH3_64bits(blk.data, blk.bytes);
+    if (hash != expected) {
+      *err = fmt::format(
+          "Checksum of block {} mismatch, expected {:016x} but it is {:016x}.",
+          blk.tag, expected, hash);
+      return false;
+    }
+    checked++;
+  }
+  if (checked != checksums.tags.size()) {
+    *err = fmt::format("{} blocks are missing.",
+                       checksums.tags.size() - checked);
+    return false;
+  }
+  return true;
+}
+
+bool libHybractal::hybf_archive::update_file(std::string_view src,
+                                             std::string_view dst,
+                                             bool *updated, std::string *err,
+                                             bool allow_mapping) noexcept {
+  *updated = false;
+  fractal_utils::binfile bfile;
+  std::shared_ptr<mapped_file> mapping;
+  std::vector<uint8_t> buffer;
+
+  if (!read_blocks(src, allow_mapping, buffer, bfile, mapping, *err)) {
+    return false;
+  }
+  hybf_metainfo_new info = parse_metainfo(bfile, *err);
+  if (!err->empty()) {
+    return false;
+  }
+  if (info.generation() >= 1) {
+    return true;
+  }
+
+  // Gen 0 and gen 1 only differ in the header and the metainfo, other blocks
+  // refer to the source and are written as they are. Blocks parsed by
+  // fractal_utils own their data, so they are viewed by another binfile
+  // instead of being modified.
+  info.update_generation();
+  std::vector<char> meta_info_seralized = struct_pack::serialize(info.to_ir());
+  fractal_utils::binfile updated_file;
+  updated_file.header = bfile.header;
+  updated_file.header.custom_part()[0] = 1;
+  for (const auto &blk : bfile.blocks) {
+    if (blk.tag == id_checksum) {
+      continue;
+    }
+    fractal_utils::data_block view = blk;
+    view.has_ownership = false;
+    if (blk.tag == id_metainfo) {
+      view.data = meta_info_seralized.data();
+      view.bytes = meta_info_seralized.size();
     }
+    updated_file.blocks.emplace_back(view);
+  }
+  std::vector<char> checksum_seralized;
+  add_checksum_block(updated_file, checksum_seralized);
+
+  // Write to a temporary file and rename it, so that dst is never left half
+  // written, and dst can be src.
+  const std::string temp_name = fmt::format("{}.updating", dst);
+  if (!updated_file.save_to_file(temp_name.c_str(), true)) {
+    *err = fmt::format("Failed to write {}.", temp_name);
+    std::error_code ec;
+    std::filesystem::remove(temp_name, ec);
+    return false;
+  }
+  updated_file = fractal_utils::binfile{};
+  bfile = fractal_utils::binfile{};
+  mapping.reset();
+
+  std::error_code ec;
+  std::filesystem::rename(temp_name, dst, ec);
+  if (ec) {
+    *err = fmt::format("Failed to rename {} to {}: {}", temp_name, dst,
+                       ec.message());
+    std::filesystem::remove(temp_name, ec);
+    return false;
+  }
+  *updated = true;
+  return true;
+}
+
+libHybractal::hybf_archive libHybractal::hybf_archive::load(
+    std::string_view filename, std::vector<uint8_t> &buffer, std::string *err,
+    const load_options &opt) noexcept {
+  fractal_utils::binfile bfile;
+  std::shared_ptr<mapped_file> mapping;
+
+  if (!read_blocks(filename, opt.binfile == nullptr, buffer, bfile, mapping,
+                   *err)) {
+    return {};
+  }
+
+  hybf_archive result;
+  result.m_info = parse_metainfo(bfile, *err);
+  if (!err->empty()) {
+    return {};
+  }
+  if (!decode_stats(bfile, result.m_stats, *err)) {
+    return {};
   }
   const size_t rows = result.rows();
   const size_t cols = result.cols();
 
-  buffer.reserve(rows * cols * sizeof(std::complex<hybf_store_t>));
+  if (result.metainfo().generation() >= 2) {
+    result.mapping = std::move(mapping);
+    if (!result.load_tiles(bfile, {0, 0, rows, cols}, opt, *err)) {
+      return {};
+    }
+
+    if (opt.binfile != nullptr) {
+      *opt.binfile = std::move(bfile);
+    }
+    return result;
+  }
 
   {
     auto blkp_age = bfile.find_block_single(id_mat_age);
@@ -506,20 +1381,22 @@ libHybractal::hybf_archive libHybractal::hybf_archive::load(
     }
 
     if (opt.compressed_age != nullptr) {
-      *opt.compressed_age = buffer;
+      opt.compressed_age->assign((const uint8_t *)blkp_age->data,
+                                 (const uint8_t *)blkp_age->data +
+                                     blkp_age->bytes);
     }
 
-    decompress(blkp_age->data, blkp_age->bytes, buffer);
+    result.age_fmt = age_format::u16;
+    if (!opt.skip_age) {
+      decompress(blkp_age->data, blkp_age->bytes, result.data_age);
 
-    if (buffer.size() != rows * cols * sizeof(uint16_t)) {
-      err->assign(fmt::format(
-          "Size of mat_age mismatch. Expected {} but in fact {} bytes.",
-          rows * cols * sizeof(uint16_t), buffer.size()));
-      return {};
+      if (result.data_age.size() != rows * cols * sizeof(uint16_t)) {
+        err->assign(fmt::format(
+            "Size of mat_age mismatch. Expected {} but in fact {} bytes.",
+            rows * cols * sizeof(uint16_t), result.data_age.size()));
+        return {};
+      }
     }
-
-    result.data_age.resize(result.rows() * result.cols());
-    memcpy(result.data_age.data(), buffer.data(), buffer.size());
   }
 
   {
@@ -531,19 +1408,24 @@ libHybractal::hybf_archive libHybractal::hybf_archive::load(
 
     if (blkp_z != nullptr) {
       if (opt.compressed_mat_z != nullptr) {
-        *opt.compressed_mat_z = buffer;
+        opt.compressed_mat_z->assign(
+            (const uint8_t *)blkp_z->data,
+            (const uint8_t *)blkp_z->data + blkp_z->bytes);
       }
+    }
 
-      decompress(blkp_z->data, blkp_z->bytes, buffer);
+    if (blkp_z != nullptr && !opt.skip_z) {
+      result.z_fmt = z_format::f64;
+      decompress(blkp_z->data, blkp_z->bytes, result.data_z);
 
-      if (buffer.size() != rows * cols * sizeof(std::complex<hybf_store_t>)) {
+      if (result.data_z.size() !=
+          rows * cols * sizeof(std::complex<hybf_store_t>)) {
         err->assign(fmt::format(
-            "Size of mat_age mismatch. Expected {} but in fact {} bytes.",
-            rows * cols * sizeof(std::complex<hybf_store_t>), buffer.size()));
+            "Size of mat_z mismatch. Expected {} but in fact {} bytes.",
+            rows * cols * sizeof(std::complex<hybf_store_t>),
+            result.data_z.size()));
         return {};
       }
-      result.data_z.resize(rows * cols);
-      memcpy(result.data_z.data(), buffer.data(), buffer.size());
     }
   }
 
@@ -554,8 +1436,521 @@ libHybractal::hybf_archive libHybractal::hybf_archive::load(
   return result;
 }
 
-bool libHybractal::hybf_archive::save(
-    std::string_view filename) const noexcept {
+bool libHybractal::hybf_archive::load_tiles(
+    const fractal_utils::binfile &bfile, const std::array<size_t, 4> &region,
+    const load_options &opt, std::string &err, int level) noexcept {
+  const auto tags = level_tags(level);
+  hybf_tile_index index;
+  if (!decode_tile_index(bfile, tags.tile_index, index, err)) {
+    return false;
+  }
+
+  const tile_grid grid{this->rows(), this->cols(), index.tile_rows,
+                       index.tile_cols};
+  const tile_rect rect{region[0], region[1], region[2], region[3]};
+  if (opt.tile_index != nullptr) {
+    *opt.tile_index = index;
+  }
+  this->m_info.z_tol = index.z_tolerance;
+  if ((index.z_filters & filter_quantize) && !(index.z_tolerance > 0)) {
+    err = fmt::format("Invalid tolerance {} of quantized mat_z.",
+                      index.z_tolerance);
+    return false;
+  }
+  const auto codec = hybf_codec(index.codec);
+  if (codec_name(codec) == "unknown") {
+    err = fmt::format("Unknown codec {}.", int(index.codec));
+    return false;
+  }
+  // Only a whole matrix in a mapped file can be used in place.
+  const bool in_place = (this->mapping != nullptr) && rect.row_begin == 0 &&
+                        rect.col_begin == 0 && rect.rows == this->rows() &&
+                        rect.cols == this->cols();
+  this->mapped_age = nullptr;
+  this->mapped_z = nullptr;
+
+  {
+    auto blkp_age = bfile.find_block_single(tags.mat_age);
+    if (blkp_age == nullptr) {
+      err = "mat_age not found.";
+      return false;
+    }
+    if (opt.compressed_age != nullptr) {
+      opt.compressed_age->assign((const uint8_t *)blkp_age->data,
+                                 (const uint8_t *)blkp_age->data +
+                                     blkp_age->bytes);
+    }
+
+    if (index.age_format > uint8_t(age_format::u32)) {
+      err = fmt::format("Unknown age format {}.", int(index.age_format));
+      return false;
+    }
+    this->age_fmt = age_format(index.age_format);
+    const bool wide = (this->age_fmt == age_format::u32);
+    const bool narrowed =
+        wide && std::any_of(index.age_tile_base.begin(),
+                            index.age_tile_base.end(), [](uint32_t base) {
+                              return base != hybf_tile_index::age_tile_raw;
+                            });
+    if (opt.skip_age) {
+      this->data_age.clear();
+    } else if (in_place && !narrowed &&
+               is_plain_block(*blkp_age, index, index.age_filters,
+                              this->rows(), this->cols(),
+                              age_element_bytes(this->age_fmt))) {
+      this->data_age.clear();
+      this->mapped_age = reinterpret_cast<uint8_t *>(blkp_age->data);
+    } else {
+      this->data_age.resize(rect.rows * rect.cols *
+                            age_element_bytes(this->age_fmt));
+      if (!decompress_tiles(blkp_age->data, blkp_age->bytes,
+                            index.age_tile_bytes, codec, index.age_filters, 0,
+                            grid, age_element_bytes(this->age_fmt), rect,
+                            this->data_age.data(), err,
+                            wide ? &index.age_tile_base : nullptr)) {
+        err = fmt::format("Failed to decode mat_age. Detail: {}", err);
+        return false;
+      }
+    }
+  }
+
+  {
+    auto blkp_z = bfile.find_block_single(tags.mat_z);
+    if (opt.compressed_mat_z != nullptr) {
+      opt.compressed_mat_z->clear();
+    }
+
+    this->data_z.clear();
+    if (blkp_z != nullptr) {
+      if (opt.compressed_mat_z != nullptr) {
+        opt.compressed_mat_z->assign(
+            (const uint8_t *)blkp_z->data,
+            (const uint8_t *)blkp_z->data + blkp_z->bytes);
+      }
+
+      this->z_fmt = z_format(index.z_format);
+      if (z_format_name(this->z_fmt) == "unknown") {
+        err = fmt::format("Unknown z format {}.", int(index.z_format));
+        return false;
+      }
+    }
+
+    const size_t z_bytes = z_element_bytes(this->z_fmt);
+    if (blkp_z == nullptr || opt.skip_z) {
+      // no mat_z
+    } else if (in_place && is_plain_block(*blkp_z, index, index.z_filters,
+                                          this->rows(), this->cols(),
+                                          z_bytes)) {
+      this->mapped_z = reinterpret_cast<uint8_t *>(blkp_z->data);
+    } else {
+      this->data_z.resize(rect.rows * rect.cols * z_bytes);
+      if (!decompress_tiles(blkp_z->data, blkp_z->bytes, index.z_tile_bytes,
+                            codec, index.z_filters, index.z_tolerance, grid,
+                            z_bytes, rect, this->data_z.data(), err)) {
+        err = fmt::format("Failed to decode mat_z. Detail: {}", err);
+        return false;
+      }
+    }
+  }
+
+  if (this->mapped_age == nullptr && this->mapped_z == nullptr) {
+    // everything is decompressed, the file is no longer needed
+    this->mapping.reset();
+  }
+  return true;
+}
+
+libHybractal::hybf_archive libHybractal::hybf_archive::load_region(
+    std::string_view filename, size_t row_begin, size_t col_begin, size_t rows,
+    size_t cols, std::string *err) noexcept {
+  fractal_utils::binfile bfile;
+  hybf_archive result;
+  // Only the pages of overlapped tiles are read.
+  std::shared_ptr<mapped_file> mapping;
+  std::vector<uint8_t> buffer;
+
+  if (!read_blocks(filename, true, buffer, bfile, mapping, *err)) {
+    return {};
+  }
+
+  const int8_t version_in_file_header = bfile.header.custom_part()[0];
+
+  if (version_in_file_header < 2) {
+    // not tiled, decode everything and crop
+    hybf_archive full = load(filename, buffer, err);
+    if (!err->empty()) {
+      return {};
+    }
+    result.m_info = full.m_info;
+    if (row_begin + rows > full.rows() || col_begin + cols > full.cols()) {
+      err->assign(fmt::format(
+          "Region [{}, {}) x [{}, {}) exceeds the size [{}, {}].", row_begin,
+          row_begin + rows, col_begin, col_begin + cols, full.rows(),
+          full.cols()));
+      return {};
+    }
+    result.age_fmt = full.age_fmt;
+    const size_t age_bytes = age_element_bytes(full.age_fmt);
+    result.data_age.resize(rows * cols * age_bytes);
+    result.z_fmt = full.z_fmt;
+    const size_t z_bytes = z_element_bytes(full.z_fmt);
+    if (full.have_mat_z()) {
+      result.data_z.resize(rows * cols * z_bytes);
+    }
+    const auto full_age = full.age_storage();
+    const auto full_z = full.z_storage();
+    for (size_t r = 0; r < rows; r++) {
+      const size_t src_offset = (r + row_begin) * full.cols() + col_begin;
+      std::copy_n(full_age.begin() + src_offset * age_bytes, cols * age_bytes,
+                  result.data_age.begin() + r * cols * age_bytes);
+      if (full.have_mat_z()) {
+        std::copy_n(full_z.begin() + src_offset * z_bytes, cols * z_bytes,
+                    result.data_z.begin() + r * cols * z_bytes);
+      }
+    }
+  } else {
+    auto blkp_meta = bfile.find_block_single(id_metainfo);
+    if (blkp_meta == nullptr) {
+      err->assign("metadata not found.");
+      return {};
+    }
+    result.m_info = hybf_metainfo_new::parse_metainfo_gen2(
+        blkp_meta->data, blkp_meta->bytes, *err);
+    if (!err->empty()) {
+      *err =
+          fmt::format("Failed to parse metainfo of gen 2. Detail: {}", *err);
+      return {};
+    }
+    if (row_begin + rows > result.rows() || col_begin + cols > result.cols()) {
+      err->assign(fmt::format(
+          "Region [{}, {}) x [{}, {}) exceeds the size [{}, {}].", row_begin,
+          row_begin + rows, col_begin, col_begin + cols, result.rows(),
+          result.cols()));
+      return {};
+    }
+    if (!result.load_tiles(bfile, {row_begin, col_begin, rows, cols}, {},
+                           *err)) {
+      return {};
+    }
+  }
+
+  // move the window to the center of region
+  const double full_rows = result.rows();
+  const double full_cols = result.cols();
+  auto crop_window = [=](auto &wind) {
+    using flt_t = std::decay_t<decltype(wind.center[0])>;
+    const double x_span = double(wind.x_span);
+    const double y_span = double(wind.y_span);
+    const double dx =
+        (col_begin + cols / 2.0 - full_cols / 2.0) * x_span / full_cols;
+    const double dy =
+        -(row_begin + rows / 2.0 - full_rows / 2.0) * y_span / full_rows;
+    wind.center[0] += flt_t(dx);
+    wind.center[1] += flt_t(dy);
+    wind.x_span = flt_t(x_span * cols / full_cols);
+    wind.y_span = flt_t(y_span * rows / full_rows);
+  };
+  std::visit(crop_window, result.m_info.wind);
+  // the center hex is regenerated from the moved window when saving
+  result.m_info.chx.clear();
+  result.m_info.rows = rows;
+  result.m_info.cols = cols;
+
+  return result;
+}
+
+libHybractal::hybf_archive::level_tag_set
+libHybractal::hybf_archive::level_tags(int level) noexcept {
+  if (level == 0) {
+    return {id_tile_index, id_mat_age, id_mat_z};
+  }
+  const int64_t base = id_level_base + 3 * int64_t(level);
+  return {base, base + 1, base + 2};
+}
+
+libHybractal::hybf_archive libHybractal::hybf_archive::load_level(
+    std::string_view filename, int level, std::string *err) noexcept {
+  if (level == 0) {
+    return load(filename, err);
+  }
+  fractal_utils::binfile bfile;
+  std::shared_ptr<mapped_file> mapping;
+  std::vector<uint8_t> buffer;
+
+  if (!read_blocks(filename, true, buffer, bfile, mapping, *err)) {
+    return {};
+  }
+
+  hybf_archive result;
+  result.m_info = parse_metainfo(bfile, *err);
+  if (!err->empty()) {
+    return {};
+  }
+  if (level < 0 || result.metainfo().generation() < 2 ||
+      bfile.find_block_single(level_tags(level).tile_index) == nullptr) {
+    err->assign(fmt::format("Pyramid level {} not found.", level));
+    return {};
+  }
+
+  const auto size = level_size(result.rows(), result.cols(), level);
+  result.m_info.rows = size[0];
+  result.m_info.cols = size[1];
+  result.mapping = std::move(mapping);
+  if (!result.load_tiles(bfile, {0, 0, size[0], size[1]}, {}, *err, level)) {
+    return {};
+  }
+  return result;
+}
+
+std::vector<std::array<size_t, 2>> libHybractal::hybf_archive::level_sizes(
+    std::string_view filename, std::string *err) noexcept {
+  fractal_utils::binfile bfile;
+  std::shared_ptr<mapped_file> mapping;
+  std::vector<uint8_t> buffer;
+
+  if (!read_blocks(filename, true, buffer, bfile, mapping, *err)) {
+    return {};
+  }
+  const auto info = parse_metainfo(bfile, *err);
+  if (!err->empty()) {
+    return {};
+  }
+
+  std::vector<std::array<size_t, 2>> ret{{info.rows, info.cols}};
+  if (info.generation() < 2) {
+    return ret;
+  }
+  for (int level = 1;
+       bfile.find_block_single(level_tags(level).tile_index) != nullptr;
+       level++) {
+    ret.emplace_back(level_size(info.rows, info.cols, level));
+  }
+  return ret;
+}
+
+libHybractal::hybf_archive libHybractal::hybf_archive::downsampled()
+    const noexcept {
+  const auto size = level_size(this->rows(), this->cols(), 1);
+  hybf_archive result{size[0], size[1], this->have_mat_z(), this->z_fmt,
+                      this->age_fmt};
+  result.m_info = this->m_info;
+  result.m_info.rows = size[0];
+  result.m_info.cols = size[1];
+
+  const size_t age_bytes = age_element_bytes(this->age_fmt);
+  const size_t z_bytes = z_element_bytes(this->z_fmt);
+  const uint8_t *const src_age = this->age_storage().data();
+  const uint8_t *const src_z = this->z_storage().data();
+  uint8_t *const dst_age = result.age_storage().data();
+  uint8_t *const dst_z = result.z_storage().data();
+
+#pragma omp parallel for schedule(static)
+  for (size_t r = 0; r < size[0]; r++) {
+    for (size_t c = 0; c < size[1]; c++) {
+      size_t best = 2 * r * this->cols() + 2 * c;
+      uint32_t best_age = load_age(src_age, best, this->age_fmt);
+      for (size_t sr = 2 * r; sr < std::min(2 * r + 2, this->rows()); sr++) {
+        for (size_t sc = 2 * c; sc < std::min(2 * c + 2, this->cols());
+             sc++) {
+          const size_t idx = sr * this->cols() + sc;
+          const uint32_t age = load_age(src_age, idx, this->age_fmt);
+          if (age == age_inside) {
+            continue;
+          }
+          if (best_age == age_inside || age > best_age) {
+            best = idx;
+            best_age = age;
+          }
+        }
+      }
+
+      const size_t dst_idx = r * size[1] + c;
+      memcpy(dst_age + dst_idx * age_bytes, src_age + best * age_bytes,
+             age_bytes);
+      if (result.have_mat_z()) {
+        memcpy(dst_z + dst_idx * z_bytes, src_z + best * z_bytes, z_bytes);
+      }
+    }
+  }
+  return result;
+}
+
+bool libHybractal::hybf_archive::check_save_options(const save_options &opt,
+                                                    bool have_z, z_format zfmt,
+                                                    age_format afmt,
+                                                    std::string *err) noexcept {
+  const bool tiled = (opt.tile_rows > 0 && opt.tile_cols > 0);
+  if (tiled) {
+    hybf_tile_index index;
+    return make_base_index(opt, have_z, zfmt, afmt, 0, index, *err);
+  }
+  if (opt.compression.codec != hybf_codec::zstd) {
+    *err = fmt::format(
+        "untiled files can only be compressed by zstd, but codec is {}.",
+        codec_name(opt.compression.codec));
+    return false;
+  }
+  if (opt.z_tolerance > 0) {
+    *err = "lossy mat_z requires tiles.";
+    return false;
+  }
+  if (afmt != age_format::u16) {
+    *err = fmt::format(
+        "untiled files can only store age as u16, but it is {}.",
+        age_format_name(afmt));
+    return false;
+  }
+  if (have_z && zfmt != z_format::f64) {
+    *err = fmt::format("untiled files can only store z as f64, but it is {}.",
+                       z_format_name(zfmt));
+    return false;
+  }
+  if (opt.pyramid_levels > 0) {
+    *err = "pyramid levels require tiles.";
+    return false;
+  }
+  return true;
+}
+
+bool libHybractal::hybf_archive::save(std::string_view filename,
+                                      const save_options &opt) const noexcept {
+  const bool tiled = (opt.tile_rows > 0 && opt.tile_cols > 0);
+  if (!tiled) {
+    std::string err;
+    if (!check_save_options(opt, this->have_mat_z(), this->z_fmt,
+                            this->age_fmt, &err)) {
+      std::cerr << fmt::format("Failed to save {}: {}", filename, err)
+                << std::endl;
+      return false;
+    }
+    return this->save_untiled(filename, opt.compression);
+  }
+
+  fractal_utils::binfile bfile;
+
+  bfile.header.custom_part()[0] = 2;
+
+  std::vector<char> meta_info_seralized =
+      struct_pack::serialize(this->m_info.to_ir());
+  bfile.blocks.emplace_back(
+      fractal_utils::data_block{id_metainfo, meta_info_seralized.size(), 0,
+                                meta_info_seralized.data(), false});
+
+  // Stored matrices are kept row major, so that they can be used in place.
+  const bool plain = opt.compression.codec == hybf_codec::store &&
+                     opt.age_filters == 0 &&
+                     (!this->have_mat_z() ||
+                      (opt.z_filters == 0 && !(opt.z_tolerance > 0)));
+  // settings shared by all levels
+  hybf_tile_index base_index;
+  {
+    std::string err;
+    if (!make_base_index(opt, this->have_mat_z(), this->z_fmt, this->age_fmt,
+                         this->m_info.z_tol, base_index, err)) {
+      std::cerr << fmt::format("Failed to save {}: {}", filename, err)
+                << std::endl;
+      return false;
+    }
+  }
+
+  // level 0 is this archive, level l is downsampled from level l - 1
+  std::vector<hybf_archive> levels;
+  levels.reserve(opt.pyramid_levels);
+  for (int l = 0; l < opt.pyramid_levels; l++) {
+    levels.emplace_back((l == 0) ? this->downsampled()
+                                 : levels.back().downsampled());
+  }
+
+  struct encoded_level {
+    hybf_tile_index index;
+    std::vector<char> index_seralized;
+    std::vector<uint8_t> compressed_age;
+    std::vector<uint8_t> compressed_z;
+  };
+  std::vector<encoded_level> encoded(levels.size() + 1);
+
+  for (size_t l = 0; l < encoded.size(); l++) {
+    const hybf_archive &src = (l == 0) ? *this : levels[l - 1];
+    encoded_level &dst = encoded[l];
+    dst.index = base_index;
+    if (plain) {
+      dst.index.tile_cols = std::max<uint32_t>(opt.tile_cols, src.cols());
+    }
+    const tile_grid grid{src.rows(), src.cols(), dst.index.tile_rows,
+                         dst.index.tile_cols};
+
+    std::vector<tiled_matrix> matrices;
+    // wide ages are narrowed to uint16 offsets tile by tile, unless they are
+    // stored plainly
+    const bool narrow = (src.age_fmt == age_format::u32) && !plain;
+    if (src.age_fmt == age_format::u32 && plain) {
+      dst.index.age_tile_base.assign(grid.tile_count(),
+                                     hybf_tile_index::age_tile_raw);
+    }
+    matrices.emplace_back(tiled_matrix{
+        src.age_storage().data(), age_element_bytes(src.age_fmt),
+        dst.index.age_filters, 0, &dst.compressed_age,
+        &dst.index.age_tile_bytes,
+        narrow ? &dst.index.age_tile_base : nullptr});
+    if (src.have_mat_z()) {
+      matrices.emplace_back(tiled_matrix{
+          src.z_storage().data(), z_element_bytes(src.z_fmt),
+          dst.index.z_filters, opt.z_tolerance, &dst.compressed_z,
+          &dst.index.z_tile_bytes});
+    }
+    // Many tiles already keep all threads busy, zstd workers would only
+    // oversubscribe.
+    compress_options tile_opt = opt.compression;
+    tile_opt.zstd_workers = 0;
+    compress_tiles(matrices, grid, tile_opt);
+    dst.index_seralized = struct_pack::serialize(dst.index);
+  }
+
+  // Insert a padding block before each stored matrix, so that its data is
+  // aligned in the file, and also in memory once the file is mapped.
+  static const std::array<uint8_t, plain_alignment> padding{};
+  auto add_padding = [plain, &bfile]() {
+    if (!plain) {
+      return;
+    }
+    const size_t offset = next_block_data_offset(bfile) + block_head_bytes;
+    const size_t bytes = (plain_alignment - offset % plain_alignment) %
+                         plain_alignment;
+    bfile.blocks.emplace_back(fractal_utils::data_block{
+        id_padding, bytes, 0, (void *)padding.data(), false});
+  };
+
+  for (size_t l = 0; l < encoded.size(); l++) {
+    auto &level = encoded[l];
+    const auto tags = level_tags(int(l));
+    bfile.blocks.emplace_back(fractal_utils::data_block{
+        tags.tile_index, level.index_seralized.size(), 0,
+        level.index_seralized.data(), false});
+
+    add_padding();
+    bfile.blocks.emplace_back(fractal_utils::data_block{
+        tags.mat_age, level.compressed_age.size(), 0,
+        level.compressed_age.data(), false});
+
+    if (this->have_mat_z()) {
+      add_padding();
+      bfile.blocks.emplace_back(fractal_utils::data_block{
+          tags.mat_z, level.compressed_z.size(), 0, level.compressed_z.data(),
+          false});
+    }
+  }
+
+  std::vector<char> stats_seralized;
+  add_stats_block(bfile, this->m_stats, stats_seralized);
+
+  std::vector<char> checksum_seralized;
+  add_checksum_block(bfile, checksum_seralized);
+
+  return bfile.save_to_file(filename.data(), true);
+}
+
+bool libHybractal::hybf_archive::save_untiled(
+    std::string_view filename, const compress_options &opt) const noexcept {
   fractal_utils::binfile bfile;
 
   bfile.header.custom_part()[0] = 1;
@@ -566,19 +1961,297 @@ bool libHybractal::hybf_archive::save(
       fractal_utils::data_block{id_metainfo, meta_info_seralized.size(), 0,
                                 meta_info_seralized.data(), false});
 
-  auto compressed_age{compress(this->data_age.data(),
-                               this->data_age.size() * sizeof(uint16_t))};
+  std::vector<uint8_t> compressed_age{};
+  std::vector<uint8_t> compressed_z{};
+
+  // Both blocks are compressed at the same time.
+#pragma omp parallel sections num_threads(2)
+  {
+#pragma omp section
+    compress(this->age_storage().data(), this->age_storage().size(),
+             compressed_age, opt);
+#pragma omp section
+    if (this->have_mat_z()) {
+      compress(this->z_storage().data(), this->z_storage().size(),
+               compressed_z, opt);
+    }
+  }
+
   bfile.blocks.emplace_back(fractal_utils::data_block{
       id_mat_age, compressed_age.size(), 0, compressed_age.data(), false});
 
-  std::vector<uint8_t> compressed_z{};
-
   if (this->have_mat_z()) {
-    compressed_z = compress(this->data_z.data(),
-                            this->data_z.size() * sizeof(this->data_z[0]));
     bfile.blocks.emplace_back(fractal_utils::data_block{
         id_mat_z, compressed_z.size(), 0, compressed_z.data(), false});
   }
 
+  std::vector<char> stats_seralized;
+  add_stats_block(bfile, this->m_stats, stats_seralized);
+
+  std::vector<char> checksum_seralized;
+  add_checksum_block(bfile, checksum_seralized);
+
   return bfile.save_to_file(filename.data(), true);
 }
+
+namespace {
+
+int seek_file(FILE *file, int64_t offset, int origin) noexcept {
+#ifdef _WIN32
+  return _fseeki64(file, offset, origin);
+#else
+  return fseeko(file, offset, origin);
+#endif
+}
+
+bool write_block_head(FILE *file, int64_t tag, uint64_t bytes) noexcept {
+  return fwrite(&tag, sizeof(tag), 1, file) == 1 &&
+         fwrite(&bytes, sizeof(bytes), 1, file) == 1;
+}
+
+bool write_block(FILE *file, int64_t tag, const void *data,
+                 uint64_t bytes) noexcept {
+  return write_block_head(file, tag, bytes) &&
+         (bytes == 0 || fwrite(data, 1, bytes, file) == bytes);
+}
+
+// Copy bytes from the current position of src to dst, and hash them.
+bool copy_and_hash(FILE *src, uint64_t bytes, FILE *dst,
+                   uint64_t &hash) noexcept {
+  XXH3_state_t state;
+  XXH3_64bits_reset(&state);
+  std::vector<uint8_t> buffer(std::min<uint64_t>(bytes, 1 << 22));
+  while (bytes > 0) {
+    const size_t chunk = std::min<uint64_t>(bytes, buffer.size());
+    if (fread(buffer.data(), 1, chunk, src) != chunk) {
+      return false;
+    }
+    XXH3_64bits_update(&state, buffer.data(), chunk);
+    if (dst != nullptr && fwrite(buffer.data(), 1, chunk, dst) != chunk) {
+      return false;
+    }
+    bytes -= chunk;
+  }
+  hash = XXH3_64bits_digest(&state);
+  return true;
+}
+
+}  // namespace
+
+libHybractal::hybf_band_writer::~hybf_band_writer() {
+  std::error_code ec;
+  if (this->m_file != nullptr) {
+    fclose(this->m_file);
+    std::filesystem::remove(this->m_temp_name, ec);
+  }
+  if (this->m_spool != nullptr) {
+    fclose(this->m_spool);
+    std::filesystem::remove(this->m_spool_name, ec);
+  }
+}
+
+std::unique_ptr<libHybractal::hybf_band_writer>
+libHybractal::hybf_band_writer::open(std::string_view filename,
+                                     const hybf_metainfo_new &info,
+                                     bool have_z, z_format zfmt,
+                                     age_format afmt, const save_options &opt,
+                                     std::string *err) noexcept {
+  if (opt.tile_rows <= 0 || opt.tile_cols <= 0) {
+    *err = "Saving band by band requires tiles.";
+    return nullptr;
+  }
+  if (opt.pyramid_levels > 0) {
+    *err = "Pyramid levels can't be saved band by band.";
+    return nullptr;
+  }
+
+  std::unique_ptr<hybf_band_writer> ret{new hybf_band_writer};
+  ret->m_info = info;
+  ret->m_opt = opt;
+  ret->m_have_z = have_z;
+  ret->m_z_fmt = zfmt;
+  ret->m_age_fmt = afmt;
+  if (!make_base_index(opt, have_z, zfmt, afmt, info.z_tolerance(),
+                       ret->m_index, *err)) {
+    return nullptr;
+  }
+
+  ret->m_filename = filename;
+  ret->m_temp_name = fmt::format("{}.writing", filename);
+  ret->m_spool_name = fmt::format("{}.z.tmp", filename);
+  ret->m_file = fopen(ret->m_temp_name.c_str(), "w+b");
+  if (ret->m_file == nullptr) {
+    *err = fmt::format("Failed to create {}.", ret->m_temp_name);
+    return nullptr;
+  }
+  if (have_z) {
+    ret->m_spool = fopen(ret->m_spool_name.c_str(), "w+b");
+    if (ret->m_spool == nullptr) {
+      *err = fmt::format("Failed to create {}.", ret->m_spool_name);
+      return nullptr;
+    }
+  }
+
+  fractal_utils::binfile bfile;
+  bfile.header.custom_part()[0] = 2;
+  const std::vector<char> meta_info_seralized =
+      struct_pack::serialize(ret->m_info.to_ir());
+  ret->m_meta_hash =
+      XXH3_64bits(meta_info_seralized.data(), meta_info_seralized.size());
+  ret->m_age_head_offset = sizeof(fractal_utils::file_header) +
+                           block_head_bytes + meta_info_seralized.size();
+  // the size of mat_age is written by finish
+  if (fwrite(&bfile.header, sizeof(fractal_utils::file_header), 1,
+             ret->m_file) != 1 ||
+      !write_block(ret->m_file, hybf_archive::id_metainfo,
+                   meta_info_seralized.data(), meta_info_seralized.size()) ||
+      !write_block_head(ret->m_file, hybf_archive::id_mat_age, 0)) {
+    *err = fmt::format("Failed to write {}.", ret->m_temp_name);
+    return nullptr;
+  }
+  return ret;
+}
+
+bool libHybractal::hybf_band_writer::write_band(
+    const fractal_utils::fractal_map &age, const fractal_utils::fractal_map *z,
+    std::string *err) noexcept {
+  const size_t rows =
+      std::min<size_t>(this->band_rows(), this->m_info.rows - this->m_next_row);
+  if (this->complete() || age.rows != rows || age.cols != this->m_info.cols ||
+      age.element_bytes != age_element_bytes(this->m_age_fmt)) {
+    *err = fmt::format(
+        "Expected a band of {} x {} pixels at row {}, but it is {} x {}.", rows,
+        this->m_info.cols, this->m_next_row, age.rows, age.cols);
+    return false;
+  }
+  if (this->m_have_z &&
+      (z == nullptr || z->rows != age.rows || z->cols != age.cols ||
+       z->element_bytes != z_element_bytes(this->m_z_fmt))) {
+    *err = "mat_z of the band is missing or mismatches with mat_age.";
+    return false;
+  }
+
+  const tile_grid grid{rows, this->m_info.cols, this->m_index.tile_rows,
+                       this->m_index.tile_cols};
+  std::vector<uint8_t> compressed_age;
+  std::vector<uint8_t> compressed_z;
+  std::vector<uint64_t> age_tile_bytes;
+  std::vector<uint64_t> z_tile_bytes;
+  std::vector<uint32_t> age_tile_base;
+
+  std::vector<tiled_matrix> matrices;
+  const bool narrow = (this->m_age_fmt == age_format::u32);
+  matrices.emplace_back(tiled_matrix{
+      age.data, age.element_bytes, this->m_index.age_filters, 0,
+      &compressed_age, &age_tile_bytes, narrow ? &age_tile_base : nullptr});
+  if (this->m_have_z) {
+    matrices.emplace_back(tiled_matrix{
+        z->data, z->element_bytes, this->m_index.z_filters,
+        this->m_opt.z_tolerance, &compressed_z, &z_tile_bytes});
+  }
+  compress_options tile_opt = this->m_opt.compression;
+  tile_opt.zstd_workers = 0;
+  compress_tiles(matrices, grid, tile_opt);
+
+  // the tiles of a band are the next row of tiles in the file
+  if (fwrite(compressed_age.data(), 1, compressed_age.size(), this->m_file) !=
+          compressed_age.size() ||
+      (this->m_have_z &&
+       fwrite(compressed_z.data(), 1, compressed_z.size(), this->m_spool) !=
+           compressed_z.size())) {
+    *err = fmt::format("Failed to write band at row {} of {}.",
+                       this->m_next_row, this->m_filename);
+    return false;
+  }
+  this->m_age_bytes += compressed_age.size();
+  this->m_z_bytes += compressed_z.size();
+  auto append = [](auto &dst, const auto &src) {
+    dst.insert(dst.end(), src.begin(), src.end());
+  };
+  append(this->m_index.age_tile_bytes, age_tile_bytes);
+  append(this->m_index.z_tile_bytes, z_tile_bytes);
+  append(this->m_index.age_tile_base, age_tile_base);
+
+  this->m_next_row += rows;
+  return true;
+}
+
+bool libHybractal::hybf_band_writer::finish(
+    const std::optional<frame_stats> &stats, std::string *err) noexcept {
+  if (!this->complete()) {
+    *err = fmt::format("Only {} of {} rows are written.", this->m_next_row,
+                       this->m_info.rows);
+    return false;
+  }
+
+  hybf_checksums checksums;
+  checksums.tags.emplace_back(hybf_archive::id_metainfo);
+  checksums.hashes.emplace_back(this->m_meta_hash);
+
+  auto fail = [this, err](std::string_view what) {
+    *err = fmt::format("Failed to {} {}.", what, this->m_temp_name);
+    return false;
+  };
+
+  // patch the size of mat_age, and hash it by reading it back
+  uint64_t hash;
+  if (seek_file(this->m_file, this->m_age_head_offset + sizeof(int64_t),
+                SEEK_SET) != 0 ||
+      fwrite(&this->m_age_bytes, sizeof(uint64_t), 1, this->m_file) != 1 ||
+      fflush(this->m_file) != 0 ||
+      !copy_and_hash(this->m_file, this->m_age_bytes, nullptr, hash) ||
+      seek_file(this->m_file, 0, SEEK_END) != 0) {
+    return fail("write mat_age of");
+  }
+  checksums.tags.emplace_back(hybf_archive::id_mat_age);
+  checksums.hashes.emplace_back(hash);
+
+  if (this->m_have_z) {
+    if (fflush(this->m_spool) != 0 ||
+        seek_file(this->m_spool, 0, SEEK_SET) != 0 ||
+        !write_block_head(this->m_file, hybf_archive::id_mat_z,
+                          this->m_z_bytes) ||
+        !copy_and_hash(this->m_spool, this->m_z_bytes, this->m_file, hash)) {
+      return fail("append mat_z to");
+    }
+    checksums.tags.emplace_back(hybf_archive::id_mat_z);
+    checksums.hashes.emplace_back(hash);
+  }
+
+  auto add_block = [this, &checksums](int64_t tag,
+                                      const std::vector<char> &blk) {
+    checksums.tags.emplace_back(tag);
+    checksums.hashes.emplace_back(XXH3_64bits(blk.data(), blk.size()));
+    return write_block(this->m_file, tag, blk.data(), blk.size());
+  };
+  if (!add_block(hybf_archive::level_tags(0).tile_index,
+                 struct_pack::serialize(this->m_index)) ||
+      (stats.has_value() &&
+       !add_block(hybf_archive::id_stats,
+                  struct_pack::serialize(stats.value())))) {
+    return fail("write");
+  }
+
+  const std::vector<char> checksum_seralized =
+      struct_pack::serialize(checksums);
+  if (!write_block(this->m_file, hybf_archive::id_checksum,
+                   checksum_seralized.data(), checksum_seralized.size())) {
+    return fail("write");
+  }
+
+  const bool closed = (fclose(this->m_file) == 0);
+  this->m_file = nullptr;
+  std::error_code ec;
+  if (!closed) {
+    std::filesystem::remove(this->m_temp_name, ec);
+    return fail("close");
+  }
+  std::filesystem::rename(this->m_temp_name, this->m_filename, ec);
+  if (ec) {
+    *err = fmt::format("Failed to rename {} to {}: {}", this->m_temp_name,
+                       this->m_filename, ec.message());
+    std::filesystem::remove(this->m_temp_name, ec);
+    return false;
+  }
+  return true;
+}
@@ -20,8 +20,11 @@ This file is part of Hybractal.
 #define HYBRACTAL_LIBHYBFILE_H
 
 #include <fractal_binfile.h>
+#include <stdio.h>
 
+#include <memory>
 #include <optional>
+#include <span>
 
 #include "libHybractal.h"
 
@@ -114,6 +117,8 @@ struct hybf_metainfo_new {
  private:
   int8_t file_genration{1};
   std::string chx{};
+  // error bound of mat_z, recorded in the tile index since gen 2
+  double z_tol{0};
 
  public:
   inline int8_t generation() const noexcept { return this->file_genration; }
@@ -125,12 +130,19 @@ struct hybf_metainfo_new {
 
   const auto &center_hex() const noexcept { return this->chx; }
 
+  // 0 means mat_z is lossless
+  inline double z_tolerance() const noexcept { return this->z_tol; }
+
   static hybf_metainfo_new parse_metainfo_gen0(const void *src, size_t bytes,
                                                std::string &err) noexcept;
 
   static hybf_metainfo_new parse_metainfo_gen1(const void *src, size_t bytes,
                                                std::string &err) noexcept;
 
+  // Same metainfo as gen 1, but the matrices are stored in tiles.
+  static hybf_metainfo_new parse_metainfo_gen2(const void *src, size_t bytes,
+                                               std::string &err) noexcept;
+
   hybf_ir_new to_ir() const noexcept;
 
   inline int precision() const noexcept {
@@ -138,82 +150,438 @@ struct hybf_metainfo_new {
   }
 
   void update_generation() noexcept;
+
+  friend class hybf_archive;
+};
+
+enum class hybf_codec : uint8_t {
+  store = 0,
+  zstd = 1,
+  lz4 = 2,
+};
+
+std::string_view codec_name(hybf_codec codec) noexcept;
+std::optional<hybf_codec> parse_codec(std::string_view name) noexcept;
+
+struct compress_options {
+  hybf_codec codec{hybf_codec::zstd};
+  // 0 means the default level of codec. For lz4, levels above 1 select lz4hc.
+  int level{0};
+  // zstd only, 0 means compressing on the calling thread. Ignored for tiled
+  // files, whose tiles are compressed in parallel already.
+  int zstd_workers{0};
+};
+
+// Reversible transforms applied to each tile before compression, they make
+// the matrices much easier to compress.
+enum hybf_filter : uint8_t {
+  // group the k-th byte of all elements together
+  filter_shuffle = 1,
+  // uint16 only, store the residual of paeth prediction from left, up and
+  // upper-left neighbors
+  filter_paeth = 2,
+  // z only, separate real and imag parts (norm and angle), and xor each value
+  // with its left neighbor
+  filter_planar_xor = 4,
+  // uint16 only, store runs of UINT16_MAX as {UINT16_MAX, length}
+  filter_rle = 8,
+  // complex<double> only, lossy. Quantize real and imag parts with an absolute
+  // error bound. It is set by save_options::z_tolerance instead of by name.
+  filter_quantize = 16,
+};
+
+std::string filter_names(uint8_t filters) noexcept;
+// comma separated names, such as "paeth,shuffle"
+std::optional<uint8_t> parse_filters(std::string_view names) noexcept;
+bool check_filters(uint8_t filters, size_t element_bytes,
+                   std::string &err) noexcept;
+size_t filtered_bytes_bound(uint8_t filters, size_t raw_bytes) noexcept;
+// tolerance is only used by filter_quantize
+void encode_filters(const void *src, size_t rows, size_t cols,
+                    size_t element_bytes, uint8_t filters, double tolerance,
+                    std::vector<uint8_t> &dst) noexcept;
+// dst is rows*cols*element_bytes
+bool decode_filters(const void *src, size_t src_bytes, size_t rows,
+                    size_t cols, size_t element_bytes, uint8_t filters,
+                    double tolerance, void *dst) noexcept;
+
+// Since gen 2, mat_age and mat_z are cut into tiles of tile_rows*tile_cols
+// pixels (smaller at the right and bottom edges), each tile is compressed
+// independently and the compressed tiles are stored row by row in the data
+// block. Elements in a tile are row major.
+struct hybf_tile_index {
+  uint32_t tile_rows;
+  uint32_t tile_cols;
+  // compressed bytes of each tile
+  std::vector<uint64_t> age_tile_bytes;
+  std::vector<uint64_t> z_tile_bytes;
+  // hybf_codec of all tiles
+  uint8_t codec;
+  // hybf_filter flags of each matrix
+  uint8_t age_filters;
+  uint8_t z_filters;
+  // absolute error bound of real and imag parts of mat_z, 0 means lossless
+  double z_tolerance;
+  // z_format of mat_z
+  uint8_t z_format;
+  // age_format of mat_age
+  uint8_t age_format;
+  // Only for uint32 ages. A tile whose ages span less than 65535 is stored as
+  // uint16 offsets to its base, and UINT16_MAX still means never escaping.
+  // Other tiles are stored as uint32 with only the shuffle filter, and their
+  // base is age_tile_raw.
+  std::vector<uint32_t> age_tile_base;
+  static constexpr uint32_t age_tile_raw = UINT32_MAX;
+};
+
+// 64-bit xxHash3 of each block, stored in the block id_checksum. tags[i] is
+// the block whose hash is hashes[i].
+struct hybf_checksums {
+  std::vector<int64_t> tags;
+  std::vector<uint64_t> hashes;
+};
+
+struct save_options {
+  // 0 means storing each matrix as one frame, which is the gen 1 format.
+  uint32_t tile_rows{256};
+  uint32_t tile_cols{256};
+  // gen 1 files can only be compressed by zstd. With codec store and no
+  // filters, tiles are widened to whole rows and the matrices are aligned in
+  // the file, so that loading uses them in place without copy.
+  compress_options compression{};
+  // filters are ignored by gen 1 files. planar-xor also applies to
+  // complex<float> and z_norm_angle.
+  uint8_t age_filters{filter_rle | filter_shuffle};
+  uint8_t z_filters{filter_planar_xor | filter_shuffle};
+  // Lossy mat_z. If positive, real and imag parts of z are stored with at most
+  // this absolute error, and planar-xor in z_filters is replaced by quantize.
+  // Only for tiled files.
+  double z_tolerance{0};
+  // Downsampled copies of the matrices stored after them. Each level halves
+  // the rows and cols of the previous one. Only for tiled files.
+  int pyramid_levels{0};
 };
 
 struct load_options {
   std::vector<uint8_t> *compressed_age{nullptr};
   std::vector<uint8_t> *compressed_mat_z{nullptr};
+  // The file is read by fractal_utils instead of being mapped if binfile is
+  // required, so that the blocks own their data.
   fractal_utils::binfile *binfile{nullptr};
+  // only filled for gen 2 files
+  hybf_tile_index *tile_index{nullptr};
+  // Don't decompress the matrix, so that have_mat_age() or have_mat_z() is
+  // false. Compressed blocks are still copied if required.
+  bool skip_age{false};
+  bool skip_z{false};
+};
+
+// A whole file mapped into memory. Pages are copy-on-write, writing to them
+// never changes the file.
+class mapped_file {
+ private:
+  uint8_t *m_data{nullptr};
+  size_t m_size{0};
+
+  mapped_file() = default;
+
+ public:
+  static std::shared_ptr<mapped_file> open(std::string_view filename,
+                                           std::string &err) noexcept;
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file();
+
+  inline uint8_t *data() const noexcept { return this->m_data; }
+  inline size_t size() const noexcept { return this->m_size; }
 };
 
 class hybf_archive {
  private:
   hybf_metainfo_new m_info;
-  std::vector<uint16_t> data_age;
-  std::vector<std::complex<hybf_store_t>> data_z;
+  // rows * cols elements of age_fmt
+  std::vector<uint8_t> data_age;
+  age_format age_fmt{age_format::u16};
+  // rows * cols elements of z_fmt
+  std::vector<uint8_t> data_z;
+  z_format z_fmt{z_format::f64};
+  // saved as the block id_stats if present
+  std::optional<frame_stats> m_stats{std::nullopt};
+  // If not null, the matrix is a block in mapping instead of data_age or
+  // data_z.
+  std::shared_ptr<mapped_file> mapping{nullptr};
+  uint8_t *mapped_age{nullptr};
+  uint8_t *mapped_z{nullptr};
+
+  inline std::span<uint8_t> age_storage() noexcept {
+    if (this->mapped_age != nullptr) {
+      return {this->mapped_age,
+              this->rows() * this->cols() * age_element_bytes(this->age_fmt)};
+    }
+    return this->data_age;
+  }
+  inline std::span<const uint8_t> age_storage() const noexcept {
+    return const_cast<hybf_archive *>(this)->age_storage();
+  }
+  inline std::span<uint8_t> z_storage() noexcept {
+    if (this->mapped_z != nullptr) {
+      return {this->mapped_z,
+              this->rows() * this->cols() * z_element_bytes(this->z_fmt)};
+    }
+    return this->data_z;
+  }
+  inline std::span<const uint8_t> z_storage() const noexcept {
+    return const_cast<hybf_archive *>(this)->z_storage();
+  }
+  // copy mapped matrices into data_age and data_z, and release the mapping
+  void detach_mapping() noexcept;
 
  public:
   enum seg_id : int64_t {
     id_metainfo = 666,
     id_mat_age = 114514,
     id_mat_z = 1919810,
+    id_tile_index = 2333,
+    // Padding before stored matrices, ignored by loading.
+    id_padding = 1024,
+    id_checksum = 9527,
+    id_stats = 4396,
+    // Pyramid levels are stored after the full matrices, see level_tags().
+    id_level_base = 1 << 20,
+  };
+
+  // Blocks of a resolution level. Level 0 is the full matrices, level l >= 1
+  // uses id_level_base + 3 * l + {0, 1, 2}.
+  struct level_tag_set {
+    int64_t tile_index;
+    int64_t mat_age;
+    int64_t mat_z;
   };
+  static level_tag_set level_tags(int level) noexcept;
 
  public:
   hybf_archive() : hybf_archive(0, 0, false) {}
-  explicit hybf_archive(size_t rows, size_t cols, bool have_z);
+  // Use age_format_for_maxit(maxit) as afmt if maxit may exceed maxit_max.
+  explicit hybf_archive(size_t rows, size_t cols, bool have_z,
+                        z_format zfmt = z_format::f64,
+                        age_format afmt = age_format::u16);
+  // A copy never shares mapped pages with the source.
+  hybf_archive(const hybf_archive &src);
+  hybf_archive(hybf_archive &&) = default;
+  hybf_archive &operator=(const hybf_archive &src);
+  hybf_archive &operator=(hybf_archive &&) = default;
+
   auto &metainfo() noexcept { return this->m_info; }
   const auto &metainfo() const noexcept { return this->m_info; }
 
+  // Statistics of the whole frame, only load() reads them. Reset or replace
+  // them after computing the matrices again.
+  auto &stats() noexcept { return this->m_stats; }
+  const auto &stats() const noexcept { return this->m_stats; }
+
   inline size_t rows() const noexcept { return this->m_info.rows; }
 
   inline size_t cols() const noexcept { return this->m_info.cols; }
 
-  inline auto &mat_z_data() const noexcept { return this->data_z; }
+  // raw bytes of mat_z, see mat_z_format()
+  inline std::span<const uint8_t> mat_z_data() const noexcept {
+    return this->z_storage();
+  }
+
+  inline z_format mat_z_format() const noexcept { return this->z_fmt; }
+
+  // raw bytes of mat_age, see mat_age_format()
+  inline std::span<const uint8_t> mat_age_data() const noexcept {
+    return this->age_storage();
+  }
 
-  inline auto &mat_age_data() const noexcept { return this->data_age; }
+  inline age_format mat_age_format() const noexcept { return this->age_fmt; }
+
+  // false only if loaded with load_options::skip_age
+  inline bool have_mat_age() const noexcept {
+    return this->age_storage().size() ==
+           (this->rows() * this->cols() * age_element_bytes(this->age_fmt));
+  }
 
   inline bool have_mat_z() const noexcept {
-    return this->data_z.size() == (this->rows() * this->cols());
+    return this->z_storage().size() ==
+           (this->rows() * this->cols() * z_element_bytes(this->z_fmt));
   }
 
+  // true if mat_age or mat_z is used in place in the mapped file
+  inline bool is_mapped() const noexcept { return this->mapping != nullptr; }
+
   fractal_utils::fractal_map map_age() noexcept {
-    return fractal_utils::fractal_map{this->rows(), this->cols(),
-                                      sizeof(uint16_t), this->data_age.data()};
+    return fractal_utils::fractal_map{
+        this->rows(), this->cols(), uint32_t(age_element_bytes(this->age_fmt)),
+        this->age_storage().data()};
   }
 
   fractal_utils::fractal_map map_z() noexcept {
     if (this->have_mat_z()) {
       return fractal_utils::fractal_map{this->rows(), this->cols(),
-                                        sizeof(std::complex<hybf_store_t>),
-                                        this->data_z.data()};
+                                        uint32_t(z_element_bytes(this->z_fmt)),
+                                        this->z_storage().data()};
     }
 
-    return fractal_utils::fractal_map{0, 0, sizeof(std::complex<hybf_store_t>),
-                                      nullptr};
+    return fractal_utils::fractal_map{
+        0, 0, uint32_t(z_element_bytes(this->z_fmt)), nullptr};
   }
 
+  // Parse the file header and the metainfo only, data blocks are neither read
+  // nor decompressed.
+  static hybf_metainfo_new probe(std::string_view filename,
+                                 std::string *err) noexcept;
+
   static hybf_archive load(std::string_view filename, std::string *err,
                            const load_options &opt = load_options()) noexcept {
     std::vector<uint8_t> buffer;
     return load(filename, buffer, err, opt);
   }
 
+  // The file is mapped and matrices are decompressed straight into the
+  // archive. buffer only holds the file if it can not be mapped.
   static hybf_archive load(std::string_view filename,
                            std::vector<uint8_t> &buffer, std::string *err,
                            const load_options &opt = load_options()) noexcept;
 
-  bool save(std::string_view filename) const noexcept;
+  // Decode the sub-window [row_begin, row_begin + rows) x [col_begin,
+  // col_begin + cols). Only the tiles that overlap it are decompressed. The
+  // window of the result is moved and scaled to the region.
+  static hybf_archive load_region(std::string_view filename, size_t row_begin,
+                                  size_t col_begin, size_t rows, size_t cols,
+                                  std::string *err) noexcept;
+
+  // Load a pyramid level saved with save_options::pyramid_levels, level 0 is
+  // the full resolution. The window is kept, so pixels are larger.
+  static hybf_archive load_level(std::string_view filename, int level,
+                                 std::string *err) noexcept;
+
+  // {rows, cols} of level 0 and of each pyramid level in the file.
+  static std::vector<std::array<size_t, 2>> level_sizes(
+      std::string_view filename, std::string *err) noexcept;
+
+  bool save(std::string_view filename,
+            const save_options &opt = save_options()) const noexcept;
+
+  // Whether an archive of these formats can be saved with opt, so that tasks
+  // are rejected before computing instead of when saving.
+  static bool check_save_options(const save_options &opt, bool have_z,
+                                 z_format zfmt, age_format afmt,
+                                 std::string *err) noexcept;
+
+  // Hash the blocks without decompressing them, and compare with the
+  // checksums in the file. Files saved before checksums were added, or that
+  // lost their checksums, have nothing to compare. They are considered to be
+  // valid, and *has_checksums is set to false so that callers can check them
+  // in another way.
+  static bool verify(std::string_view filename, std::string *err,
+                     bool *has_checksums = nullptr) noexcept;
+
+  // Convert a gen 0 file into gen 1 by rewriting the header and the metainfo,
+  // other blocks are copied without being decompressed. dst is replaced by
+  // renaming, so it can be src. Newer files are skipped and updated is false.
+  // Without allow_mapping, src is parsed by fractal_utils.
+  static bool update_file(std::string_view src, std::string_view dst,
+                          bool *updated, std::string *err,
+                          bool allow_mapping = true) noexcept;
+
+ private:
+  static hybf_metainfo_new parse_metainfo(const fractal_utils::binfile &bfile,
+                                          std::string &err) noexcept;
+
+  // region is {row_begin, col_begin, rows, cols} of the given level
+  bool load_tiles(const fractal_utils::binfile &bfile,
+                  const std::array<size_t, 4> &region, const load_options &opt,
+                  std::string &err, int level = 0) noexcept;
+
+  // Half rows and cols. Each pixel is the one with the largest escaping age in
+  // its 2x2 block, so thin filaments survive. Pixels that never escape are
+  // kept only if the whole block never escapes.
+  hybf_archive downsampled() const noexcept;
+
+  bool save_untiled(std::string_view filename,
+                    const compress_options &opt) const noexcept;
+};
+
+// Saves a tiled file band by band, so that a frame larger than memory is
+// compressed and written while it is computed. Each band is a row of tiles,
+// and its matrices are freed once the band is written. Compressed tiles of
+// mat_z are spooled into <filename>.z.tmp until finish() appends them, and the
+// file is written as <filename>.writing and renamed when finished.
+//
+// Pyramid levels and the plain layout of save_options are not supported.
+class hybf_band_writer {
+ private:
+  std::string m_filename;
+  std::string m_temp_name;
+  std::string m_spool_name;
+  FILE *m_file{nullptr};
+  FILE *m_spool{nullptr};
+
+  hybf_metainfo_new m_info;
+  save_options m_opt;
+  hybf_tile_index m_index;
+  bool m_have_z;
+  z_format m_z_fmt;
+  age_format m_age_fmt;
+
+  size_t m_next_row{0};
+  // file offset of the block head of mat_age, whose size is written by finish
+  size_t m_age_head_offset{0};
+  uint64_t m_age_bytes{0};
+  uint64_t m_z_bytes{0};
+  uint64_t m_meta_hash{0};
+
+  hybf_band_writer() = default;
+
+ public:
+  hybf_band_writer(const hybf_band_writer &) = delete;
+  hybf_band_writer &operator=(const hybf_band_writer &) = delete;
+  // removes the unfinished file
+  ~hybf_band_writer();
+
+  static std::unique_ptr<hybf_band_writer> open(
+      std::string_view filename, const hybf_metainfo_new &info, bool have_z,
+      z_format zfmt, age_format afmt, const save_options &opt,
+      std::string *err) noexcept;
+
+  // rows of each band except the last one
+  inline size_t band_rows() const noexcept { return this->m_opt.tile_rows; }
+  // first row of the next band
+  inline size_t next_row() const noexcept { return this->m_next_row; }
+  inline bool complete() const noexcept {
+    return this->m_next_row >= this->m_info.rows;
+  }
+
+  // age and z are the next band of min(band_rows(), rows - next_row()) rows
+  // and all cols. z is ignored if the file has no mat_z.
+  bool write_band(const fractal_utils::fractal_map &age,
+                  const fractal_utils::fractal_map *z,
+                  std::string *err) noexcept;
+
+  // Append mat_z, the tile index, stats and checksums after all bands.
+  bool finish(const std::optional<frame_stats> &stats,
+              std::string *err) noexcept;
 };
 
 void compress(const void *src, size_t bytes,
               std::vector<uint8_t> &dest) noexcept;
 
+void compress(const void *src, size_t bytes, std::vector<uint8_t> &dest,
+              const compress_options &opt) noexcept;
+
 std::vector<uint8_t> compress(const void *src, size_t bytes) noexcept;
 
 void decompress(const void *src, size_t src_bytes,
                 std::vector<uint8_t> &dest) noexcept;
 
+// Returns the decompressed bytes. Because lz4 and stored data don't record
+// their size, the caller has to know a capacity that is large enough.
+std::optional<size_t> decompress(hybf_codec codec, const void *src,
+                                 size_t src_bytes, void *dst,
+                                 size_t capacity) noexcept;
+
 }  // namespace libHybractal
 
 #endif  // HYBRACTAL_LIBHYBFILE_H
\ No newline at end of file
@@ -21,6 +21,8 @@ This file is part of Hybractal.
 #include <hex_convert.h>
 #include <omp.h>
 
+#include <algorithm>
+
 #include "float_encode.hpp"
 #include "libHybractal.h"
 
@@ -116,31 +118,219 @@ libHybractal::float_variant_t libHybractal::hex_to_float_by_gen(
   return NAN;
 }
 
+std::string_view libHybractal::z_format_name(z_format fmt) noexcept {
+  switch (fmt) {
+    case z_format::f64:
+      return "f64";
+    case z_format::f32:
+      return "f32";
+    case z_format::norm_angle_u16:
+      return "norm-angle";
+  }
+  return "unknown";
+}
+
+std::optional<libHybractal::z_format> libHybractal::parse_z_format(
+    std::string_view name) noexcept {
+  for (auto fmt : {z_format::f64, z_format::f32, z_format::norm_angle_u16}) {
+    if (name == z_format_name(fmt)) {
+      return fmt;
+    }
+  }
+  return std::nullopt;
+}
+
+std::string_view libHybractal::age_format_name(age_format fmt) noexcept {
+  switch (fmt) {
+    case age_format::u16:
+      return "u16";
+    case age_format::u32:
+      return "u32";
+  }
+  return "unknown";
+}
+
+libHybractal::frame_stats libHybractal::frame_stats::make(int maxit) noexcept {
+  frame_stats ret;
+  const uint64_t ages = uint64_t(maxit) + 1;
+  ret.bin_width = uint32_t((ages + max_bins - 1) / max_bins);
+  ret.age_histogram.resize((ages + ret.bin_width - 1) / ret.bin_width);
+  return ret;
+}
+
+void libHybractal::frame_stats::merge(const frame_stats &src) noexcept {
+  assert(src.bin_width == this->bin_width);
+  assert(src.age_histogram.size() == this->age_histogram.size());
+  for (size_t i = 0; i < src.age_histogram.size(); i++) {
+    this->age_histogram[i] += src.age_histogram[i];
+  }
+  this->escaped += src.escaped;
+  this->inside += src.inside;
+  this->total_iterations += src.total_iterations;
+}
+
+uint32_t libHybractal::frame_stats::age_quantile(double q) const noexcept {
+  const double target = q * this->escaped;
+  uint64_t counted = 0;
+  for (size_t i = 0; i < this->age_histogram.size(); i++) {
+    counted += this->age_histogram[i];
+    if (counted > 0 && counted >= target) {
+      return uint32_t(i * this->bin_width);
+    }
+  }
+  return 0;
+}
+
+int libHybractal::frame_stats::suggest_maxit(double tolerance) const
+    noexcept {
+  const double allowed = tolerance * (this->escaped + this->inside);
+  uint64_t late = 0;
+  // count from the latest bin, until it is no longer negligible
+  for (size_t i = this->age_histogram.size(); i-- > 0;) {
+    late += this->age_histogram[i];
+    if (late > allowed) {
+      return int(std::min<uint64_t>((i + 1) * uint64_t(this->bin_width),
+                                    INT32_MAX));
+    }
+  }
+  return 0;
+}
+
+libHybractal::frame_stats libHybractal::make_frame_stats(
+    const fractal_utils::fractal_map &map_age, int maxit) noexcept {
+  assert(age_format_of(map_age.element_bytes).has_value());
+  const age_format afmt = age_format_of(map_age.element_bytes).value();
+
+  frame_stats ret = frame_stats::make(maxit);
+#pragma omp parallel
+  {
+    // every thread counts into its own histogram, which are merged at last
+    frame_stats local = frame_stats::make(maxit);
+#pragma omp for schedule(static)
+    for (size_t r = 0; r < map_age.rows; r++) {
+      for (size_t c = 0; c < map_age.cols; c++) {
+        local.add(load_age(map_age.data, r * map_age.cols + c, afmt), maxit);
+      }
+    }
+#pragma omp critical
+    ret.merge(local);
+  }
+  return ret;
+}
+
+libHybractal::cost_map libHybractal::predict_zoom_cost(
+    const fractal_utils::fractal_map &map_age, int maxit, double ratio,
+    size_t cost_rows, size_t cost_cols) noexcept {
+  assert(age_format_of(map_age.element_bytes).has_value());
+  assert(ratio >= 1);
+  const age_format afmt = age_format_of(map_age.element_bytes).value();
+
+  cost_map ret{cost_rows, cost_cols,
+               std::vector<double>(cost_rows * cost_cols)};
+  // the next frame is the center 1/ratio of this frame
+  const double crop_rows = map_age.rows / ratio;
+  const double crop_cols = map_age.cols / ratio;
+  const double crop_r0 = (map_age.rows - crop_rows) / 2;
+  const double crop_c0 = (map_age.cols - crop_cols) / 2;
+  auto src_range = [](double begin, double span, size_t idx, size_t num,
+                      size_t limit) {
+    size_t first = size_t(begin + span * idx / num);
+    size_t last = size_t(std::ceil(begin + span * (idx + 1) / num));
+    first = std::min(first, limit - 1);
+    last = std::clamp(last, first + 1, limit);
+    return std::array<size_t, 2>{first, last};
+  };
+
+#pragma omp parallel for schedule(static)
+  for (size_t r = 0; r < cost_rows; r++) {
+    const auto rows =
+        src_range(crop_r0, crop_rows, r, cost_rows, map_age.rows);
+    for (size_t c = 0; c < cost_cols; c++) {
+      const auto cols =
+          src_range(crop_c0, crop_cols, c, cost_cols, map_age.cols);
+      double sum = 0;
+      for (size_t sr = rows[0]; sr < rows[1]; sr++) {
+        for (size_t sc = cols[0]; sc < cols[1]; sc++) {
+          const uint32_t age =
+              load_age(map_age.data, sr * map_age.cols + sc, afmt);
+          sum += (age == age_inside) ? maxit : age + 1;
+        }
+      }
+      // cells of the next frame have the same size, so the mean is enough
+      ret.cost[r * cost_cols + c] =
+          sum / ((rows[1] - rows[0]) * (cols[1] - cols[0]));
+    }
+  }
+  return ret;
+}
+
+std::vector<libHybractal::pixel_block> libHybractal::frame_blocks(
+    size_t rows, size_t cols, const cost_map *cost) noexcept {
+  std::vector<pixel_block> blocks;
+  if (cost == nullptr || cost->rows == 0 || cost->cols == 0) {
+    blocks.reserve(rows);
+    for (size_t r = 0; r < rows; r++) {
+      blocks.push_back({r, r + 1, 0, cols});
+    }
+    return blocks;
+  }
+
+  std::vector<size_t> order(cost->rows * cost->cols);
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [cost](size_t a, size_t b) {
+    return cost->cost[a] > cost->cost[b];
+  });
+
+  blocks.reserve(order.size());
+  for (size_t i : order) {
+    const size_t r = i / cost->cols;
+    const size_t c = i % cost->cols;
+    const pixel_block block{
+        r * rows / cost->rows, (r + 1) * rows / cost->rows,
+        c * cols / cost->cols, (c + 1) * cols / cost->cols};
+    if (block[0] < block[1] && block[2] < block[3]) {
+      blocks.push_back(block);
+    }
+  }
+  return blocks;
+}
+
+// block is in pixels of a frame of frame_size, and the first pixel of map_age
+// and map_z is the pixel origin of the frame.
 template <typename float_t>
-void compute_frame_private(const fractal_utils::center_wind<float_t> &wind_C,
-                           const uint16_t maxit,
-                           fractal_utils::fractal_map &map_age_u16,
-                           fractal_utils::fractal_map *map_z) noexcept {
+void compute_tile_private(const fractal_utils::center_wind<float_t> &wind_C,
+                          const int maxit,
+                          const std::array<size_t, 2> &frame_size,
+                          const std::array<size_t, 2> &origin,
+                          fractal_utils::fractal_map &map_age,
+                          fractal_utils::fractal_map *map_z,
+                          const libHybractal::pixel_block &block,
+                          libHybractal::frame_stats *stats) noexcept {
   using namespace libHybractal;
   if (map_z != nullptr) {
-    assert(map_z->rows == map_age_u16.rows);
-    assert(map_z->cols == map_age_u16.cols);
-    assert(map_z->element_bytes == sizeof(std::complex<hybf_store_t>));
+    assert(map_z->rows == map_age.rows);
+    assert(map_z->cols == map_age.cols);
+    assert(z_format_of(map_z->element_bytes).has_value());
   }
+  const z_format zfmt = (map_z != nullptr)
+                            ? z_format_of(map_z->element_bytes).value()
+                            : z_format::f64;
 
-  assert(map_age_u16.element_bytes == sizeof(uint16_t));
+  assert(age_format_of(map_age.element_bytes).has_value());
+  const age_format afmt = age_format_of(map_age.element_bytes).value();
 
-  assert(maxit <= libHybractal::maxit_max);
+  assert(age_format_for_maxit(maxit) <= afmt);
 
   const std::complex<float_t> left_top{wind_C.left_top_corner()[0],
                                        wind_C.left_top_corner()[1]};
-  const float_t r_unit = -wind_C.y_span / map_age_u16.rows;
-  const float_t c_unit = wind_C.x_span / map_age_u16.cols;
+  const float_t r_unit = -wind_C.y_span / frame_size[0];
+  const float_t c_unit = wind_C.x_span / frame_size[1];
 
-#pragma omp parallel for schedule(dynamic)
-  for (size_t r = 0; r < map_age_u16.rows; r++) {
+  for (size_t r = block[0]; r < block[1]; r++) {
     const float_t imag = left_top.imag() + r * r_unit;
-    for (size_t c = 0; c < map_age_u16.cols; c++) {
+    for (size_t c = block[2]; c < block[3]; c++) {
       const float_t real = left_top.real() + c * c_unit;
       std::complex<float_t> z{0, 0};
       const std::complex<float_t> C{real, imag};
@@ -148,56 +338,287 @@ void compute_frame_private(const fractal_utils::center_wind<float_t> &wind_C,
       int age = DECLARE_HYBRACTAL_SEQUENCE(
           HYBRACTAL_SEQUENCE_STR)::compute_age<float_t>(z, C, maxit);
 
-      if (age < 0) {
-        age = UINT16_MAX;
+      const size_t idx = (r - origin[0]) * map_age.cols + (c - origin[1]);
+      store_age(map_age.data, idx, afmt, age);
+      if (stats != nullptr) {
+        stats->add((age < 0) ? age_inside : uint32_t(age), maxit);
       }
 
-      map_age_u16.at<uint16_t>(r, c) = static_cast<uint16_t>(age);
-
       if (map_z != nullptr) {
         if constexpr (std::is_trivial_v<float_t>) {
-          map_z->at<std::complex<hybf_store_t>>(r, c).real(double(z.real()));
-          map_z->at<std::complex<hybf_store_t>>(r, c).imag(double(z.imag()));
+          store_z(map_z->data, idx, zfmt, double(z.real()), double(z.imag()));
         } else {
-          auto &cplx = map_z->at<std::complex<hybf_store_t>>(r, c);
-          cplx.real(float_type_cvt<float_t, hybf_store_t>(z.real()));
-          cplx.imag(float_type_cvt<float_t, hybf_store_t>(z.imag()));
+          store_z(map_z->data, idx, zfmt,
+                  float_type_cvt<float_t, hybf_store_t>(z.real()),
+                  float_type_cvt<float_t, hybf_store_t>(z.imag()));
         }
       }
     }
   }
 }
 
-void libHybractal::compute_frame_by_precision(
-    const fractal_utils::wind_base &wind_C, int precision, const uint16_t maxit,
-    fractal_utils::fractal_map &map_age_u16,
+template <typename float_t>
+void compute_block_private(const fractal_utils::center_wind<float_t> &wind_C,
+                           const int maxit,
+                           fractal_utils::fractal_map &map_age,
+                           fractal_utils::fractal_map *map_z,
+                           const libHybractal::pixel_block &block,
+                           libHybractal::frame_stats *stats) noexcept {
+  compute_tile_private(wind_C, maxit, {map_age.rows, map_age.cols}, {0, 0},
+                       map_age, map_z, block, stats);
+}
+
+template <typename float_t>
+void compute_tile_parallel(const fractal_utils::center_wind<float_t> &wind_C,
+                           const int maxit,
+                           const std::array<size_t, 2> &frame_size,
+                           fractal_utils::fractal_map &map_age,
+                           fractal_utils::fractal_map *map_z,
+                           const libHybractal::pixel_block &block) noexcept {
+#pragma omp parallel for schedule(dynamic)
+  for (size_t r = block[0]; r < block[1]; r++) {
+    compute_tile_private(wind_C, maxit, frame_size, {block[0], block[2]},
+                         map_age, map_z, {r, r + 1, block[2], block[3]},
+                         nullptr);
+  }
+}
+
+template <typename float_t>
+void compute_frame_private(const fractal_utils::center_wind<float_t> &wind_C,
+                           const int maxit,
+                           fractal_utils::fractal_map &map_age,
+                           fractal_utils::fractal_map *map_z,
+                           libHybractal::frame_stats *stats,
+                           const libHybractal::cost_map *cost) noexcept {
+  using namespace libHybractal;
+  const double wtime = omp_get_wtime();
+  if (stats != nullptr) {
+    *stats = frame_stats::make(maxit);
+  }
+  const auto blocks = frame_blocks(map_age.rows, map_age.cols, cost);
+#pragma omp parallel
+  {
+    // every thread counts into its own histogram, which are merged at last
+    frame_stats local;
+    if (stats != nullptr) {
+      local = frame_stats::make(maxit);
+    }
+#pragma omp for schedule(dynamic)
+    for (size_t b = 0; b < blocks.size(); b++) {
+      compute_block_private(wind_C, maxit, map_age, map_z, blocks[b],
+                            (stats != nullptr) ? &local : nullptr);
+    }
+    if (stats != nullptr) {
+#pragma omp critical
+      stats->merge(local);
+    }
+  }
+  if (stats != nullptr) {
+    stats->wall_time = omp_get_wtime() - wtime;
+  }
+}
+
+template <typename float_t>
+void compute_expmap_private(const fractal_utils::center_wind<float_t> &wind_C,
+                            const int maxit, double r_max,
+                            double log_step,
+                            fractal_utils::fractal_map &map_age,
+                            fractal_utils::fractal_map *map_z) noexcept {
+  using namespace libHybractal;
+  if (map_z != nullptr) {
+    assert(map_z->rows == map_age.rows);
+    assert(map_z->cols == map_age.cols);
+    assert(z_format_of(map_z->element_bytes).has_value());
+  }
+  const z_format zfmt = (map_z != nullptr)
+                            ? z_format_of(map_z->element_bytes).value()
+                            : z_format::f64;
+
+  assert(age_format_of(map_age.element_bytes).has_value());
+  const age_format afmt = age_format_of(map_age.element_bytes).value();
+  assert(age_format_for_maxit(maxit) <= afmt);
+
+  const std::complex<float_t> center{wind_C.center[0], wind_C.center[1]};
+
+  // The offsets are small enough to be represented in double even for deep
+  // zooms, only the sum with center requires float_t.
+  std::vector<std::complex<double>> unit_circle(map_age.cols);
+  for (size_t c = 0; c < map_age.cols; c++) {
+    unit_circle[c] = std::polar(1.0, 2 * M_PI * c / map_age.cols);
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (size_t r = 0; r < map_age.rows; r++) {
+    const double radius = r_max * std::exp(-double(r) * log_step);
+    for (size_t c = 0; c < map_age.cols; c++) {
+      const std::complex<double> offset = radius * unit_circle[c];
+      std::complex<float_t> z{0, 0};
+      const std::complex<float_t> C{center.real() + float_t(offset.real()),
+                                    center.imag() + float_t(offset.imag())};
+
+      int age = DECLARE_HYBRACTAL_SEQUENCE(
+          HYBRACTAL_SEQUENCE_STR)::compute_age<float_t>(z, C, maxit);
+
+      store_age(map_age.data, r * map_age.cols + c, afmt, age);
+
+      if (map_z != nullptr) {
+        store_z(map_z->data, r * map_z->cols + c, zfmt,
+                float_type_cvt<float_t, hybf_store_t>(z.real()),
+                float_type_cvt<float_t, hybf_store_t>(z.imag()));
+      }
+    }
+  }
+}
+
+void libHybractal::compute_expmap_by_precision(
+    const fractal_utils::wind_base &wind_C, int precision, const int maxit,
+    double r_max, double log_step, fractal_utils::fractal_map &map_age,
     fractal_utils::fractal_map *map_z) noexcept {
+  switch (precision) {
+    case 1:
+      compute_expmap_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<1>> &>(
+              wind_C),
+          maxit, r_max, log_step, map_age, map_z);
+      break;
+    case 2:
+      compute_expmap_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<2>> &>(
+              wind_C),
+          maxit, r_max, log_step, map_age, map_z);
+      break;
+    case 4:
+      compute_expmap_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<4>> &>(
+              wind_C),
+          maxit, r_max, log_step, map_age, map_z);
+      break;
+    case 8:
+      compute_expmap_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<8>> &>(
+              wind_C),
+          maxit, r_max, log_step, map_age, map_z);
+      break;
+    default:
+      abort();
+  }
+}
+
+void libHybractal::compute_frame_by_precision(
+    const fractal_utils::wind_base &wind_C, int precision, const int maxit,
+    fractal_utils::fractal_map &map_age, fractal_utils::fractal_map *map_z,
+    frame_stats *stats, const cost_map *cost) noexcept {
   switch (precision) {
     case 1:
       compute_frame_private(
           dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<1>> &>(
               wind_C),
-          maxit, map_age_u16, map_z);
+          maxit, map_age, map_z, stats, cost);
       break;
     case 2:
       compute_frame_private(
           dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<2>> &>(
               wind_C),
-          maxit, map_age_u16, map_z);
+          maxit, map_age, map_z, stats, cost);
       break;
     case 4:
       compute_frame_private(
           dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<4>> &>(
               wind_C),
-          maxit, map_age_u16, map_z);
+          maxit, map_age, map_z, stats, cost);
       break;
     case 8:
       compute_frame_private(
           dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<8>> &>(
               wind_C),
-          maxit, map_age_u16, map_z);
+          maxit, map_age, map_z, stats, cost);
       break;
     default:
       abort();
   }
-}
\ No newline at end of file
+}
+
+void libHybractal::compute_block_by_precision(
+    const fractal_utils::wind_base &wind_C, int precision, const int maxit,
+    fractal_utils::fractal_map &map_age, fractal_utils::fractal_map *map_z,
+    const pixel_block &block, frame_stats *stats) noexcept {
+  switch (precision) {
+    case 1:
+      compute_block_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<1>> &>(
+              wind_C),
+          maxit, map_age, map_z, block, stats);
+      break;
+    case 2:
+      compute_block_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<2>> &>(
+              wind_C),
+          maxit, map_age, map_z, block, stats);
+      break;
+    case 4:
+      compute_block_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<4>> &>(
+              wind_C),
+          maxit, map_age, map_z, block, stats);
+      break;
+    case 8:
+      compute_block_private(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<8>> &>(
+              wind_C),
+          maxit, map_age, map_z, block, stats);
+      break;
+    default:
+      abort();
+  }
+}
+
+void libHybractal::compute_tile_by_precision(
+    const fractal_utils::wind_base &wind_C, int precision, const int maxit,
+    size_t frame_rows, size_t frame_cols, const pixel_block &block,
+    fractal_utils::fractal_map &map_age,
+    fractal_utils::fractal_map *map_z) noexcept {
+  assert(map_age.rows == block[1] - block[0]);
+  assert(map_age.cols == block[3] - block[2]);
+  switch (precision) {
+    case 1:
+      compute_tile_parallel(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<1>> &>(
+              wind_C),
+          maxit, {frame_rows, frame_cols}, map_age, map_z, block);
+      break;
+    case 2:
+      compute_tile_parallel(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<2>> &>(
+              wind_C),
+          maxit, {frame_rows, frame_cols}, map_age, map_z, block);
+      break;
+    case 4:
+      compute_tile_parallel(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<4>> &>(
+              wind_C),
+          maxit, {frame_rows, frame_cols}, map_age, map_z, block);
+      break;
+    case 8:
+      compute_tile_parallel(
+          dynamic_cast<const fractal_utils::center_wind<float_by_prec_t<8>> &>(
+              wind_C),
+          maxit, {frame_rows, frame_cols}, map_age, map_z, block);
+      break;
+    default:
+      abort();
+  }
+}
+
+int libHybractal::estimate_maxit(const fractal_utils::wind_base &wind_C,
+                                 int precision, int maxit_cap, int maxit_min,
+                                 size_t probe_rows, size_t probe_cols,
+                                 double tolerance) noexcept {
+  fractal_utils::fractal_map probe_age(
+      probe_rows, probe_cols,
+      age_element_bytes(age_format_for_maxit(maxit_cap)));
+  frame_stats stats;
+  compute_frame_by_precision(wind_C, precision, maxit_cap, probe_age, nullptr,
+                             &stats);
+  const int suggested = stats.suggest_maxit(tolerance);
+  return std::clamp(suggested, std::min(maxit_min, maxit_cap), maxit_cap);
+}
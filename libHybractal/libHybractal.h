@@ -305,7 +305,10 @@ float_t hex_to_float_by_gen(std::string_view hex, int8_t gen, std::string &err,
   return variant_to_float<float_t>(var);
 }
 
+// The largest maxit that uint16 ages can hold. Larger maxit requires uint32
+// ages, see age_format.
 static constexpr uint16_t maxit_max = UINT16_MAX - 1;
+static constexpr int maxit_max_wide = INT32_MAX;
 
 template <typename float_t, typename cplx_t = std::complex<float_t>>
 HYBRACTAL_HOST_DEVICE_FUN inline cplx_t iterate_mandelbrot(
@@ -487,11 +490,276 @@ constexpr uint64_t global_sequence_len =
 
 #include <fractal_map.h>
 
+#include <cmath>
+#include <optional>
+#include <string_view>
+
 namespace libHybractal {
 
+// How mat_z is stored in memory and in files. The computed z always has
+// |z| < 2, so the norm and angle can be quantized without a scale.
+enum class z_format : uint8_t {
+  // std::complex<hybf_store_t>, 16 bytes
+  f64 = 0,
+  // std::complex<float>, 8 bytes
+  f32 = 1,
+  // z_norm_angle, 4 bytes
+  norm_angle_u16 = 2,
+};
+
+struct z_norm_angle {
+  // |z| / 2 in [0, 1]
+  uint16_t norm;
+  // (arg(z) + pi) / (2 * pi) in [0, 1]
+  uint16_t angle;
+};
+
+std::string_view z_format_name(z_format fmt) noexcept;
+std::optional<z_format> parse_z_format(std::string_view name) noexcept;
+
+HYBRACTAL_HOST_DEVICE_FUN constexpr size_t z_element_bytes(
+    z_format fmt) noexcept {
+  switch (fmt) {
+    case z_format::f32:
+      return 2 * sizeof(float);
+    case z_format::norm_angle_u16:
+      return sizeof(z_norm_angle);
+    default:
+      return 2 * sizeof(hybf_store_t);
+  }
+}
+
+// Element bytes of all formats are different, so a fractal_map of z tells its
+// format by itself.
+inline std::optional<z_format> z_format_of(size_t element_bytes) noexcept {
+  for (auto fmt : {z_format::f64, z_format::f32, z_format::norm_angle_u16}) {
+    if (z_element_bytes(fmt) == element_bytes) {
+      return fmt;
+    }
+  }
+  return std::nullopt;
+}
+
+HYBRACTAL_HOST_DEVICE_FUN inline void store_z(void *dst, size_t idx,
+                                              z_format fmt, double re,
+                                              double im) noexcept {
+  switch (fmt) {
+    case z_format::f32: {
+      float *const p = reinterpret_cast<float *>(dst) + 2 * idx;
+      p[0] = float(re);
+      p[1] = float(im);
+    } break;
+    case z_format::norm_angle_u16: {
+      const double norm = std::min(1.0, std::sqrt(re * re + im * im) / 2);
+      const double angle = (std::atan2(im, re) + M_PI) / (2 * M_PI);
+      z_norm_angle &p = reinterpret_cast<z_norm_angle *>(dst)[idx];
+      p.norm = uint16_t(norm * UINT16_MAX + 0.5);
+      p.angle = uint16_t(angle * UINT16_MAX + 0.5);
+    } break;
+    default: {
+      hybf_store_t *const p = reinterpret_cast<hybf_store_t *>(dst) + 2 * idx;
+      p[0] = re;
+      p[1] = im;
+    }
+  }
+}
+
+template <typename flt_t>
+HYBRACTAL_HOST_DEVICE_FUN inline void load_z(const void *src, size_t idx,
+                                             z_format fmt, flt_t &re,
+                                             flt_t &im) noexcept {
+  switch (fmt) {
+    case z_format::f32: {
+      const float *const p = reinterpret_cast<const float *>(src) + 2 * idx;
+      re = flt_t(p[0]);
+      im = flt_t(p[1]);
+    } break;
+    case z_format::norm_angle_u16: {
+      const z_norm_angle p = reinterpret_cast<const z_norm_angle *>(src)[idx];
+      const flt_t norm = flt_t(2) * p.norm / UINT16_MAX;
+      const flt_t angle = flt_t(2 * M_PI) * p.angle / UINT16_MAX - flt_t(M_PI);
+      re = norm * std::cos(angle);
+      im = norm * std::sin(angle);
+    } break;
+    default: {
+      const hybf_store_t *const p =
+          reinterpret_cast<const hybf_store_t *>(src) + 2 * idx;
+      re = flt_t(p[0]);
+      im = flt_t(p[1]);
+    }
+  }
+}
+
+// How mat_age is stored. Pixels that never escape are stored as the max value
+// of the type.
+enum class age_format : uint8_t {
+  u16 = 0,
+  u32 = 1,
+};
+
+// load_age() returns this for pixels that never escape.
+constexpr uint32_t age_inside = UINT32_MAX;
+
+std::string_view age_format_name(age_format fmt) noexcept;
+
+constexpr age_format age_format_for_maxit(int64_t maxit) noexcept {
+  return (maxit <= maxit_max) ? age_format::u16 : age_format::u32;
+}
+
+HYBRACTAL_HOST_DEVICE_FUN constexpr size_t age_element_bytes(
+    age_format fmt) noexcept {
+  return (fmt == age_format::u32) ? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
+inline std::optional<age_format> age_format_of(size_t element_bytes) noexcept {
+  for (auto fmt : {age_format::u16, age_format::u32}) {
+    if (age_element_bytes(fmt) == element_bytes) {
+      return fmt;
+    }
+  }
+  return std::nullopt;
+}
+
+// Negative age means the pixel never escapes.
+HYBRACTAL_HOST_DEVICE_FUN inline void store_age(void *dst, size_t idx,
+                                                age_format fmt,
+                                                int age) noexcept {
+  if (fmt == age_format::u32) {
+    reinterpret_cast<uint32_t *>(dst)[idx] =
+        (age < 0) ? UINT32_MAX : uint32_t(age);
+  } else {
+    reinterpret_cast<uint16_t *>(dst)[idx] =
+        (age < 0) ? UINT16_MAX : uint16_t(age);
+  }
+}
+
+HYBRACTAL_HOST_DEVICE_FUN inline uint32_t load_age(const void *src,
+                                                   size_t idx,
+                                                   age_format fmt) noexcept {
+  if (fmt == age_format::u32) {
+    return reinterpret_cast<const uint32_t *>(src)[idx];
+  }
+  const uint16_t age = reinterpret_cast<const uint16_t *>(src)[idx];
+  return (age == UINT16_MAX) ? age_inside : age;
+}
+
+// Statistics of a computed frame. Escaping ages are counted in bins of
+// bin_width, so that the histogram has at most max_bins bins whatever maxit
+// is.
+struct frame_stats {
+  uint32_t bin_width{1};
+  std::vector<uint64_t> age_histogram;
+  uint64_t escaped{0};
+  uint64_t inside{0};
+  // pixels that never escape count maxit iterations
+  uint64_t total_iterations{0};
+  // seconds spent on computing
+  double wall_time{0};
+
+  static constexpr uint32_t max_bins = 4096;
+
+  // empty statistics with bins for ages in [0, maxit]
+  static frame_stats make(int maxit) noexcept;
+
+  inline void add(uint32_t age, int maxit) noexcept {
+    if (age == age_inside) {
+      this->inside++;
+      this->total_iterations += maxit;
+      return;
+    }
+    this->escaped++;
+    this->total_iterations += age;
+    this->age_histogram[age / this->bin_width]++;
+  }
+
+  // src must have the same bins
+  void merge(const frame_stats &src) noexcept;
+
+  // smallest escaping age that is not less than q of the escaped pixels,
+  // rounded down to its bin
+  uint32_t age_quantile(double q) const noexcept;
+
+  // Smallest maxit, rounded up to bins, with which at most tolerance of all
+  // pixels escape later than maxit. Returns 0 if no pixel needs to escape.
+  int suggest_maxit(double tolerance) const noexcept;
+};
+
+// Count the ages of a computed map, wall_time is left 0.
+frame_stats make_frame_stats(const fractal_utils::fractal_map &map_age,
+                             int maxit) noexcept;
+
+inline void store_z(fractal_utils::fractal_map &map_z, size_t r, size_t c,
+                    double re, double im) noexcept {
+  store_z(map_z.data, r * map_z.cols + c,
+          z_format_of(map_z.element_bytes).value(), re, im);
+}
+
+// Predicted iteration cost of a frame on a coarse grid. Cell (r, c) covers
+// pixel rows [r * frame_rows / rows, (r + 1) * frame_rows / rows), and
+// likewise for cols.
+struct cost_map {
+  size_t rows{0};
+  size_t cols{0};
+  std::vector<double> cost;
+};
+
+// Predict the cost of the next frame of a zoom, whose spans are 1/ratio of
+// this frame, from the center of this frame's map_age. Pixels that never
+// escape cost maxit.
+cost_map predict_zoom_cost(const fractal_utils::fractal_map &map_age,
+                           int maxit, double ratio, size_t cost_rows,
+                           size_t cost_cols) noexcept;
+
+// pixels in rows [b[0], b[1]) and cols [b[2], b[3])
+using pixel_block = std::array<size_t, 4>;
+
+// Blocks that cover a frame. Without cost they are rows in order, otherwise
+// they are the cells of cost from the most expensive one, so that handing
+// them out in order lets all threads finish at nearly the same time.
+std::vector<pixel_block> frame_blocks(size_t rows, size_t cols,
+                                      const cost_map *cost) noexcept;
+
+// map_age holds uint16 or uint32 ages (see age_format), and map_z_nullable
+// holds any z_format. maxit must fit in the age format. If stats is not null,
+// it is filled while computing. If cost is not null, see frame_blocks.
 void compute_frame_by_precision(
-    const fractal_utils::wind_base &wind_C, int precision, const uint16_t maxit,
-    fractal_utils::fractal_map &map_age_u16,
+    const fractal_utils::wind_base &wind_C, int precision, const int maxit,
+    fractal_utils::fractal_map &map_age,
+    fractal_utils::fractal_map *map_z_nullable,
+    frame_stats *stats = nullptr, const cost_map *cost = nullptr) noexcept;
+
+// Compute one block of a frame in the calling thread, for schedulers that
+// share threads among frames. Ages are added to stats if it is not null.
+void compute_block_by_precision(const fractal_utils::wind_base &wind_C,
+                                int precision, const int maxit,
+                                fractal_utils::fractal_map &map_age,
+                                fractal_utils::fractal_map *map_z_nullable,
+                                const pixel_block &block,
+                                frame_stats *stats) noexcept;
+
+// Compute block of a frame of frame_rows * frame_cols pixels into map_age and
+// map_z_nullable, which are as large as the block, with rows in parallel.
+// Pixels are the same as those computed with the whole frame, so that tiles
+// computed elsewhere can be stitched together.
+void compute_tile_by_precision(
+    const fractal_utils::wind_base &wind_C, int precision, const int maxit,
+    size_t frame_rows, size_t frame_cols, const pixel_block &block,
+    fractal_utils::fractal_map &map_age,
+    fractal_utils::fractal_map *map_z_nullable) noexcept;
+
+// Estimate the maxit of a frame from a probe of probe_rows * probe_cols pixels
+// of the same window computed with maxit_cap, see frame_stats::suggest_maxit.
+// The result is clamped into [maxit_min, maxit_cap].
+int estimate_maxit(const fractal_utils::wind_base &wind_C, int precision,
+                   int maxit_cap, int maxit_min, size_t probe_rows,
+                   size_t probe_cols, double tolerance) noexcept;
+
+// Compute the exponential map (log-polar strip) around the center of wind_C.
+// Row r samples the circle of radius r_max * exp(-r * log_step), and column c
+// samples the angle 2 * pi * c / cols. The spans of wind_C are not used.
+void compute_expmap_by_precision(
+    const fractal_utils::wind_base &wind_C, int precision, const int maxit,
+    double r_max, double log_step, fractal_utils::fractal_map &map_age,
     fractal_utils::fractal_map *map_z_nullable) noexcept;
 
 }  // namespace libHybractal
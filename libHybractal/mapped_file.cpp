@@ -0,0 +1,111 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fmt/format.h>
+
+#include "libHybfile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
+
+std::shared_ptr<libHybractal::mapped_file> libHybractal::mapped_file::open(
+    std::string_view filename, std::string &err) noexcept {
+  std::shared_ptr<mapped_file> ret{new mapped_file};
+  const std::string name{filename};
+#ifdef _WIN32
+  HANDLE file = CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    err = fmt::format("Failed to open {}, error code {}.", filename,
+                      GetLastError());
+    return nullptr;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart <= 0) {
+    CloseHandle(file);
+    err = fmt::format("Failed to get the size of {} or it is empty.",
+                      filename);
+    return nullptr;
+  }
+  // The view keeps the mapping and the file alive after their handles are
+  // closed.
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) {
+    err = fmt::format("Failed to map {}, error code {}.", filename,
+                      GetLastError());
+    return nullptr;
+  }
+  void *data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(mapping);
+  if (data == nullptr) {
+    err = fmt::format("Failed to map {}, error code {}.", filename,
+                      GetLastError());
+    return nullptr;
+  }
+  ret->m_data = reinterpret_cast<uint8_t *>(data);
+  ret->m_size = size_t(size.QuadPart);
+#else
+  const int fd = ::open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err = fmt::format("Failed to open {}: {}", filename, strerror(errno));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    err = fmt::format("Failed to get the size of {} or it is empty.",
+                      filename);
+    return nullptr;
+  }
+  // Private mapping, so pages that are written are copied instead of being
+  // written back.
+  void *data = mmap(nullptr, size_t(st.st_size), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    err = fmt::format("Failed to map {}: {}", filename, strerror(errno));
+    return nullptr;
+  }
+  ret->m_data = reinterpret_cast<uint8_t *>(data);
+  ret->m_size = size_t(st.st_size);
+#endif
+  return ret;
+}
+
+libHybractal::mapped_file::~mapped_file() {
+  if (this->m_data == nullptr) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(this->m_data);
+#else
+  munmap(this->m_data, this->m_size);
+#endif
+}
@@ -0,0 +1,509 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fmt/format.h>
+#include <omp.h>
+#include <png.h>
+#include <stdio.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "libRender.h"
+
+namespace {
+
+void append_u32_be(std::vector<uint8_t> &dst, uint32_t val) noexcept {
+  dst.push_back(uint8_t(val >> 24));
+  dst.push_back(uint8_t(val >> 16));
+  dst.push_back(uint8_t(val >> 8));
+  dst.push_back(uint8_t(val));
+}
+
+uint32_t read_u32_be(const uint8_t *src) noexcept {
+  return (uint32_t(src[0]) << 24) | (uint32_t(src[1]) << 16) |
+         (uint32_t(src[2]) << 8) | uint32_t(src[3]);
+}
+
+void append_png_chunk(std::vector<uint8_t> &dst, const char type[4],
+                      const uint8_t *data, size_t bytes) noexcept {
+  append_u32_be(dst, uint32_t(bytes));
+  const size_t type_pos = dst.size();
+  dst.insert(dst.end(), type, type + 4);
+  dst.insert(dst.end(), data, data + bytes);
+  const uLong crc = crc32(0, dst.data() + type_pos, uInt(bytes + 4));
+  append_u32_be(dst, uint32_t(crc));
+}
+
+// Deflate a strip of rows into a raw deflate segment. Segments except the last
+// one end with a sync flush, so that they can be concatenated into one stream.
+bool deflate_strip(const void *const *row_ptrs, size_t row_beg, size_t row_end,
+                   size_t row_bytes, int level, bool is_last,
+                   std::vector<uint8_t> &dst, uLong &adler) noexcept {
+  thread_local std::vector<uint8_t> filtered;
+  filtered.resize((row_end - row_beg) * (row_bytes + 1));
+
+  // filter type 2 (Up), which only depends on the unfiltered previous row.
+  for (size_t r = row_beg; r < row_end; r++) {
+    uint8_t *const out = filtered.data() + (r - row_beg) * (row_bytes + 1);
+    const uint8_t *const cur = reinterpret_cast<const uint8_t *>(row_ptrs[r]);
+    out[0] = 2;
+    if (r == 0) {
+      memcpy(out + 1, cur, row_bytes);
+      continue;
+    }
+    const uint8_t *const prev =
+        reinterpret_cast<const uint8_t *>(row_ptrs[r - 1]);
+#pragma omp simd
+    for (size_t i = 0; i < row_bytes; i++) {
+      out[i + 1] = uint8_t(cur[i] - prev[i]);
+    }
+  }
+
+  adler = adler32(1L, filtered.data(), uInt(filtered.size()));
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    return false;
+  }
+
+  dst.resize(deflateBound(&strm, filtered.size()) + 16);
+  strm.next_in = filtered.data();
+  strm.avail_in = uInt(filtered.size());
+  strm.next_out = dst.data();
+  strm.avail_out = uInt(dst.size());
+
+  const int ret = deflate(&strm, is_last ? Z_FINISH : Z_SYNC_FLUSH);
+  const bool ok = is_last ? (ret == Z_STREAM_END)
+                          : (ret == Z_OK && strm.avail_in == 0);
+  dst.resize(dst.size() - strm.avail_out);
+  deflateEnd(&strm);
+  return ok;
+}
+
+bool write_buffer(const char *filename, const std::vector<uint8_t> &buffer) {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == nullptr) {
+    return false;
+  }
+  const size_t written = fwrite(buffer.data(), 1, buffer.size(), fp);
+  fclose(fp);
+  return written == buffer.size();
+}
+
+bool read_buffer(const char *filename, std::vector<uint8_t> &buffer) {
+  std::ifstream ifs{filename, std::ios::binary};
+  if (!ifs) {
+    return false;
+  }
+  ifs.seekg(0, std::ios::end);
+  buffer.resize(size_t(ifs.tellg()));
+  ifs.seekg(0, std::ios::beg);
+  ifs.read(reinterpret_cast<char *>(buffer.data()), buffer.size());
+  return bool(ifs);
+}
+
+}  // namespace
+
+bool libHybractal::encode_png_u8c3(const void *const *row_ptrs, size_t rows,
+                                   size_t cols, int level,
+                                   std::vector<uint8_t> &dst) noexcept {
+  const size_t row_bytes = cols * 3;
+
+  // Strips should be large enough for deflate to find matches, and numerous
+  // enough to keep all threads busy.
+  const size_t threads = std::max(omp_get_max_threads(), 1);
+  const size_t strip_rows =
+      std::max<size_t>(32, (rows + 2 * threads - 1) / (2 * threads));
+  const size_t strip_num = (rows + strip_rows - 1) / strip_rows;
+
+  std::vector<std::vector<uint8_t>> segments(strip_num);
+  std::vector<uLong> adlers(strip_num);
+  int fail_counter = 0;
+
+#pragma omp parallel for schedule(dynamic) reduction(+ : fail_counter)
+  for (size_t s = 0; s < strip_num; s++) {
+    const size_t beg = s * strip_rows;
+    const size_t end = std::min(beg + strip_rows, rows);
+    if (!deflate_strip(row_ptrs, beg, end, row_bytes, level,
+                       s == strip_num - 1, segments[s], adlers[s])) {
+      fail_counter++;
+    }
+  }
+
+  if (fail_counter > 0) {
+    return false;
+  }
+
+  // zlib stream: header, concatenated deflate segments, adler32 of all.
+  std::vector<uint8_t> idat;
+  {
+    size_t total = 6;
+    for (const auto &seg : segments) {
+      total += seg.size();
+    }
+    idat.reserve(total);
+  }
+  idat.push_back(0x78);
+  idat.push_back(0x01);
+  uLong adler = 1L;
+  for (size_t s = 0; s < strip_num; s++) {
+    idat.insert(idat.end(), segments[s].begin(), segments[s].end());
+    const size_t beg = s * strip_rows;
+    const size_t end = std::min(beg + strip_rows, rows);
+    adler = adler32_combine(adler, adlers[s],
+                            z_off_t((end - beg) * (row_bytes + 1)));
+  }
+  append_u32_be(idat, uint32_t(adler));
+
+  dst.clear();
+  dst.reserve(idat.size() + 64);
+  const uint8_t signature[8]{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  dst.insert(dst.end(), signature, signature + 8);
+
+  {
+    std::vector<uint8_t> ihdr;
+    append_u32_be(ihdr, uint32_t(cols));
+    append_u32_be(ihdr, uint32_t(rows));
+    // bit depth 8, color type 2 (RGB), deflate, adaptive filtering, no
+    // interlace
+    const uint8_t rest[5]{8, 2, 0, 0, 0};
+    ihdr.insert(ihdr.end(), rest, rest + 5);
+    append_png_chunk(dst, "IHDR", ihdr.data(), ihdr.size());
+  }
+
+  // A chunk holds at most 2^31-1 bytes, consecutive IDAT chunks are joined by
+  // decoders.
+  constexpr size_t max_chunk = size_t(1) << 30;
+  for (size_t offset = 0; offset < idat.size(); offset += max_chunk) {
+    const size_t bytes = std::min(max_chunk, idat.size() - offset);
+    append_png_chunk(dst, "IDAT", idat.data() + offset, bytes);
+  }
+
+  append_png_chunk(dst, "IEND", nullptr, 0);
+  return true;
+}
+
+namespace {
+constexpr uint8_t qoi_op_index = 0x00;
+constexpr uint8_t qoi_op_diff = 0x40;
+constexpr uint8_t qoi_op_luma = 0x80;
+constexpr uint8_t qoi_op_run = 0xc0;
+constexpr uint8_t qoi_op_rgb = 0xfe;
+constexpr uint8_t qoi_mask_2 = 0xc0;
+
+struct qoi_rgba {
+  uint8_t r, g, b, a;
+  bool operator==(const qoi_rgba &another) const noexcept {
+    return r == another.r && g == another.g && b == another.b &&
+           a == another.a;
+  }
+};
+
+inline int qoi_hash(const qoi_rgba &px) noexcept {
+  return (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+}
+
+constexpr uint8_t qoi_padding[8]{0, 0, 0, 0, 0, 0, 0, 1};
+}  // namespace
+
+void libHybractal::encode_qoi_u8c3(const void *const *row_ptrs, size_t rows,
+                                   size_t cols,
+                                   std::vector<uint8_t> &dst) noexcept {
+  dst.clear();
+  dst.reserve(14 + rows * cols * 4 + 8);
+
+  const char magic[4]{'q', 'o', 'i', 'f'};
+  dst.insert(dst.end(), magic, magic + 4);
+  append_u32_be(dst, uint32_t(cols));
+  append_u32_be(dst, uint32_t(rows));
+  dst.push_back(3);  // channels
+  dst.push_back(0);  // sRGB
+
+  qoi_rgba index[64];
+  memset(index, 0, sizeof(index));
+  qoi_rgba prev{0, 0, 0, 255};
+  int run = 0;
+
+  for (size_t r = 0; r < rows; r++) {
+    const uint8_t *const row = reinterpret_cast<const uint8_t *>(row_ptrs[r]);
+    for (size_t c = 0; c < cols; c++) {
+      const qoi_rgba px{row[c * 3], row[c * 3 + 1], row[c * 3 + 2], 255};
+      const bool is_last = (r == rows - 1) && (c == cols - 1);
+
+      if (px == prev) {
+        run++;
+        if (run == 62 || is_last) {
+          dst.push_back(qoi_op_run | uint8_t(run - 1));
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run > 0) {
+        dst.push_back(qoi_op_run | uint8_t(run - 1));
+        run = 0;
+      }
+
+      const int hash = qoi_hash(px);
+      if (index[hash] == px) {
+        dst.push_back(qoi_op_index | uint8_t(hash));
+        prev = px;
+        continue;
+      }
+      index[hash] = px;
+
+      const int8_t vr = int8_t(px.r - prev.r);
+      const int8_t vg = int8_t(px.g - prev.g);
+      const int8_t vb = int8_t(px.b - prev.b);
+      const int8_t vg_r = vr - vg;
+      const int8_t vg_b = vb - vg;
+
+      if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+        dst.push_back(qoi_op_diff | uint8_t((vr + 2) << 4) |
+                      uint8_t((vg + 2) << 2) | uint8_t(vb + 2));
+      } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 &&
+                 vg_b < 8) {
+        dst.push_back(qoi_op_luma | uint8_t(vg + 32));
+        dst.push_back(uint8_t((vg_r + 8) << 4) | uint8_t(vg_b + 8));
+      } else {
+        dst.push_back(qoi_op_rgb);
+        dst.push_back(px.r);
+        dst.push_back(px.g);
+        dst.push_back(px.b);
+      }
+      prev = px;
+    }
+  }
+
+  dst.insert(dst.end(), qoi_padding, qoi_padding + 8);
+}
+
+bool libHybractal::decode_qoi_u8c3(const uint8_t *src, size_t bytes,
+                                   std::vector<uint8_t> &dst, size_t &rows,
+                                   size_t &cols) noexcept {
+  if (bytes < 14 + 8 || memcmp(src, "qoif", 4) != 0) {
+    return false;
+  }
+  cols = read_u32_be(src + 4);
+  rows = read_u32_be(src + 8);
+  dst.resize(rows * cols * 3);
+
+  qoi_rgba index[64];
+  memset(index, 0, sizeof(index));
+  qoi_rgba px{0, 0, 0, 255};
+  int run = 0;
+  size_t pos = 14;
+  const size_t end = bytes - 8;
+
+  for (size_t i = 0; i < rows * cols; i++) {
+    if (run > 0) {
+      run--;
+    } else if (pos < end) {
+      const uint8_t b1 = src[pos++];
+      if (b1 == qoi_op_rgb) {
+        px.r = src[pos++];
+        px.g = src[pos++];
+        px.b = src[pos++];
+      } else if (b1 == 0xff) {  // QOI_OP_RGBA
+        px.r = src[pos++];
+        px.g = src[pos++];
+        px.b = src[pos++];
+        px.a = src[pos++];
+      } else if ((b1 & qoi_mask_2) == qoi_op_index) {
+        px = index[b1];
+      } else if ((b1 & qoi_mask_2) == qoi_op_diff) {
+        px.r += ((b1 >> 4) & 0x03) - 2;
+        px.g += ((b1 >> 2) & 0x03) - 2;
+        px.b += (b1 & 0x03) - 2;
+      } else if ((b1 & qoi_mask_2) == qoi_op_luma) {
+        const uint8_t b2 = src[pos++];
+        const int vg = (b1 & 0x3f) - 32;
+        px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+        px.g += vg;
+        px.b += vg - 8 + (b2 & 0x0f);
+      } else {  // QOI_OP_RUN
+        run = (b1 & 0x3f);
+      }
+      index[qoi_hash(px)] = px;
+    } else {
+      return false;
+    }
+
+    dst[i * 3] = px.r;
+    dst[i * 3 + 1] = px.g;
+    dst[i * 3 + 2] = px.b;
+  }
+
+  return true;
+}
+
+void libHybractal::encode_ppm_u8c3(const void *const *row_ptrs, size_t rows,
+                                   size_t cols,
+                                   std::vector<uint8_t> &dst) noexcept {
+  const std::string header = fmt::format("P6\n{} {}\n255\n", cols, rows);
+  dst.resize(header.size() + rows * cols * 3);
+  memcpy(dst.data(), header.data(), header.size());
+
+  uint8_t *pixels = dst.data() + header.size();
+  for (size_t r = 0; r < rows; r++) {
+    memcpy(pixels + r * cols * 3, row_ptrs[r], cols * 3);
+  }
+}
+
+bool libHybractal::decode_ppm_u8c3(const uint8_t *src, size_t bytes,
+                                   std::vector<uint8_t> &dst, size_t &rows,
+                                   size_t &cols) noexcept {
+  // Only the layout written by encode_ppm_u8c3 is supported.
+  unsigned long w{0}, h{0}, maxval{0};
+  int header_bytes{0};
+  const std::string head{reinterpret_cast<const char *>(src),
+                         std::min<size_t>(bytes, 64)};
+  if (sscanf(head.c_str(), "P6 %lu %lu %lu%n", &w, &h, &maxval,
+             &header_bytes) != 3 ||
+      maxval != 255) {
+    return false;
+  }
+  // a single whitespace follows maxval
+  header_bytes++;
+
+  rows = h;
+  cols = w;
+  if (bytes < header_bytes + rows * cols * 3) {
+    return false;
+  }
+  dst.resize(rows * cols * 3);
+  memcpy(dst.data(), src + header_bytes, dst.size());
+  return true;
+}
+
+std::string_view libHybractal::image_extension(image_format fmt) noexcept {
+  switch (fmt) {
+    case image_format::png:
+      return ".png";
+    case image_format::qoi:
+      return ".qoi";
+    case image_format::ppm:
+      return ".ppm";
+  }
+  return ".png";
+}
+
+std::optional<libHybractal::image_format> libHybractal::parse_image_format(
+    std::string_view name) noexcept {
+  if (name == "png") {
+    return image_format::png;
+  }
+  if (name == "qoi") {
+    return image_format::qoi;
+  }
+  if (name == "ppm") {
+    return image_format::ppm;
+  }
+  return std::nullopt;
+}
+
+bool libHybractal::write_image_u8c3(const char *filename, image_format fmt,
+                                    const void *const *row_ptrs, size_t rows,
+                                    size_t cols, int png_level) noexcept {
+  thread_local std::vector<uint8_t> buffer;
+  switch (fmt) {
+    case image_format::png:
+      if (!encode_png_u8c3(row_ptrs, rows, cols, png_level, buffer)) {
+        return false;
+      }
+      break;
+    case image_format::qoi:
+      encode_qoi_u8c3(row_ptrs, rows, cols, buffer);
+      break;
+    case image_format::ppm:
+      encode_ppm_u8c3(row_ptrs, rows, cols, buffer);
+      break;
+  }
+  return write_buffer(filename, buffer);
+}
+
+bool libHybractal::write_image_u8c3(const char *filename, image_format fmt,
+                                    const fractal_utils::fractal_map &img,
+                                    int png_level) noexcept {
+  assert(img.element_bytes == 3);
+  std::vector<const void *> row_ptrs(img.rows);
+  for (size_t r = 0; r < img.rows; r++) {
+    row_ptrs[r] =
+        reinterpret_cast<const uint8_t *>(img.data) + r * img.cols * 3;
+  }
+  return write_image_u8c3(filename, fmt, row_ptrs.data(), img.rows, img.cols,
+                          png_level);
+}
+
+bool libHybractal::read_png_u8c3(const char *filename,
+                                 std::vector<uint8_t> &dst, size_t &rows,
+                                 size_t &cols) noexcept {
+  png_image image;
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+
+  if (!png_image_begin_read_from_file(&image, filename)) {
+    std::cerr << fmt::format("Failed to read {}, detail: {}", filename,
+                             image.message)
+              << std::endl;
+    return false;
+  }
+
+  image.format = PNG_FORMAT_RGB;
+  rows = image.height;
+  cols = image.width;
+  dst.resize(PNG_IMAGE_SIZE(image));
+
+  if (!png_image_finish_read(&image, nullptr, dst.data(), 0, nullptr)) {
+    std::cerr << fmt::format("Failed to decode {}, detail: {}", filename,
+                             image.message)
+              << std::endl;
+    png_image_free(&image);
+    return false;
+  }
+
+  return true;
+}
+
+bool libHybractal::read_image_u8c3(const char *filename, image_format fmt,
+                                   std::vector<uint8_t> &dst, size_t &rows,
+                                   size_t &cols) noexcept {
+  if (fmt == image_format::png) {
+    return read_png_u8c3(filename, dst, rows, cols);
+  }
+
+  thread_local std::vector<uint8_t> buffer;
+  if (!read_buffer(filename, buffer)) {
+    return false;
+  }
+
+  switch (fmt) {
+    case image_format::qoi:
+      return decode_qoi_u8c3(buffer.data(), buffer.size(), dst, rows, cols);
+    case image_format::ppm:
+      return decode_ppm_u8c3(buffer.data(), buffer.size(), dst, rows, cols);
+    default:
+      return false;
+  }
+}
@@ -34,7 +34,7 @@ libHybractal::gpu_resource::gpu_resource(size_t _rows, size_t _cols)
     : m_rows(_rows), m_cols(_cols) {
   cudaError_t err_code;
   err_code =
-      cudaMalloc(&this->device_mat_age, _rows * _cols * sizeof(uint16_t));
+      cudaMalloc(&this->device_mat_age, _rows * _cols * sizeof(uint32_t));
   PRIVATE_HANDLE_ERROR_GPU_RCS(err_code);
   err_code = cudaMalloc(&this->device_mat_z,
                         _rows * _cols *
@@ -130,11 +130,13 @@ __device__ cplx cplx_cvt_normalize(cuFloatComplex z) {
   return ret;
 }
 
-__device__ float normalize_age_cos(uint16_t age, const float peroid) {
+__device__ float normalize_age_cos(uint32_t age, const float peroid) {
 
   const float omega = 2 * M_PI / peroid;
+  // large uint32 ages lose precision in float, take the phase first
+  const float phase = fmod(double(age), double(peroid));
 
-  return 0.5f * (1 - std::cos(omega * age));
+  return 0.5f * (1 - std::cos(omega * phase));
 }
 
 __device__ float get_float3_value(float3 val, int idx) {
@@ -160,16 +162,18 @@ map_value(float3 src, const libHybractal::hsv_render_option::hsv_range &range) {
   return hsv;
 }
 
-__global__ void render_custom(const uint16_t *age_ptr,
-                              const cuDoubleComplex *z_ptr, uchar3 *u8c3_ptr,
+__global__ void render_custom(const void *age_ptr, libHybractal::age_format afmt,
+                              const void *z_ptr, libHybractal::z_format zfmt,
+                              uchar3 *u8c3_ptr,
                               const libHybractal::hsv_render_option opt) {
   static_assert(sizeof(uchar3) == 3, "");
 
   const int gidx = blockIdx.x * blockDim.x + threadIdx.x;
-  const uint16_t age = age_ptr[gidx];
-  const cuFloatComplex z{(float)z_ptr[gidx].x, (float)z_ptr[gidx].y};
+  const uint32_t age = libHybractal::load_age(age_ptr, gidx, afmt);
+  cuFloatComplex z;
+  libHybractal::load_z(z_ptr, gidx, zfmt, z.x, z.y);
 
-  const bool is_normal = (age < libHybractal::maxit_max);
+  const bool is_normal = (age != libHybractal::age_inside);
 
   const libHybractal::hsv_render_option::hsv_range &range =
       (is_normal) ? opt.range_age_normal : opt.range_age_inf;
@@ -209,6 +213,13 @@ libHybractal::render_hsv(const fractal_utils::fractal_map &mat_age,
   assert(rcs.cols() == mat_z.cols);
   assert(rcs.cols() == mat_u8c3.cols);
 
+  // any z format fits in the buffer of complex<hybf_store_t>, and compact
+  // formats take less bytes to upload.
+  const auto zfmt = libHybractal::z_format_of(mat_z.element_bytes);
+  assert(zfmt.has_value());
+  const auto afmt = libHybractal::age_format_of(mat_age.element_bytes);
+  assert(afmt.has_value());
+
   cudaError_t err;
 
   err = cudaMemcpy(rcs.mat_age_gpu(), mat_age.data, mat_age.byte_count(),
@@ -232,7 +243,7 @@ libHybractal::render_hsv(const fractal_utils::fractal_map &mat_age,
   const int blockdim = 64;
 
   render_custom<<<mat_age.element_count() / blockdim, blockdim>>>(
-      rcs.mat_age_gpu(), (const cuDoubleComplex *)rcs.mat_z_gpu(),
+      rcs.mat_age_gpu(), afmt.value(), rcs.mat_z_gpu(), zfmt.value(),
       (uchar3 *)rcs.mat_u8c3_gpu(), opt);
 
   err = cudaMemcpy(mat_u8c3.data, rcs.mat_u8c3_gpu(), mat_u8c3.byte_count(),
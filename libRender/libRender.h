@@ -24,6 +24,8 @@ This file is part of Hybractal.
 #include <libHybractal.h>
 
 #include <optional>
+#include <string_view>
+#include <vector>
 
 namespace libHybractal {
 
@@ -70,7 +72,8 @@ class gpu_resource {
   auto operator=(const gpu_resource &) = delete;
   auto operator=(gpu_resource &&) = delete;
 
-  uint16_t *device_mat_age{nullptr};
+  // uint16 or uint32 ages
+  void *device_mat_age{nullptr};
   std::complex<libHybractal::hybf_store_t> *device_mat_z{nullptr};
   fractal_utils::pixel_RGB *device_mat_u8c3{nullptr};
 
@@ -82,7 +85,7 @@ class gpu_resource {
   inline size_t rows() const noexcept { return this->m_rows; }
   inline size_t cols() const noexcept { return this->m_cols; }
 
-  inline uint16_t *mat_age_gpu() noexcept { return this->device_mat_age; }
+  inline void *mat_age_gpu() noexcept { return this->device_mat_age; }
   inline std::complex<libHybractal::hybf_store_t> *mat_z_gpu() noexcept {
     return this->device_mat_z;
   }
@@ -101,6 +104,43 @@ void render_hsv(const fractal_utils::fractal_map &mat_age,
                 fractal_utils::fractal_map &mat_u8c3,
                 const hsv_render_option &opt, gpu_resource &rcs) noexcept;
 
+// qoi and ppm are lossless and much faster to encode than png, they are meant
+// for images that are only read by ffmpeg.
+enum class image_format : uint8_t { png, qoi, ppm };
+
+std::string_view image_extension(image_format fmt) noexcept;
+std::optional<image_format> parse_image_format(std::string_view name) noexcept;
+
+// Rows are deflated in parallel strips that are joined into a single zlib
+// stream, so the encoding scales with omp threads.
+bool encode_png_u8c3(const void *const *row_ptrs, size_t rows, size_t cols,
+                     int level, std::vector<uint8_t> &dst) noexcept;
+
+void encode_qoi_u8c3(const void *const *row_ptrs, size_t rows, size_t cols,
+                     std::vector<uint8_t> &dst) noexcept;
+bool decode_qoi_u8c3(const uint8_t *src, size_t bytes,
+                     std::vector<uint8_t> &dst, size_t &rows,
+                     size_t &cols) noexcept;
+
+void encode_ppm_u8c3(const void *const *row_ptrs, size_t rows, size_t cols,
+                     std::vector<uint8_t> &dst) noexcept;
+bool decode_ppm_u8c3(const uint8_t *src, size_t bytes,
+                     std::vector<uint8_t> &dst, size_t &rows,
+                     size_t &cols) noexcept;
+
+bool write_image_u8c3(const char *filename, image_format fmt,
+                      const void *const *row_ptrs, size_t rows, size_t cols,
+                      int png_level = 1) noexcept;
+bool write_image_u8c3(const char *filename, image_format fmt,
+                      const fractal_utils::fractal_map &img,
+                      int png_level = 1) noexcept;
+
+bool read_png_u8c3(const char *filename, std::vector<uint8_t> &dst,
+                   size_t &rows, size_t &cols) noexcept;
+bool read_image_u8c3(const char *filename, image_format fmt,
+                     std::vector<uint8_t> &dst, size_t &rows,
+                     size_t &cols) noexcept;
+
 }  // namespace libHybractal
 
 #endif  // HYBRACTAL_LIBRENDER_LIBRENDER_H
\ No newline at end of file
@@ -0,0 +1,120 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fmt/format.h>
+#include <libRender.h>
+#include <omp.h>
+
+#include <array>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+// Encode random images and decode them back. Images have odd sizes, and runs
+// of one color longer than the 62 pixels a qoi run can hold. png is encoded
+// with several thread counts, so that its rows are split into several strips.
+namespace {
+
+std::vector<uint8_t> make_image(size_t rows, size_t cols,
+                                std::mt19937 &rng) noexcept {
+  std::vector<uint8_t> img(rows * cols * 3);
+  std::uniform_int_distribution<int> dist{0, 255};
+  for (size_t p = 0; p < rows * cols; p++) {
+    // a long run every 3 rows, noise and a few colors otherwise
+    const size_t r = p / cols;
+    const int c = (r % 3 == 0) ? 7 : ((p % 5 == 0) ? dist(rng) % 4 : dist(rng));
+    img[3 * p] = uint8_t(c);
+    img[3 * p + 1] = uint8_t((r % 3 == 0) ? 11 : dist(rng));
+    img[3 * p + 2] = uint8_t((r % 3 == 0) ? 13 : c / 2);
+  }
+  return img;
+}
+
+bool check(std::string_view what, size_t rows, size_t cols,
+           const std::vector<uint8_t> &img, bool decoded, size_t dec_rows,
+           size_t dec_cols, const std::vector<uint8_t> &dec) noexcept {
+  if (decoded && dec_rows == rows && dec_cols == cols &&
+      dec.size() >= img.size() &&
+      std::equal(img.begin(), img.end(), dec.begin())) {
+    return true;
+  }
+  std::cout << fmt::format("{} of a {}x{} image fails to round trip.", what,
+                           rows, cols)
+            << std::endl;
+  return false;
+}
+
+}  // namespace
+
+int main() {
+  int fail_count = 0;
+  std::mt19937 rng{20230401};
+  const std::array<std::array<size_t, 2>, 5> sizes{
+      {{1, 1}, {1, 200}, {3, 5}, {97, 131}, {257, 301}}};
+
+  for (const auto &[rows, cols] : sizes) {
+    const auto img = make_image(rows, cols, rng);
+    std::vector<const void *> row_ptrs(rows);
+    for (size_t r = 0; r < rows; r++) {
+      row_ptrs[r] = img.data() + r * cols * 3;
+    }
+
+    std::vector<uint8_t> encoded, decoded;
+    size_t dec_rows = 0, dec_cols = 0;
+
+    libHybractal::encode_qoi_u8c3(row_ptrs.data(), rows, cols, encoded);
+    bool ok = libHybractal::decode_qoi_u8c3(encoded.data(), encoded.size(),
+                                            decoded, dec_rows, dec_cols);
+    fail_count +=
+        !check("qoi", rows, cols, img, ok, dec_rows, dec_cols, decoded);
+
+    libHybractal::encode_ppm_u8c3(row_ptrs.data(), rows, cols, encoded);
+    ok = libHybractal::decode_ppm_u8c3(encoded.data(), encoded.size(), decoded,
+                                       dec_rows, dec_cols);
+    fail_count +=
+        !check("ppm", rows, cols, img, ok, dec_rows, dec_cols, decoded);
+
+    for (int threads : {1, 2, 3, 8}) {
+      for (int level : {1, 9}) {
+        omp_set_num_threads(threads);
+        ok = libHybractal::encode_png_u8c3(row_ptrs.data(), rows, cols, level,
+                                           encoded);
+        const std::string filename = "test_image_file.png";
+        {
+          std::ofstream ofs{filename, std::ios::binary};
+          ofs.write(reinterpret_cast<const char *>(encoded.data()),
+                    encoded.size());
+          ok = ok && ofs.good();
+        }
+        ok = ok && libHybractal::read_png_u8c3(filename.c_str(), decoded,
+                                               dec_rows, dec_cols);
+        fail_count += !check(
+            fmt::format("png with {} threads and level {}", threads, level),
+            rows, cols, img, ok, dec_rows, dec_cols, decoded);
+      }
+    }
+  }
+
+  if (fail_count <= 0) {
+    std::cout << "Success" << std::endl;
+  } else {
+    std::cout << fmt::format("{} round trip(s) failed.", fail_count)
+              << std::endl;
+  }
+  return fail_count;
+}
@@ -21,74 +21,559 @@ This file is part of Hybractal.
 #include <libHybfile.h>
 #include <omp.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <filesystem>
 #include <iostream>
-
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "journal.h"
+#include "lease.h"
+#include "pipeline.h"
 #include "videotool.h"
 
 using std::cout, std::cerr, std::endl;
 
-std::vector<int> unfinished_tasks(const common_info &common,
-                                  const compute_task &ct) noexcept;
+namespace {
+// Journal records of frames are outdated if this changes.
+uint64_t compute_fingerprint(const common_info &common,
+                             const compute_task &ct) noexcept {
+  return hash_string(fmt::format(
+      "{} {} {} {} {} {} {} {} {} {} {} {} {}", common.hybf_prefix,
+      common.rows, common.cols, common.maxit, common.frame_num, common.ratio,
+      ct.center_hex, ct.y_span, ct.x_span, ct.precision, ct.maxit_tolerance,
+      ct.maxit_min, HYBRACTAL_SEQUENCE_STR));
+}
+}  // namespace
 
-bool run_compute(const common_info &common,
-                 const compute_task &ctask) noexcept {
-  omp_set_num_threads(ctask.threads);
+// frames in journaled are finished and not checked again
+std::vector<int> unfinished_tasks(const common_info &common,
+                                  const std::set<int> &journaled) noexcept;
 
-  libHybractal::hybf_archive archive(common.rows, common.cols, true);
+bool init_compute_archive(const common_info &common, const compute_task &ctask,
+                          libHybractal::hybf_archive &archive) noexcept {
+  archive = libHybractal::hybf_archive(
+      common.rows, common.cols, true, ctask.z_fmt,
+      libHybractal::age_format_for_maxit(common.maxit));
 
   archive.metainfo().maxit = common.maxit;
 
-  {
-    std::string err;
-    archive.metainfo().wind = libHybractal::make_center_wind_variant(
-        ctask.center_hex, ctask.x_span, ctask.y_span, ctask.precision, false,
-        err);
+  std::string err;
+  archive.metainfo().wind = libHybractal::make_center_wind_variant(
+      ctask.center_hex, ctask.x_span, ctask.y_span, ctask.precision, false,
+      err);
 
-    if (!err.empty()) {
-      cerr << fmt::format("Invalid center hex. Detail: {}", err) << endl;
-      return false;
+  if (!err.empty()) {
+    cerr << fmt::format("Invalid center hex. Detail: {}", err) << endl;
+    return false;
+  }
+  return true;
+}
+
+libHybractal::save_options hybf_save_options(
+    const compute_task &ctask) noexcept {
+  libHybractal::save_options ret;
+  ret.compression = ctask.compression;
+  ret.age_filters = ctask.age_filters;
+  ret.z_filters = ctask.z_filters;
+  ret.z_tolerance = ctask.z_tolerance;
+  return ret;
+}
+
+int set_frame_maxit(const common_info &common, const compute_task &ctask,
+                    libHybractal::hybf_archive &archive) noexcept {
+  int maxit = common.maxit;
+  if (ctask.maxit_tolerance > 0) {
+    const size_t probe_rows =
+        std::min<size_t>(ctask.maxit_probe_rows, common.rows);
+    const size_t probe_cols =
+        std::max<size_t>(1, probe_rows * common.cols / common.rows);
+    maxit = libHybractal::estimate_maxit(
+        archive.metainfo().window_base(), archive.metainfo().precision(),
+        common.maxit, ctask.maxit_min, probe_rows, probe_cols,
+        ctask.maxit_tolerance);
+  }
+  archive.metainfo().maxit = maxit;
+  return maxit;
+}
+
+libHybractal::cost_map predict_next_cost(
+    const common_info &common, libHybractal::hybf_archive &archive) noexcept {
+  // edge of the pixel blocks that are scheduled
+  constexpr size_t cell_size = 32;
+  if (common.ratio < 1 || !archive.have_mat_age()) {
+    return {};
+  }
+  return libHybractal::predict_zoom_cost(
+      archive.map_age(), archive.metainfo().maxit, common.ratio,
+      (archive.rows() + cell_size - 1) / cell_size,
+      (archive.cols() + cell_size - 1) / cell_size);
+}
+
+void set_frame_window(const common_info &common, const compute_task &ctask,
+                      int fidx, libHybractal::hybf_archive &archive) noexcept {
+  const double factor = std::pow(common.ratio, -fidx);
+
+  auto update_xy_span = [ctask, factor](auto &wind) {
+    wind.x_span = ctask.x_span * factor;
+    wind.y_span = ctask.y_span * factor;
+  };
+
+  std::visit(update_xy_span, archive.metainfo().wind);
+}
+
+namespace {
+// A frame whose blocks are being computed.
+struct frame_job {
+  int fidx;
+  // order of activation, smaller is more urgent
+  int rank;
+  // taken from the pool of frame_scheduler, and given back by the writer
+  std::unique_ptr<libHybractal::hybf_archive> archive;
+  int maxit;
+  // guarded by the lock of frame_scheduler, and so are the members below
+  std::vector<libHybractal::pixel_block> blocks;
+  // blocks handed out
+  size_t next_block{0};
+  size_t finished_blocks{0};
+  // blocks that are not handed out follow a predicted cost
+  bool by_cost{false};
+  // one per thread of frame_scheduler, made when the thread computes its first
+  // block of this frame and merged when the frame is finished
+  std::vector<libHybractal::frame_stats> thread_stats;
+  double begin_time;
+};
+
+// Frames that are computed and wait for the writer.
+struct pending_write {
+  int fidx;
+  std::unique_ptr<libHybractal::hybf_archive> archive;
+};
+
+// Shares a fixed number of threads among several frames. An idle thread takes
+// the next block of the most urgent active frame, or activates the next
+// pending frame if no block is left. Finished frames are compressed and saved
+// by a background writer while the next frames are computed. Archives come
+// from a pool, so matrices are never reallocated.
+class frame_scheduler {
+ private:
+  const common_info &m_common;
+  const compute_task &m_ctask;
+  const libHybractal::hybf_archive &m_first_frame;
+  const int m_total;
+
+  // every archive is either free, computed or written
+  bounded_queue<std::unique_ptr<libHybractal::hybf_archive>> m_pool;
+  // two frames, so that one is written while the other one is queued
+  bounded_queue<pending_write> m_writes{2};
+  stage_meter m_meter_compute;
+  stage_meter m_meter_write;
+
+  frame_dispenser &m_frames;
+  // hybf files are written to temporary files and renamed if frames are
+  // shared with other processes
+  const frame_leases *const m_leases;
+  task_journal *const m_journal;
+
+  std::mutex m_lock;
+  std::condition_variable m_changed;
+  // sorted by rank
+  std::vector<std::shared_ptr<frame_job>> m_active;
+  int m_activating{0};
+  int m_ranks{0};
+  int m_finished{0};
+  std::atomic<bool> m_failed{false};
+  // predicted by the previous frame
+  std::map<int, libHybractal::cost_map> m_costs;
+  // claimed frames that are not active yet
+  std::set<int> m_preparing;
+  // frames whose blocks are scheduled by a predicted cost
+  int m_cost_scheduled{0};
+
+ public:
+  frame_scheduler(const common_info &common, const compute_task &ctask,
+                  const libHybractal::hybf_archive &first_frame,
+                  int frame_num, frame_dispenser &frames,
+                  const frame_leases *leases, task_journal *journal)
+      : m_common{common},
+        m_ctask{ctask},
+        m_first_frame{first_frame},
+        m_total{frame_num},
+        m_pool{size_t(ctask.frames_in_flight) + 2},
+        m_meter_compute{"compute", ctask.threads},
+        m_meter_write{"write", ctask.write_threads},
+        m_frames{frames},
+        m_leases{leases},
+        m_journal{journal} {
+    const size_t pool_size =
+        std::min<size_t>(this->m_pool.capacity(), frame_num);
+    for (size_t i = 0; i < pool_size; i++) {
+      this->m_pool.push(
+          std::make_unique<libHybractal::hybf_archive>(first_frame));
     }
   }
 
-  const auto frame_idxs = unfinished_tasks(common, ctask);
-  const int task_num = frame_idxs.size();
+  bool run(bool benchmark) noexcept {
+    const auto wall_begin = stage_meter::clock_t::now();
+    std::thread writer{[this]() { this->write(); }};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < this->m_ctask.threads; i++) {
+      threads.emplace_back([this, i]() { this->work(i); });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    const auto compute_end = stage_meter::clock_t::now();
+    this->m_writes.close();
+    writer.join();
+    const auto wall_end = stage_meter::clock_t::now();
+
+    if (benchmark) {
+      const double wall_seconds =
+          std::chrono::duration<double>(wall_end - wall_begin).count();
+      // saving is hidden behind computing, except for the last frames
+      const double tail =
+          std::chrono::duration<double>(wall_end - compute_end).count();
+      const double write_busy = this->m_meter_write.busy_seconds();
+      const double overlap =
+          (write_busy > 0) ? std::max(0.0, 1 - tail / write_busy) : 1;
+      cout << fmt::format(
+                  "Computing finished in {:.3f} s, saving took {:.3f} s and "
+                  "{:.1f}% of it overlapped with computing.",
+                  wall_seconds, write_busy, 100 * overlap)
+           << endl;
+      for (const stage_meter *m : {&this->m_meter_compute,
+                                   &this->m_meter_write}) {
+        cout << "  " << m->report(wall_seconds) << endl;
+      }
+      cout << fmt::format(
+                  "  {} of {} frames were scheduled by predicted cost.",
+                  this->m_cost_scheduled, this->m_finished)
+           << endl;
+    }
+    return !this->m_failed;
+  }
 
-  int counter = 0;
-  for (int fidx : frame_idxs) {
-    const double factor = std::pow(common.ratio, -fidx);
+ private:
+  // frames whose blocks are all handed out don't count
+  int frames_in_flight() const noexcept {
+    int ret = this->m_activating;
+    for (const auto &job : this->m_active) {
+      ret += (job->next_block < job->blocks.size());
+    }
+    return ret;
+  }
 
-    auto update_xy_span = [ctask, factor](auto &wind) {
-      wind.x_span = ctask.x_span * factor;
-      wind.y_span = ctask.y_span * factor;
-    };
+  void work(int thread_idx) noexcept {
+    // blocks are computed serially, and so are the probe and the saving.
+    omp_set_num_threads(1);
+    std::unique_lock lk{this->m_lock};
+    while (!this->m_failed) {
+      std::shared_ptr<frame_job> job{nullptr};
+      for (const auto &j : this->m_active) {
+        if (j->next_block < j->blocks.size()) {
+          job = j;
+          break;
+        }
+      }
 
-    std::visit(update_xy_span, archive.metainfo().wind);
+      if (job != nullptr) {
+        // blocks may be rescheduled, so they are copied under the lock
+        const libHybractal::pixel_block block = job->blocks[job->next_block++];
+        lk.unlock();
+        {
+          auto m = this->m_meter_compute.measure();
+          this->compute_block(*job, block, thread_idx);
+        }
+        lk.lock();
+        if (++job->finished_blocks == job->blocks.size()) {
+          lk.unlock();
+          this->finish(*job);
+          lk.lock();
+          std::erase(this->m_active, job);
+          this->m_finished++;
+          cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : {}, maxit = {}\n",
+                              100 * float(this->m_finished) / this->m_total,
+                              this->m_finished, this->m_total,
+                              hybf_filename(this->m_common, job->fidx),
+                              job->maxit)
+               << std::flush;
+          this->m_changed.notify_all();
+        }
+        continue;
+      }
 
-    cout << endl;
-    std::string filename = hybf_filename(common, fidx);
-    cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : {}",
-                        100 * float(counter) / task_num, counter, task_num,
-                        filename);
+      if (!this->m_frames.exhausted() &&
+          this->frames_in_flight() < this->m_ctask.frames_in_flight) {
+        // claiming a frame may touch the lease directory
+        this->m_activating++;
+        lk.unlock();
+        const auto next = this->m_frames.next();
+        lk.lock();
+        if (next.st != frame_dispenser::status::frame) {
+          this->m_activating--;
+          if (next.st == frame_dispenser::status::wait) {
+            this->m_changed.wait_for(
+                lk, std::chrono::duration<double>(
+                        this->m_frames.poll_seconds()));
+          }
+          continue;
+        }
+        const int fidx = next.fidx;
+        const int rank = this->m_ranks++;
+        std::optional<libHybractal::cost_map> cost = this->take_cost(fidx);
+        this->m_preparing.emplace(fidx);
+        lk.unlock();
+        auto new_job = this->activate(fidx, rank, cost);
+        lk.lock();
+        this->m_activating--;
+        this->m_preparing.erase(fidx);
+        this->m_cost_scheduled += new_job->by_cost;
+        // the previous frame may be finished while activating
+        if (auto late = this->take_cost(fidx); late.has_value()) {
+          this->reschedule(*new_job, late.value());
+        }
+        auto pos = std::upper_bound(
+            this->m_active.begin(), this->m_active.end(), rank,
+            [](int r, const auto &j) { return r < j->rank; });
+        this->m_active.emplace(pos, std::move(new_job));
+        this->m_changed.notify_all();
+        continue;
+      }
+
+      if (this->m_frames.exhausted() && this->m_active.empty() &&
+          this->m_activating == 0) {
+        break;
+      }
+      this->m_changed.wait(lk);
+    }
+    this->m_changed.notify_all();
+  }
 
-    auto mat_age = archive.map_age();
-    auto mat_z = archive.map_z();
+  std::shared_ptr<frame_job> activate(
+      int fidx, int rank,
+      const std::optional<libHybractal::cost_map> &cost) noexcept {
+    auto job = std::make_shared<frame_job>();
+    job->fidx = fidx;
+    job->rank = rank;
+    // blocks until the writer gives an archive back
+    job->archive = this->m_pool.pop().value();
+    job->begin_time = omp_get_wtime();
+    // matrices are overwritten by computing
+    job->archive->metainfo() = this->m_first_frame.metainfo();
+    job->archive->stats().reset();
+    set_frame_window(this->m_common, this->m_ctask, fidx, *job->archive);
+    job->maxit =
+        set_frame_maxit(this->m_common, this->m_ctask, *job->archive);
+    job->by_cost = cost.has_value() && cost->rows > 0;
+    job->blocks = libHybractal::frame_blocks(
+        job->archive->rows(), job->archive->cols(),
+        job->by_cost ? &cost.value() : nullptr);
+    job->thread_stats.resize(this->m_ctask.threads);
+    return job;
+  }
+
+  std::optional<libHybractal::cost_map> take_cost(int fidx) noexcept {
+    auto it = this->m_costs.find(fidx);
+    if (it == this->m_costs.end()) {
+      return std::nullopt;
+    }
+    auto ret = std::move(it->second);
+    this->m_costs.erase(it);
+    return ret;
+  }
 
-    ::libHybractal::compute_frame_by_precision(archive.metainfo().window_base(),
-                                               archive.metainfo().precision(),
-                                               common.maxit, mat_age, &mat_z);
+  // Blocks of an active frame that are not handed out yet are replaced by the
+  // cells of cost, from the most expensive one. Without cost, blocks are rows
+  // handed out from the top, so cells are cut below the rows handed out.
+  void reschedule(frame_job &job,
+                  const libHybractal::cost_map &cost) noexcept {
+    if (job.by_cost || cost.rows == 0 ||
+        job.next_block >= job.blocks.size()) {
+      return;
+    }
+    const size_t row_begin = job.blocks[job.next_block][0];
+    job.blocks.resize(job.next_block);
+    for (auto block : libHybractal::frame_blocks(job.archive->rows(),
+                                                 job.archive->cols(), &cost)) {
+      block[0] = std::max(block[0], row_begin);
+      if (block[0] < block[1]) {
+        job.blocks.emplace_back(block);
+      }
+    }
+    job.by_cost = true;
+    this->m_cost_scheduled++;
+  }
 
-    const bool ok = archive.save(filename);
+  void compute_block(frame_job &job, const libHybractal::pixel_block &block,
+                     int thread_idx) noexcept {
+    auto mat_age = job.archive->map_age();
+    auto mat_z = job.archive->map_z();
+    auto &local = job.thread_stats[thread_idx];
+    if (local.age_histogram.empty()) {
+      local = libHybractal::frame_stats::make(job.maxit);
+    }
+    libHybractal::compute_block_by_precision(
+        job.archive->metainfo().window_base(),
+        job.archive->metainfo().precision(), job.maxit, mat_age, &mat_z,
+        block, &local);
+  }
 
-    if (!ok) {
-      cerr << fmt::format("\nFailed to export hybf file: {}\n", filename);
+  // hand a computed frame to the writer
+  void finish(frame_job &job) noexcept {
+    // every block is finished, so no thread writes its stats any more
+    auto stats = libHybractal::frame_stats::make(job.maxit);
+    for (const auto &local : job.thread_stats) {
+      if (!local.age_histogram.empty()) {
+        stats.merge(local);
+      }
+    }
+    stats.wall_time = omp_get_wtime() - job.begin_time;
+    job.archive->stats() = std::move(stats);
+    {
+      // The next frame is usually active already, as frames in flight only
+      // count frames with blocks left. Frames in deepest-first order are
+      // never predicted, since the previous frame doesn't cover them.
+      auto cost = predict_next_cost(this->m_common, *job.archive);
+      const int next = job.fidx + 1;
+      std::lock_guard lk{this->m_lock};
+      auto it = std::find_if(
+          this->m_active.begin(), this->m_active.end(),
+          [next](const auto &j) { return j->fidx == next; });
+      if (it != this->m_active.end()) {
+        this->reschedule(**it, cost);
+      } else if (this->m_frames.pending(next) ||
+                 this->m_preparing.contains(next)) {
+        this->m_costs.insert_or_assign(next, std::move(cost));
+      }
+    }
+    this->m_writes.push(pending_write{job.fidx, std::move(job.archive)});
+  }
+
+  void write() noexcept {
+    omp_set_num_threads(this->m_ctask.write_threads);
+    while (true) {
+      auto frame = this->m_writes.pop();
+      if (!frame.has_value()) {
+        break;
+      }
+      const std::string filename =
+          hybf_filename(this->m_common, frame->fidx);
+      // other processes never see a partial file
+      const std::string temp =
+          (this->m_leases != nullptr)
+              ? fmt::format("{}.{}.tmp", filename, this->m_leases->owner())
+              : filename;
+      bool ok;
+      {
+        auto m = this->m_meter_write.measure();
+        ok = frame->archive->save(temp, hybf_save_options(this->m_ctask));
+        if (ok && temp != filename) {
+          std::error_code ec;
+          std::filesystem::rename(temp, filename, ec);
+          ok = !ec;
+        }
+      }
+      this->m_frames.done(frame->fidx);
+      task_journal::record rec{frame->fidx};
+      if (ok && this->m_journal != nullptr &&
+          hash_file(filename, 0, rec.bytes, rec.hash)) {
+        this->m_journal->append(task_journal::stage::compute, rec);
+      }
+      if (!ok) {
+        cerr << fmt::format("\nFailed to export hybf file: {}\n", filename);
+        this->m_failed = true;
+        // wake up threads that wait for frames or archives
+        std::lock_guard lk{this->m_lock};
+        this->m_changed.notify_all();
+      }
+      this->m_pool.push(std::move(frame->archive));
+    }
+  }
+};
+}  // namespace
+
+bool run_compute(const common_info &common, const compute_task &ctask,
+                 bool benchmark) noexcept {
+  omp_set_num_threads(ctask.threads);
+
+  libHybractal::hybf_archive archive;
+  if (!init_compute_archive(common, ctask, archive)) {
+    return false;
+  }
+
+  std::unique_ptr<frame_leases> leases{nullptr};
+  if (!common.lease_dir.empty()) {
+    leases = std::make_unique<frame_leases>(common.lease_dir, "compute",
+                                            common.lease_expiry);
+    if (!leases->ok()) {
       return false;
     }
-    counter++;
+    cout << fmt::format("Sharing frames through {} as {}", common.lease_dir,
+                        leases->owner())
+         << endl;
+  }
+
+  std::unique_ptr<task_journal> journal{nullptr};
+  std::set<int> journaled;
+  if (!common.journal_file.empty()) {
+    std::string err;
+    journal = task_journal::open(common.journal_file, &err);
+    if (journal == nullptr) {
+      // such as a task file in a read-only directory
+      cerr << fmt::format("Warning: {} Frames are checked without a journal.",
+                          err)
+           << endl;
+    } else {
+      journaled = journal->finished(
+          task_journal::stage::compute, compute_fingerprint(common, ctask),
+          [&common](const task_journal::record &rec) {
+            std::error_code ec;
+            const auto bytes = std::filesystem::file_size(
+                hybf_filename(common, rec.fidx), ec);
+            return !ec && bytes == rec.bytes;
+          },
+          [&common](const task_journal::record &rec) {
+            task_journal::record current{rec.fidx};
+            return hash_file(hybf_filename(common, rec.fidx), 0,
+                             current.bytes, current.hash) &&
+                   current.bytes == rec.bytes && current.hash == rec.hash;
+          });
+    }
+  }
+
+  auto frame_idxs = unfinished_tasks(common, journaled);
+  const int task_num = frame_idxs.size();
+  if (ctask.deepest_first) {
+    std::reverse(frame_idxs.begin(), frame_idxs.end());
+  }
+
+  // hybf files are renamed into place, so a file is either valid or missing
+  frame_dispenser frames{frame_idxs, leases.get(), [&common](int fidx, bool) {
+                           thread_local std::vector<uint8_t> buffer;
+                           bool exist;
+                           return check_hybf(hybf_filename(common, fidx),
+                                             common, buffer, exist);
+                         }};
+  frame_scheduler scheduler{common, ctask, archive, task_num, frames,
+                            leases.get(), journal.get()};
+  if (!scheduler.run(benchmark)) {
+    return false;
+  }
+  if (journal != nullptr) {
+    journal->checkpoint();
   }
 
-  cout << fmt::format("\n[{:^6.1f}% : {:^3} / {:^3}] : All tasks finished.",
-                      100.0f, counter, task_num)
+  if (frames.skipped() > 0) {
+    cout << fmt::format("{} frames are computed by other processes.",
+                        frames.skipped())
+         << endl;
+  }
+  cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : All tasks finished.",
+                      100.0f, task_num, task_num)
        << endl;
 
   return true;
@@ -104,8 +589,20 @@ bool check_hybf(std::string_view filename, const common_info &ci,
   exist = true;
 
   std::string err;
-  libHybractal::hybf_archive hybf_archive =
-      libHybractal::hybf_archive::load(filename, buffer, &err);
+  libHybractal::hybf_archive hybf_archive;
+  // Hashing blocks is much cheaper than decompressing them, and also catches
+  // corruption that decompresses to the right size. Files without checksums
+  // are still checked by decompressing them.
+  bool has_checksums = false;
+  if (libHybractal::hybf_archive::verify(filename, &err, &has_checksums)) {
+    if (opt.move_archive != nullptr || !has_checksums) {
+      hybf_archive = libHybractal::hybf_archive::load(filename, buffer, &err);
+    } else {
+      // Only the metainfo is checked, the matrices are not decompressed.
+      hybf_archive.metainfo() =
+          libHybractal::hybf_archive::probe(filename, &err);
+    }
+  }
 
   if (!err.empty()) {
     cout << fmt::format(
@@ -163,16 +660,19 @@ bool check_hybf_size(const libHybractal::hybf_archive &archive,
 }
 
 std::vector<int> unfinished_tasks(const common_info &common,
-                                  const compute_task &ct) noexcept {
+                                  const std::set<int> &journaled) noexcept {
   std::vector<uint8_t> need_compute;
   need_compute.resize(common.frame_num);
   for (int fidx = 0; fidx < common.frame_num; fidx++) {
-    need_compute[fidx] = true;
+    need_compute[fidx] = !journaled.contains(fidx);
   }
 
 #pragma omp parallel for schedule(dynamic)
   for (int fidx = 0; fidx < common.frame_num; fidx++) {
     thread_local std::vector<uint8_t> buffer;
+    if (!need_compute[fidx]) {
+      continue;
+    }
 
     bool exist;
     std::string filename = hybf_filename(common, fidx);
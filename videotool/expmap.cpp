@@ -0,0 +1,400 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// A zoom about a fixed center can be produced from one log-polar strip: row r
+// of the strip samples the circle of radius r_max * exp(-r * log_step), and
+// column c samples the angle 2 * pi * c / cols. Zooming in by a factor only
+// shifts the rows, so every video frame is a cheap remap of the rendered strip.
+// Pixels too close to the center for the strip are taken from the last frame.
+
+#include <fmt/format.h>
+#include <libRender.h>
+#include <omp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "videotool.h"
+
+using std::cout, std::cerr, std::endl;
+
+std::string expmap_filename(const common_info &ci) noexcept {
+  return fmt::format("{}expmap.hybf", ci.hybf_prefix);
+}
+
+expmap_geometry make_expmap_geometry(const common_info &ci,
+                                     const compute_task &ct) noexcept {
+  expmap_geometry geo;
+  const auto vsize = video_size(ci);
+  geo.video = {size_t(vsize[0]), size_t(vsize[1])};
+
+  // pixels are assumed to be square, so y span decides the size of pixels.
+  geo.pixel_0 = ct.y_span / geo.video[0];
+  geo.pixel_center =
+      ct.y_span * std::pow(ci.ratio, -(ci.frame_num - 1)) / ci.rows;
+
+  const double half_diagonal =
+      0.5 * std::hypot(double(geo.video[0]), double(geo.video[1]));
+
+  // One column per pixel on the outermost circle. The renderer requires the
+  // pixel count to be multiples of 64.
+  geo.cols = size_t(std::ceil(2 * M_PI * half_diagonal / 64)) * 64;
+  // keep the pixels of strip square in log-polar space
+  geo.log_step = 2 * M_PI / geo.cols;
+
+  geo.r_max = geo.pixel_0 * half_diagonal;
+  geo.r_min = geo.pixel_center * (std::min(ci.rows, ci.cols) / 2.0 - 1);
+  geo.rows =
+      size_t(std::ceil(std::log(geo.r_max / geo.r_min) / geo.log_step)) + 1;
+
+  return geo;
+}
+
+bool load_or_compute_center(const common_info &ci, const compute_task &ct,
+                            libHybractal::hybf_archive &archive) noexcept {
+  const int fidx = ci.frame_num - 1;
+  const std::string filename = hybf_filename(ci, fidx);
+
+  {
+    std::vector<uint8_t> buffer;
+    bool exist{false};
+    check_hybf_option opt;
+    opt.move_archive = &archive;
+    if (check_hybf(filename, ci, buffer, exist, opt)) {
+      return true;
+    }
+  }
+
+  cout << fmt::format("Computing center frame {}", filename) << endl;
+
+  const double factor = std::pow(ci.ratio, -fidx);
+  archive = libHybractal::hybf_archive(
+      ci.rows, ci.cols, true, ct.z_fmt,
+      libHybractal::age_format_for_maxit(ci.maxit));
+  archive.metainfo().maxit = ci.maxit;
+  {
+    std::string err;
+    archive.metainfo().wind = libHybractal::make_center_wind_variant(
+        ct.center_hex, ct.x_span * factor, ct.y_span * factor, ct.precision,
+        false, err);
+    if (!err.empty()) {
+      cerr << fmt::format("Invalid center hex. Detail: {}", err) << endl;
+      return false;
+    }
+  }
+
+  auto mat_age = archive.map_age();
+  auto mat_z = archive.map_z();
+  libHybractal::frame_stats stats;
+  libHybractal::compute_frame_by_precision(archive.metainfo().window_base(),
+                                           archive.metainfo().precision(),
+                                           ci.maxit, mat_age, &mat_z, &stats);
+  archive.stats() = std::move(stats);
+
+  if (!archive.save(filename, hybf_save_options(ct))) {
+    cerr << fmt::format("Failed to export hybf file: {}", filename) << endl;
+    return false;
+  }
+  return true;
+}
+
+bool load_or_compute_strip(const common_info &ci, const compute_task &ct,
+                           const expmap_geometry &geo,
+                           libHybractal::hybf_archive &archive) noexcept {
+  const std::string filename = expmap_filename(ci);
+
+  {
+    std::vector<uint8_t> buffer;
+    bool exist{false};
+    check_hybf_option opt;
+    opt.move_archive = &archive;
+    opt.ignore_size = true;
+    if (check_hybf(filename, ci, buffer, exist, opt)) {
+      if (check_hybf_size(archive, {geo.rows, geo.cols})) {
+        return true;
+      }
+      cout << fmt::format(
+                  "Warning: {} exists, but its size mismatch with the task. It "
+                  "will be computed again.",
+                  filename)
+           << endl;
+    }
+  }
+
+  cout << fmt::format("Computing exponential map {}, size = [{}, {}]",
+                      filename, geo.rows, geo.cols)
+       << endl;
+
+  archive = libHybractal::hybf_archive(
+      geo.rows, geo.cols, true, ct.z_fmt,
+      libHybractal::age_format_for_maxit(ci.maxit));
+  archive.metainfo().maxit = ci.maxit;
+  {
+    std::string err;
+    // The window of strip records the first frame, the geometry of strip is
+    // decided by the task.
+    archive.metainfo().wind = libHybractal::make_center_wind_variant(
+        ct.center_hex, ct.x_span, ct.y_span, ct.precision, false, err);
+    if (!err.empty()) {
+      cerr << fmt::format("Invalid center hex. Detail: {}", err) << endl;
+      return false;
+    }
+  }
+
+  auto mat_age = archive.map_age();
+  auto mat_z = archive.map_z();
+
+  double wtime = omp_get_wtime();
+  libHybractal::compute_expmap_by_precision(
+      archive.metainfo().window_base(), archive.metainfo().precision(),
+      ci.maxit, geo.r_max, geo.log_step, mat_age, &mat_z);
+  wtime = omp_get_wtime() - wtime;
+  cout << fmt::format("Exponential map computed in {} seconds.", wtime)
+       << endl;
+
+  if (!archive.save(filename, hybf_save_options(ct))) {
+    cerr << fmt::format("Failed to export hybf file: {}", filename) << endl;
+    return false;
+  }
+  return true;
+}
+
+bool render_archive(libHybractal::hybf_archive &archive,
+                    const libHybractal::hsv_render_option &render,
+                    fractal_utils::fractal_map &img_u8c3) noexcept {
+  libHybractal::gpu_resource gpu_rcs(archive.rows(), archive.cols());
+  if (!gpu_rcs.ok()) {
+    cerr << "Failed to initialize gpu resource." << endl;
+    return false;
+  }
+  libHybractal::render_hsv(archive.map_age(), archive.map_z(), img_u8c3,
+                           render, gpu_rcs);
+  return true;
+}
+
+namespace {
+
+// Position of video pixels relative to the center. They are shared by all
+// frames, since frames only differ in scale.
+struct remap_table {
+  // log(radius in pixels) / log_step
+  std::vector<float> scaled_log_rho;
+  // angle, in unit of strip columns
+  std::vector<float> strip_col;
+  // offset to center in pixels, y axis points upwards
+  std::vector<float> dx;
+  std::vector<float> dy;
+
+  explicit remap_table(const expmap_geometry &geo) {
+    const size_t count = geo.video[0] * geo.video[1];
+    scaled_log_rho.resize(count);
+    strip_col.resize(count);
+    dx.resize(count);
+    dy.resize(count);
+
+    const double center_r = (geo.video[0] - 1) / 2.0;
+    const double center_c = (geo.video[1] - 1) / 2.0;
+
+    for (size_t r = 0; r < geo.video[0]; r++) {
+      for (size_t c = 0; c < geo.video[1]; c++) {
+        const size_t idx = r * geo.video[1] + c;
+        const double x = c - center_c;
+        const double y = center_r - r;
+        dx[idx] = float(x);
+        dy[idx] = float(y);
+
+        const double rho = std::hypot(x, y);
+        // rho == 0 gives -inf, which will be taken from the center frame.
+        scaled_log_rho[idx] = float(std::log(rho) / geo.log_step);
+
+        double theta = std::atan2(y, x);
+        if (theta < 0) {
+          theta += 2 * M_PI;
+        }
+        strip_col[idx] = float(theta / (2 * M_PI) * geo.cols);
+      }
+    }
+  }
+};
+
+inline void bilinear_u8c3(const fractal_utils::fractal_map &img, float r,
+                          float c, bool wrap_cols, uint8_t *dst) noexcept {
+  const float max_r = img.rows - 1;
+  const float max_c = img.cols - 1;
+  r = std::clamp(r, 0.0f, max_r);
+  if (!wrap_cols) {
+    c = std::clamp(c, 0.0f, max_c);
+  }
+
+  const int r0 = int(r);
+  const int c0 = int(c);
+  const float fr = r - r0;
+  const float fc = c - c0;
+
+  const int r1 = std::min<int>(r0 + 1, img.rows - 1);
+  int c1 = c0 + 1;
+  if (wrap_cols) {
+    c1 = c1 % int(img.cols);
+  } else {
+    c1 = std::min<int>(c1, img.cols - 1);
+  }
+  const int c0_ = (wrap_cols) ? (c0 % int(img.cols)) : c0;
+
+  const uint8_t *const data = reinterpret_cast<const uint8_t *>(img.data);
+  const uint8_t *p00 = data + (r0 * img.cols + c0_) * 3;
+  const uint8_t *p01 = data + (r0 * img.cols + c1) * 3;
+  const uint8_t *p10 = data + (r1 * img.cols + c0_) * 3;
+  const uint8_t *p11 = data + (r1 * img.cols + c1) * 3;
+
+  for (int ch = 0; ch < 3; ch++) {
+    const float top = p00[ch] + fc * (p01[ch] - p00[ch]);
+    const float bottom = p10[ch] + fc * (p11[ch] - p10[ch]);
+    dst[ch] = uint8_t(top + fr * (bottom - top) + 0.5f);
+  }
+}
+
+// Remap a video frame whose pixel size is pixel_size.
+void remap_frame(const expmap_geometry &geo, const remap_table &table,
+                 double pixel_size, const fractal_utils::fractal_map &strip,
+                 const fractal_utils::fractal_map &center,
+                 uint8_t *dst) noexcept {
+  const float row_base = float(std::log(geo.r_max / pixel_size) / geo.log_step);
+  const float center_zoom = float(pixel_size / geo.pixel_center);
+  const float center_r = (center.rows - 1) / 2.0f;
+  const float center_c = (center.cols - 1) / 2.0f;
+  const float last_row = strip.rows - 1;
+
+  thread_local std::vector<float> strip_rows;
+  strip_rows.resize(geo.video[1]);
+
+  for (size_t r = 0; r < geo.video[0]; r++) {
+    const size_t offset = r * geo.video[1];
+    const float *const log_rho = table.scaled_log_rho.data() + offset;
+
+    // row = log(r_max / (rho * pixel_size)) / log_step
+#pragma omp simd
+    for (size_t c = 0; c < geo.video[1]; c++) {
+      strip_rows[c] = row_base - log_rho[c];
+    }
+
+    for (size_t c = 0; c < geo.video[1]; c++) {
+      const size_t idx = offset + c;
+      uint8_t *const pixel = dst + idx * 3;
+      if (strip_rows[c] <= last_row) {
+        bilinear_u8c3(strip, strip_rows[c], table.strip_col[idx], true, pixel);
+        continue;
+      }
+      bilinear_u8c3(center, center_r - table.dy[idx] * center_zoom,
+                    center_c + table.dx[idx] * center_zoom, false, pixel);
+    }
+  }
+}
+
+}  // namespace
+
+bool run_expmap(const common_info &ci, const compute_task &ct,
+                const render_task &rt, const video_task &vt) noexcept {
+  const expmap_geometry geo = make_expmap_geometry(ci, ct);
+
+  cout << fmt::format(
+              "Exponential map: strip size = [{}, {}], radius in [{}, {}], "
+              "video size = [{}, {}]",
+              geo.rows, geo.cols, geo.r_min, geo.r_max, geo.video[0],
+              geo.video[1])
+       << endl;
+
+  libHybractal::hsv_render_option render;
+  {
+    auto temp = libHybractal::hsv_render_option::load_from_file(rt.config_file);
+    if (!temp.has_value()) {
+      cerr << fmt::format("Failed to load render json file {}.", rt.config_file)
+           << endl;
+      return false;
+    }
+    render = temp.value();
+  }
+
+  fractal_utils::fractal_map img_center(ci.rows, ci.cols, 3);
+  fractal_utils::fractal_map img_strip(geo.rows, geo.cols, 3);
+
+  omp_set_num_threads(ct.threads);
+  {
+    libHybractal::hybf_archive center;
+    if (!load_or_compute_center(ci, ct, center)) {
+      return false;
+    }
+    if (!render_archive(center, render, img_center)) {
+      return false;
+    }
+  }
+  {
+    libHybractal::hybf_archive strip;
+    if (!load_or_compute_strip(ci, ct, geo, strip)) {
+      return false;
+    }
+    if (!render_archive(strip, render, img_strip)) {
+      return false;
+    }
+  }
+
+  const std::string command = encoder_pipe_command(ci, rt, vt);
+  FILE *const pipe = open_encoder_pipe(command);
+  if (pipe == nullptr) {
+    return false;
+  }
+
+  const remap_table table{geo};
+  const int fps = rt.png_per_frame;
+  const int video_frames = fps * ci.frame_num;
+  const size_t frame_bytes = geo.video[0] * geo.video[1] * 3;
+
+  omp_set_num_threads(rt.threads);
+  std::vector<uint8_t> batch(frame_bytes * fps);
+  bool ok = true;
+
+  for (int first = 0; first < video_frames; first += fps) {
+    cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : remapping",
+                        100 * float(first) / video_frames, first, video_frames)
+         << endl;
+
+    const int frames = std::min(fps, video_frames - first);
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < frames; i++) {
+      const double pixel_size =
+          geo.pixel_0 * std::pow(ci.ratio, -double(first + i) / fps);
+      remap_frame(geo, table, pixel_size, img_strip, img_center,
+                  batch.data() + i * frame_bytes);
+    }
+
+    const size_t bytes = frames * frame_bytes;
+    if (fwrite(batch.data(), 1, bytes, pipe) != bytes) {
+      cerr << "Failed to write frames to encoder." << endl;
+      ok = false;
+      break;
+    }
+  }
+
+  const int ret = close_encoder_pipe(pipe);
+  if (ret != 0) {
+    cerr << fmt::format("Encoder exited with code {}.", ret) << endl;
+    return false;
+  }
+
+  return ok;
+}
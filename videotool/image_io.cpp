@@ -0,0 +1,145 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "videotool.h"
+
+namespace {
+
+// Each destination pixel covers [begin, end) of source pixels, where the first
+// and the last source pixel may be covered partially.
+struct resample_span {
+  int begin;
+  int end;
+  float weight_first;
+  float weight_last;
+  float inv_area;
+};
+
+std::vector<resample_span> make_spans(size_t src_len,
+                                      size_t dst_len) noexcept {
+  std::vector<resample_span> spans(dst_len);
+  const double scale = double(src_len) / double(dst_len);
+
+  for (size_t d = 0; d < dst_len; d++) {
+    const double lo = d * scale;
+    const double hi = std::min<double>((d + 1) * scale, src_len);
+
+    resample_span &s = spans[d];
+    s.begin = int(lo);
+    s.end = std::min<int>(int(std::ceil(hi)), src_len);
+    s.end = std::max(s.end, s.begin + 1);
+
+    s.weight_first = float(std::min<double>(s.begin + 1, hi) - lo);
+    s.weight_last = float(hi - (s.end - 1));
+    if (s.end - s.begin == 1) {
+      s.weight_last = s.weight_first;
+    }
+    s.inv_area = float(1.0 / (hi - lo));
+  }
+  return spans;
+}
+
+inline float span_weight(const resample_span &s, int idx) noexcept {
+  if (idx == s.begin) {
+    return s.weight_first;
+  }
+  if (idx == s.end - 1) {
+    return s.weight_last;
+  }
+  return 1.0f;
+}
+
+}  // namespace
+
+void resize_u8c3(const fractal_utils::fractal_map &src,
+                 fractal_utils::fractal_map &dst) noexcept {
+  assert(src.element_bytes == 3);
+  resize_u8c3(reinterpret_cast<const uint8_t *>(src.data), src.rows, src.cols,
+              src.cols * 3, dst);
+}
+
+void resize_u8c3(const uint8_t *src, size_t src_rows, size_t src_cols,
+                 size_t src_row_bytes,
+                 fractal_utils::fractal_map &dst) noexcept {
+  assert(dst.element_bytes == 3);
+
+  if (src_rows == dst.rows && src_cols == dst.cols) {
+    for (size_t r = 0; r < dst.rows; r++) {
+      memcpy(reinterpret_cast<uint8_t *>(dst.data) + r * dst.cols * 3,
+             src + r * src_row_bytes, dst.cols * 3);
+    }
+    return;
+  }
+
+  const auto spans_c = make_spans(src_cols, dst.cols);
+  const auto spans_r = make_spans(src_rows, dst.rows);
+
+  // horizontal pass, keep floats to avoid rounding twice.
+  thread_local std::vector<float> temp;
+  temp.resize(src_rows * dst.cols * 3);
+
+  for (size_t r = 0; r < src_rows; r++) {
+    const uint8_t *src_row = src + r * src_row_bytes;
+    float *tmp_row = temp.data() + r * dst.cols * 3;
+    for (size_t c = 0; c < dst.cols; c++) {
+      const resample_span &s = spans_c[c];
+      float sum[3]{0, 0, 0};
+      for (int sc = s.begin; sc < s.end; sc++) {
+        const float w = span_weight(s, sc);
+        for (int ch = 0; ch < 3; ch++) {
+          sum[ch] += w * src_row[sc * 3 + ch];
+        }
+      }
+      for (int ch = 0; ch < 3; ch++) {
+        tmp_row[c * 3 + ch] = sum[ch] * s.inv_area;
+      }
+    }
+  }
+
+  // vertical pass
+  for (size_t r = 0; r < dst.rows; r++) {
+    const resample_span &s = spans_r[r];
+    uint8_t *dst_row = reinterpret_cast<uint8_t *>(dst.data) + r * dst.cols * 3;
+    for (size_t i = 0; i < dst.cols * 3; i++) {
+      float sum = 0;
+      for (int sr = s.begin; sr < s.end; sr++) {
+        sum += span_weight(s, sr) * temp[sr * dst.cols * 3 + i];
+      }
+      dst_row[i] = uint8_t(std::clamp(sum * s.inv_area + 0.5f, 0.0f, 255.0f));
+    }
+  }
+}
+
+void blend_u8c3(fractal_utils::fractal_map &dst,
+                const fractal_utils::fractal_map &src, float alpha) noexcept {
+  assert(dst.rows == src.rows && dst.cols == src.cols);
+  assert(dst.element_bytes == 3 && src.element_bytes == 3);
+
+  uint8_t *const d = reinterpret_cast<uint8_t *>(dst.data);
+  const uint8_t *const s = reinterpret_cast<const uint8_t *>(src.data);
+  const float beta = 1.0f - alpha;
+
+#pragma omp simd
+  for (size_t i = 0; i < dst.byte_count(); i++) {
+    d[i] = uint8_t(alpha * s[i] + beta * d[i] + 0.5f);
+  }
+}
@@ -0,0 +1,228 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "journal.h"
+
+#include <fmt/format.h>
+#include <libHybfile.h>
+
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <sstream>
+
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using std::cout, std::cerr, std::endl;
+
+namespace {
+
+std::string_view stage_name(task_journal::stage s) noexcept {
+  switch (s) {
+    case task_journal::stage::compute:
+      return "compute";
+    case task_journal::stage::render:
+      return "render";
+  }
+  return "";
+}
+
+std::optional<task_journal::stage> parse_stage(std::string_view name) noexcept {
+  if (name == "compute") {
+    return task_journal::stage::compute;
+  }
+  if (name == "render") {
+    return task_journal::stage::render;
+  }
+  return std::nullopt;
+}
+
+}  // namespace
+
+std::unique_ptr<task_journal> task_journal::open(std::string_view filename,
+                                                 std::string *err) noexcept {
+  std::unique_ptr<task_journal> ret{new task_journal};
+  ret->m_filename = filename;
+
+  // config compute <fingerprint>
+  // frame compute <fidx> <bytes> <hash>
+  // checkpoint
+  std::ifstream ifs{ret->m_filename};
+  std::string str;
+  while (std::getline(ifs, str)) {
+    std::istringstream ss{str};
+    std::string type, stg_name;
+    ss >> type;
+    if (type == "checkpoint") {
+      ret->m_lines.emplace_back(line{line::kind::checkpoint});
+      continue;
+    }
+    ss >> stg_name;
+    const auto stg = parse_stage(stg_name);
+    if (!stg.has_value()) {
+      continue;
+    }
+    line l{line::kind::config, stg.value(), 0, {}};
+    if (type == "config") {
+      ss >> std::hex >> l.config;
+    } else if (type == "frame") {
+      l.type = line::kind::frame;
+      ss >> std::dec >> l.rec.fidx >> l.rec.bytes >> std::hex >> l.rec.hash;
+    } else {
+      continue;
+    }
+    std::string rest;
+    if (ss.fail() || (ss >> rest)) {
+      continue;
+    }
+    ret->m_lines.emplace_back(l);
+  }
+  ifs.close();
+
+  ret->m_file = fopen(ret->m_filename.c_str(), "ab");
+  if (ret->m_file == nullptr) {
+    *err = fmt::format("Failed to open {} for appending.", filename);
+    return nullptr;
+  }
+  return ret;
+}
+
+task_journal::~task_journal() {
+  if (this->m_file == nullptr) {
+    return;
+  }
+  this->checkpoint();
+  fclose(this->m_file);
+}
+
+std::set<int> task_journal::finished(stage s, uint64_t config,
+                                     const validate_fun &exists,
+                                     const validate_fun &validate) noexcept {
+  size_t trusted_end = 0;
+  for (size_t i = 0; i < this->m_lines.size(); i++) {
+    if (this->m_lines[i].type == line::kind::checkpoint) {
+      trusted_end = i;
+    }
+  }
+
+  std::set<int> ret;
+  std::optional<uint64_t> current{std::nullopt};
+  size_t validated = 0;
+  for (size_t i = 0; i < this->m_lines.size(); i++) {
+    const line &l = this->m_lines[i];
+    if (l.type == line::kind::checkpoint || l.stg != s) {
+      continue;
+    }
+    if (l.type == line::kind::config) {
+      // records of another configuration are outdated
+      if (current.has_value() && current.value() != l.config) {
+        ret.clear();
+      }
+      current = l.config;
+      continue;
+    }
+    if (current != config) {
+      continue;
+    }
+    // outputs may be deleted after the checkpoint
+    const bool ok = (i < trusted_end) ? exists(l.rec) : validate(l.rec);
+    validated += (i >= trusted_end);
+    if (ok) {
+      ret.emplace(l.rec.fidx);
+    } else {
+      ret.erase(l.rec.fidx);
+    }
+  }
+  if (current != config) {
+    ret.clear();
+    this->write_line(fmt::format("config {} {:016x}", stage_name(s), config));
+  }
+
+  if (!ret.empty()) {
+    cout << fmt::format(
+                "Journal {}: {} frames of {} are finished, {} records are "
+                "validated.",
+                this->m_filename, ret.size(), stage_name(s), validated)
+         << endl;
+  }
+  return ret;
+}
+
+void task_journal::append(stage s, const record &rec) noexcept {
+  this->write_line(fmt::format("frame {} {} {} {:016x}", stage_name(s),
+                               rec.fidx, rec.bytes, rec.hash));
+  bool need_sync;
+  {
+    std::lock_guard lk{this->m_lock};
+    need_sync = (++this->m_unsynced >= checkpoint_interval);
+  }
+  if (need_sync) {
+    this->checkpoint();
+  }
+}
+
+void task_journal::checkpoint() noexcept {
+  std::lock_guard lk{this->m_lock};
+  if (this->m_unsynced <= 0) {
+    return;
+  }
+  // records must be durable before the checkpoint that trusts them
+  this->sync();
+  fputs("checkpoint\n", this->m_file);
+  fflush(this->m_file);
+  this->m_unsynced = 0;
+}
+
+void task_journal::write_line(const std::string &content) noexcept {
+  std::lock_guard lk{this->m_lock};
+  // a killed process still leaves the flushed lines in the page cache
+  fmt::print(this->m_file, "{}\n", content);
+  fflush(this->m_file);
+}
+
+void task_journal::sync() noexcept {
+  fflush(this->m_file);
+#ifdef _WIN32
+  _commit(_fileno(this->m_file));
+#else
+  fsync(fileno(this->m_file));
+#endif
+}
+
+uint64_t hash_string(std::string_view str) noexcept {
+  return XXH3_64bits(str.data(), str.size());
+}
+
+bool hash_file(std::string_view filename, uint64_t seed, uint64_t &bytes,
+               uint64_t &hash) noexcept {
+  std::string err;
+  auto file = libHybractal::mapped_file::open(filename, err);
+  if (file == nullptr) {
+    return false;
+  }
+  bytes = file->size();
+  hash = XXH3_64bits_withSeed(file->data(), file->size(), seed);
+  return true;
+}
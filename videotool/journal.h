@@ -0,0 +1,107 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HYBRACTAL_VIDEOTOOL_JOURNAL_H
+#define HYBRACTAL_VIDEOTOOL_JOURNAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// An append-only journal of the frames finished by each stage of a task, so
+// that a resumed stage doesn't stat or validate every output again. A record
+// holds the size and hash of the outputs of a frame, and a checkpoint line is
+// appended each time the journal is fsynced. Records before the last
+// checkpoint are only checked cheaply, such as by the size of the files, and
+// later ones are validated against the files.
+// Lines that don't parse, like a torn last line, are ignored.
+//
+// Records are only valid for the configuration of the stage that wrote them,
+// which is identified by a fingerprint.
+class task_journal {
+ public:
+  enum class stage : uint8_t { compute, render };
+
+  struct record {
+    int fidx{-1};
+    uint64_t bytes{0};
+    uint64_t hash{0};
+  };
+
+  using validate_fun = std::function<bool(const record &)>;
+
+  // fsync after this number of records
+  static constexpr int checkpoint_interval = 64;
+
+ private:
+  struct line {
+    enum class kind : uint8_t { config, frame, checkpoint };
+    kind type{kind::checkpoint};
+    stage stg{stage::compute};
+    // fingerprint of config lines
+    uint64_t config{0};
+    record rec{};
+  };
+
+  std::string m_filename;
+  FILE *m_file{nullptr};
+  std::vector<line> m_lines;
+
+  std::mutex m_lock;
+  int m_unsynced{0};
+
+  task_journal() = default;
+
+ public:
+  task_journal(const task_journal &) = delete;
+  task_journal &operator=(const task_journal &) = delete;
+  // makes a checkpoint
+  ~task_journal();
+
+  // Load the journal and open it for appending, or create it.
+  static std::unique_ptr<task_journal> open(std::string_view filename,
+                                            std::string *err) noexcept;
+
+  // Frames finished by stage s with the configuration of fingerprint config.
+  // Records before the last checkpoint are kept if exists returns true, and
+  // later ones if validate returns true. Later records of the stage are
+  // appended with this fingerprint.
+  std::set<int> finished(stage s, uint64_t config, const validate_fun &exists,
+                         const validate_fun &validate) noexcept;
+
+  void append(stage s, const record &rec) noexcept;
+  void checkpoint() noexcept;
+
+ private:
+  void write_line(const std::string &content) noexcept;
+  void sync() noexcept;
+};
+
+uint64_t hash_string(std::string_view str) noexcept;
+// size and xxh3 of a file
+bool hash_file(std::string_view filename, uint64_t seed, uint64_t &bytes,
+               uint64_t &hash) noexcept;
+
+#endif  // HYBRACTAL_VIDEOTOOL_JOURNAL_H
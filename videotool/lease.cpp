@@ -0,0 +1,328 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "lease.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace stdfs = std::filesystem;
+using std::cout, std::cerr, std::endl;
+
+namespace {
+
+std::string make_owner_id() noexcept {
+  std::string host;
+  int pid;
+#ifdef _WIN32
+  char buf[MAX_COMPUTERNAME_LENGTH + 1]{};
+  DWORD len = sizeof(buf);
+  if (GetComputerNameA(buf, &len)) {
+    host.assign(buf, len);
+  }
+  pid = int(GetCurrentProcessId());
+#else
+  char buf[256]{};
+  if (gethostname(buf, sizeof(buf) - 1) == 0) {
+    host = buf;
+  }
+  pid = int(getpid());
+#endif
+  // owner ids are parts of filenames
+  std::replace_if(
+      host.begin(), host.end(),
+      [](char c) { return !std::isalnum((unsigned char)c) && c != '-'; }, '_');
+  if (host.empty()) {
+    host = "unknown";
+  }
+  std::random_device rd;
+  return fmt::format("{}-{}-{:08x}", host, pid, rd());
+}
+
+std::string read_owner(const std::string &filename) noexcept {
+  std::ifstream ifs{filename};
+  std::string ret;
+  std::getline(ifs, ret);
+  return ret;
+}
+
+}  // namespace
+
+frame_leases::frame_leases(std::string_view dir, std::string_view stage,
+                           double expiry) noexcept
+    : m_dir{dir},
+      m_stage{stage},
+      m_owner{make_owner_id()},
+      m_expiry{expiry} {
+  std::error_code ec;
+  stdfs::create_directories(this->m_dir, ec);
+  if (ec) {
+    cerr << fmt::format("Failed to create lease directory {}: {}",
+                        this->m_dir, ec.message())
+         << endl;
+    return;
+  }
+  this->m_ok = true;
+  this->m_heartbeat = std::thread{[this]() { this->heartbeat(); }};
+}
+
+frame_leases::~frame_leases() {
+  {
+    std::lock_guard lk{this->m_lock};
+    this->m_stop = true;
+  }
+  this->m_stop_cv.notify_all();
+  if (this->m_heartbeat.joinable()) {
+    this->m_heartbeat.join();
+  }
+  std::set<int> held;
+  {
+    std::lock_guard lk{this->m_lock};
+    held = this->m_held;
+  }
+  for (int fidx : held) {
+    this->release(fidx);
+  }
+}
+
+std::string frame_leases::lease_filename(int fidx) const noexcept {
+  return (stdfs::path{this->m_dir} /
+          fmt::format("{}-{:06}.lease", this->m_stage, fidx))
+      .string();
+}
+
+bool frame_leases::expired(const std::string &filename) const noexcept {
+  std::error_code ec;
+  const auto mtime = stdfs::last_write_time(filename, ec);
+  if (ec) {
+    // released in the meantime, claim it next time
+    return false;
+  }
+  const std::chrono::duration<double> age =
+      stdfs::file_time_type::clock::now() - mtime;
+  return age.count() > this->m_expiry;
+}
+
+frame_leases::claim_result frame_leases::claim(int fidx) noexcept {
+  const std::string filename = this->lease_filename(fidx);
+  const std::string temp = filename + "." + this->m_owner + ".tmp";
+  {
+    std::ofstream ofs{temp, std::ios::trunc};
+    ofs << this->m_owner << '\n';
+    if (!ofs) {
+      cerr << fmt::format("Failed to write {}", temp) << endl;
+      return claim_result::busy;
+    }
+  }
+
+  std::error_code ec;
+  claim_result ret = claim_result::busy;
+  for (bool recovering : {false, true}) {
+    // linking is atomic even on most network filesystems, unlike O_EXCL
+    stdfs::create_hard_link(temp, filename, ec);
+    if (!ec) {
+      ret = recovering ? claim_result::recovered : claim_result::claimed;
+      break;
+    }
+    if (recovering || !this->expired(filename)) {
+      break;
+    }
+    // Only one process can rename the stale lease away. If a fresh lease is
+    // renamed by a process that checked the stale one, the frame is only
+    // computed twice.
+    const std::string stale = filename + "." + this->m_owner + ".stale";
+    stdfs::rename(filename, stale, ec);
+    if (ec) {
+      break;
+    }
+    cout << fmt::format("Taking over {} from {}", filename, read_owner(stale))
+         << endl;
+    stdfs::remove(stale, ec);
+  }
+  stdfs::remove(temp, ec);
+
+  if (ret != claim_result::busy) {
+    std::lock_guard lk{this->m_lock};
+    this->m_held.emplace(fidx);
+  }
+  return ret;
+}
+
+void frame_leases::release(int fidx) noexcept {
+  {
+    std::lock_guard lk{this->m_lock};
+    if (this->m_held.erase(fidx) == 0) {
+      return;
+    }
+  }
+  const std::string filename = this->lease_filename(fidx);
+  // the lease may be taken over while this process stalled
+  if (read_owner(filename) == this->m_owner) {
+    std::error_code ec;
+    stdfs::remove(filename, ec);
+  }
+}
+
+std::vector<int> frame_leases::leased_frames() const noexcept {
+  std::vector<int> ret;
+  const std::string prefix = this->m_stage + "-";
+  const std::string_view suffix = ".lease";
+  std::error_code ec;
+  for (const auto &entry : stdfs::directory_iterator{this->m_dir, ec}) {
+    const std::string name = entry.path().filename().string();
+    if (!name.starts_with(prefix) || !name.ends_with(suffix)) {
+      continue;
+    }
+    int fidx;
+    const char *const end = name.data() + name.size() - suffix.size();
+    auto [ptr, err] = std::from_chars(name.data() + prefix.size(), end, fidx);
+    if (err == std::errc{} && ptr == end) {
+      ret.emplace_back(fidx);
+    }
+  }
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
+
+void frame_leases::heartbeat() noexcept {
+  const auto interval = std::chrono::duration<double>(this->poll_seconds());
+  std::unique_lock lk{this->m_lock};
+  while (!this->m_stop_cv.wait_for(lk, interval,
+                                   [this]() { return this->m_stop; })) {
+    const std::set<int> held = this->m_held;
+    lk.unlock();
+    for (int fidx : held) {
+      const std::string filename = this->lease_filename(fidx);
+      if (read_owner(filename) != this->m_owner) {
+        std::lock_guard g{this->m_lock};
+        // not released in the meantime
+        if (this->m_held.erase(fidx) > 0) {
+          cerr << fmt::format(
+                      "Warning: lease {} is taken over by another process, "
+                      "this frame may be computed twice.",
+                      filename)
+               << endl;
+        }
+        continue;
+      }
+      std::error_code ec;
+      stdfs::last_write_time(filename, stdfs::file_time_type::clock::now(),
+                             ec);
+    }
+    lk.lock();
+  }
+}
+
+frame_dispenser::frame_dispenser(const std::vector<int> &frames,
+                                 frame_leases *leases,
+                                 finished_fun finished) noexcept
+    : m_leases{leases},
+      m_finished{std::move(finished)},
+      m_pending{frames.begin(), frames.end()},
+      m_last_retry{std::chrono::steady_clock::now()} {}
+
+frame_dispenser::result frame_dispenser::next() noexcept {
+  std::unique_lock lk{this->m_lock};
+  while (true) {
+    if (this->m_pending.empty()) {
+      if (this->m_deferred.empty()) {
+        return {(this->m_claiming > 0) ? status::wait : status::exhausted};
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (std::chrono::duration<double>(now - this->m_last_retry).count() <
+          this->poll_seconds()) {
+        return {status::wait};
+      }
+      this->m_last_retry = now;
+      this->m_pending.swap(this->m_deferred);
+    }
+
+    const int fidx = this->m_pending.front();
+    this->m_pending.pop_front();
+    if (this->m_leases == nullptr) {
+      return {status::frame, fidx};
+    }
+
+    this->m_claiming++;
+    lk.unlock();
+    const auto claimed = this->m_leases->claim(fidx);
+    const bool recovered = (claimed == frame_leases::claim_result::recovered);
+    bool finished = false;
+    if (claimed != frame_leases::claim_result::busy) {
+      // other processes may have finished it since the frames were listed
+      finished = this->m_finished(fidx, recovered);
+      if (finished) {
+        this->m_leases->release(fidx);
+      }
+    }
+    lk.lock();
+    this->m_claiming--;
+
+    if (claimed == frame_leases::claim_result::busy) {
+      this->m_deferred.emplace_back(fidx);
+      continue;
+    }
+    if (finished) {
+      this->m_skipped++;
+      continue;
+    }
+    return {status::frame, fidx, recovered};
+  }
+}
+
+void frame_dispenser::done(int fidx) noexcept {
+  if (this->m_leases != nullptr) {
+    this->m_leases->release(fidx);
+  }
+}
+
+bool frame_dispenser::pending(int fidx) const noexcept {
+  std::lock_guard lk{this->m_lock};
+  return std::find(this->m_pending.begin(), this->m_pending.end(), fidx) !=
+             this->m_pending.end() ||
+         std::find(this->m_deferred.begin(), this->m_deferred.end(), fidx) !=
+             this->m_deferred.end();
+}
+
+bool frame_dispenser::exhausted() const noexcept {
+  std::lock_guard lk{this->m_lock};
+  return this->m_pending.empty() && this->m_deferred.empty() &&
+         this->m_claiming == 0;
+}
+
+int frame_dispenser::skipped() const noexcept {
+  std::lock_guard lk{this->m_lock};
+  return this->m_skipped;
+}
+
+double frame_dispenser::poll_seconds() const noexcept {
+  return (this->m_leases != nullptr) ? this->m_leases->poll_seconds() : 0;
+}
@@ -0,0 +1,146 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HYBRACTAL_VIDEOTOOL_LEASE_H
+#define HYBRACTAL_VIDEOTOOL_LEASE_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Frames are shared by processes, possibly on different machines, through
+// lease files in a shared directory. A process claims a frame by hard linking
+// a file that holds its owner id to <dir>/<stage>-<frame>.lease, which fails
+// if the lease exists. A heartbeat thread refreshes the mtime of held leases,
+// so a lease that is older than expiry seconds is left by a crashed process
+// and may be taken over. Clocks of the machines are expected to agree within
+// a small fraction of expiry.
+//
+// Leases only avoid duplicated work. A process that stalls longer than expiry
+// loses its frames, so outputs must be written atomically or idempotently.
+class frame_leases {
+ public:
+  enum class claim_result : uint8_t {
+    // held by a living process
+    busy,
+    claimed,
+    // taken over from a crashed process, outputs of the frame may be partial
+    recovered,
+  };
+
+ private:
+  std::string m_dir;
+  std::string m_stage;
+  std::string m_owner;
+  double m_expiry;
+  bool m_ok{false};
+
+  std::mutex m_lock;
+  std::condition_variable m_stop_cv;
+  bool m_stop{false};
+  std::set<int> m_held;
+  std::thread m_heartbeat;
+
+ public:
+  frame_leases(std::string_view dir, std::string_view stage,
+               double expiry) noexcept;
+  frame_leases(const frame_leases &) = delete;
+  frame_leases &operator=(const frame_leases &) = delete;
+  // stops the heartbeat and releases all held leases
+  ~frame_leases();
+
+  bool ok() const noexcept { return this->m_ok; }
+  // host name, process id and a random number
+  const std::string &owner() const noexcept { return this->m_owner; }
+  // interval of heartbeats, and of retrying frames leased by others
+  double poll_seconds() const noexcept { return this->m_expiry / 4; }
+
+  claim_result claim(int fidx) noexcept;
+  void release(int fidx) noexcept;
+  // frames that have a lease file, no matter who holds it
+  std::vector<int> leased_frames() const noexcept;
+
+ private:
+  std::string lease_filename(int fidx) const noexcept;
+  bool expired(const std::string &filename) const noexcept;
+  void heartbeat() noexcept;
+};
+
+// Hands out frames to the threads of one process. With leases, a frame is
+// handed out only after it is claimed, and frames leased by other processes
+// are retried until they are finished or their leases expire. Without leases,
+// frames are handed out in order.
+class frame_dispenser {
+ public:
+  enum class status : uint8_t {
+    frame,
+    // frames left are leased by others, try again after poll_seconds
+    wait,
+    exhausted,
+  };
+
+  struct result {
+    status st;
+    int fidx{-1};
+    // the frame is taken over from a crashed process
+    bool recovered{false};
+  };
+
+  // Whether a claimed frame is already finished by another process. The
+  // second argument is true if the lease is taken over from a crashed process.
+  using finished_fun = std::function<bool(int, bool)>;
+
+ private:
+  frame_leases *const m_leases;
+  const finished_fun m_finished;
+
+  mutable std::mutex m_lock;
+  std::deque<int> m_pending;
+  std::deque<int> m_deferred;
+  // popped from m_pending and being claimed
+  int m_claiming{0};
+  int m_skipped{0};
+  std::chrono::steady_clock::time_point m_last_retry;
+
+ public:
+  frame_dispenser(const std::vector<int> &frames, frame_leases *leases,
+                  finished_fun finished) noexcept;
+
+  // never blocks
+  result next() noexcept;
+  // release the lease after outputs of fidx are written or given up
+  void done(int fidx) noexcept;
+
+  // fidx is not handed out yet
+  bool pending(int fidx) const noexcept;
+  bool exhausted() const noexcept;
+  // frames finished by other processes
+  int skipped() const noexcept;
+  double poll_seconds() const noexcept;
+};
+
+#endif  // HYBRACTAL_VIDEOTOOL_LEASE_H
@@ -20,9 +20,11 @@ This file is part of Hybractal.
 #include <hex_convert.h>
 #include <libHybractal.h>
 
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <nlohmann/json.hpp>
+#include <tuple>
 
 #include "videotool.h"
 
@@ -32,14 +34,14 @@ std::string hybf_filename(const common_info &ci, int frameidx) noexcept {
 
 std::string png_filename(const common_info &ci, int frameidx,
                          int pngidx) noexcept {
-  return fmt::format("{}frame{:06}-png{:06}.png", ci.png_prefix, frameidx,
-                     pngidx);
+  return fmt::format("{}frame{:06}-png{:06}{}", ci.png_prefix, frameidx,
+                     pngidx, libHybractal::image_extension(ci.image_format));
 }
 
 std::string png_filename_expression(const common_info &ci,
                                     int frame_idx) noexcept {
-  return fmt::format("{}frame{:06}-png{}.png", ci.png_prefix, frame_idx,
-                     "%06d");
+  return fmt::format("{}frame{:06}-png{}{}", ci.png_prefix, frame_idx, "%06d",
+                     libHybractal::image_extension(ci.image_format));
 }
 
 using njson = nlohmann::json;
@@ -57,6 +59,16 @@ std::optional<full_task> load_task(std::string_view filename) noexcept {
     std::ifstream ifs(filename.data());
     njson jo = njson::parse(ifs, nullptr, true, true);
     ret = parse_fulltask(jo);
+
+    bool journal = true;
+    if (jo.at("common").contains("journal")) {
+      journal = jo.at("common").at("journal");
+    }
+    if (journal) {
+      ret.common.journal_file = std::filesystem::path{filename}
+                                    .replace_extension(".journal")
+                                    .string();
+    }
   } catch (std::exception &e) {
     std::cerr << fmt::format("Failed to parse {}, detail: {}", filename,
                              e.what())
@@ -87,6 +99,18 @@ common_info parse_common(const njson &jo) noexcept(false) {
     ret.video_prefix = "";
   }
 
+  if (jo.contains("image-format")) {
+    const std::string name = jo.at("image-format");
+    auto fmt_opt = libHybractal::parse_image_format(name);
+    if (!fmt_opt.has_value()) {
+      throw std::runtime_error{fmt::format(
+          "Invalid image-format \"{}\", expected png, qoi or ppm.", name)};
+    }
+    ret.image_format = fmt_opt.value();
+  } else {
+    ret.image_format = libHybractal::image_format::png;
+  }
+
   ret.rows = jo.at("rows");
   ret.cols = jo.at("cols");
   if (ret.rows <= 0 || ret.cols <= 0) {
@@ -104,7 +128,7 @@ common_info parse_common(const njson &jo) noexcept(false) {
 
   ret.maxit = jo.at("maxit");
 
-  if (ret.maxit <= 0 || ret.maxit > ::libHybractal::maxit_max) {
+  if (ret.maxit <= 0 || ret.maxit > ::libHybractal::maxit_max_wide) {
     throw std::runtime_error{
         fmt::format("Invalid value for maxit: {}", ret.maxit)};
     return {};
@@ -122,6 +146,22 @@ common_info parse_common(const njson &jo) noexcept(false) {
         fmt::format("ratio should be greater than 1, but it is {}", ret.ratio)};
   }
 
+  if (jo.contains("lease-dir")) {
+    ret.lease_dir = jo.at("lease-dir");
+  } else {
+    ret.lease_dir = "";
+  }
+
+  if (jo.contains("lease-expiry")) {
+    ret.lease_expiry = jo.at("lease-expiry");
+  } else {
+    ret.lease_expiry = 60;
+  }
+  if (ret.lease_expiry <= 0) {
+    throw std::runtime_error{fmt::format(
+        "lease-expiry should be positive, but it is {}", ret.lease_expiry)};
+  }
+
   return ret;
 }
 
@@ -153,6 +193,131 @@ compute_task parse_compute(const njson &jo) noexcept(false) {
         fmt::format("{} is not a valid precision.", ret.precision)};
   }
 
+  if (jo.contains("codec")) {
+    const std::string name = jo.at("codec");
+    auto codec = libHybractal::parse_codec(name);
+    if (!codec.has_value()) {
+      throw std::runtime_error{fmt::format(
+          "Invalid codec \"{}\", expected store, zstd or lz4.", name)};
+    }
+    ret.compression.codec = codec.value();
+  } else {
+    ret.compression.codec = libHybractal::hybf_codec::zstd;
+  }
+
+  if (jo.contains("compress-level")) {
+    ret.compression.level = jo.at("compress-level");
+  } else {
+    ret.compression.level = 0;
+  }
+
+  // Frames are always tiled, and tiles are compressed in parallel already, so
+  // zstd workers are not configurable.
+  ret.compression.zstd_workers = 0;
+
+  if (jo.contains("z-format")) {
+    const std::string name = jo.at("z-format");
+    auto zfmt = libHybractal::parse_z_format(name);
+    if (!zfmt.has_value()) {
+      throw std::runtime_error{fmt::format(
+          "Invalid z-format \"{}\", expected f64, f32 or norm-angle.", name)};
+    }
+    ret.z_fmt = zfmt.value();
+  } else {
+    ret.z_fmt = libHybractal::z_format::f64;
+  }
+
+  for (auto [key, dst, element_bytes] :
+       {std::make_tuple("age-filters", &ret.age_filters, sizeof(uint16_t)),
+        std::make_tuple("z-filters", &ret.z_filters,
+                        libHybractal::z_element_bytes(ret.z_fmt))}) {
+    if (!jo.contains(key)) {
+      continue;
+    }
+    const std::string names = jo.at(key);
+    auto filters = libHybractal::parse_filters(names);
+    std::string err;
+    if (!filters.has_value()) {
+      throw std::runtime_error{
+          fmt::format("Invalid {} \"{}\".", key, names)};
+    }
+    if (!libHybractal::check_filters(filters.value(), element_bytes, err)) {
+      throw std::runtime_error{fmt::format("Invalid {}: {}", key, err)};
+    }
+    *dst = filters.value();
+  }
+
+  if (jo.contains("z-tolerance")) {
+    ret.z_tolerance = jo.at("z-tolerance");
+  } else {
+    ret.z_tolerance = 0;
+  }
+  if (!(ret.z_tolerance >= 0)) {
+    throw std::runtime_error{
+        fmt::format("z-tolerance = {}", ret.z_tolerance)};
+  }
+
+  if (jo.contains("maxit-tolerance")) {
+    ret.maxit_tolerance = jo.at("maxit-tolerance");
+  } else {
+    ret.maxit_tolerance = 0;
+  }
+  if (!(ret.maxit_tolerance >= 0 && ret.maxit_tolerance < 1)) {
+    throw std::runtime_error{
+        fmt::format("maxit-tolerance = {}", ret.maxit_tolerance)};
+  }
+
+  if (jo.contains("maxit-probe-rows")) {
+    ret.maxit_probe_rows = jo.at("maxit-probe-rows");
+  } else {
+    ret.maxit_probe_rows = 64;
+  }
+  if (ret.maxit_probe_rows <= 0) {
+    throw std::runtime_error{
+        fmt::format("maxit-probe-rows = {}", ret.maxit_probe_rows)};
+  }
+
+  if (jo.contains("maxit-min")) {
+    ret.maxit_min = jo.at("maxit-min");
+  } else {
+    ret.maxit_min = 64;
+  }
+  if (ret.maxit_min <= 0) {
+    throw std::runtime_error{fmt::format("maxit-min = {}", ret.maxit_min)};
+  }
+
+  if (jo.contains("frames-in-flight")) {
+    ret.frames_in_flight = jo.at("frames-in-flight");
+  } else {
+    ret.frames_in_flight = 2;
+  }
+  if (ret.frames_in_flight <= 0) {
+    throw std::runtime_error{
+        fmt::format("frames-in-flight = {}", ret.frames_in_flight)};
+  }
+
+  if (jo.contains("frame-order")) {
+    const std::string order = jo.at("frame-order");
+    if (order != "in-order" && order != "deepest-first") {
+      throw std::runtime_error{fmt::format(
+          "Invalid frame-order \"{}\", expected in-order or deepest-first.",
+          order)};
+    }
+    ret.deepest_first = (order == "deepest-first");
+  } else {
+    ret.deepest_first = false;
+  }
+
+  if (jo.contains("write-threads")) {
+    ret.write_threads = jo.at("write-threads");
+  } else {
+    ret.write_threads = 1;
+  }
+  if (ret.write_threads <= 0) {
+    throw std::runtime_error{
+        fmt::format("write-threads = {}", ret.write_threads)};
+  }
+
   return ret;
 }
 
@@ -184,9 +349,53 @@ render_task parse_render(const njson &jo) noexcept(false) {
                     ret.extra_png_num, ret.png_per_frame)};
   }
 
+  if (jo.contains("png-compress-level")) {
+    ret.png_level = jo.at("png-compress-level");
+  } else {
+    ret.png_level = 1;
+  }
+
+  if (ret.png_level < 0 || ret.png_level > 9) {
+    throw std::runtime_error{
+        fmt::format("png-compress-level = {}", ret.png_level)};
+  }
+
+  for (auto [key, dst] : {std::make_pair("load-threads", &ret.load_threads),
+                          std::make_pair("render-threads", &ret.render_threads),
+                          std::make_pair("write-threads", &ret.write_threads),
+                          std::make_pair("queue-capacity",
+                                         &ret.queue_capacity)}) {
+    if (jo.contains(key)) {
+      *dst = jo.at(key);
+    } else {
+      *dst = 0;
+    }
+    if (*dst < 0) {
+      throw std::runtime_error{fmt::format("{} = {}", key, *dst)};
+    }
+  }
+
   return ret;
 }
 
+std::array<int, 3> render_stage_threads(const render_task &rt) noexcept {
+  // Rendering runs on gpu and the threads mainly wait for it, while png
+  // encoding is the most cpu hungry stage.
+  int load = rt.load_threads;
+  int render = rt.render_threads;
+  int write = rt.write_threads;
+  if (load <= 0) {
+    load = std::max(1, rt.threads / 4);
+  }
+  if (render <= 0) {
+    render = std::max(1, rt.threads / 4);
+  }
+  if (write <= 0) {
+    write = std::max(1, rt.threads - load - render);
+  }
+  return {load, render, write};
+}
+
 video_task::video_config parse_videotask_video_config(const njson &jo) noexcept(
     false) {
   video_task::video_config ret;
@@ -241,6 +450,12 @@ video_task parse_videotask(const njson &jo) noexcept(false) {
     ret.ffmpeg_exe = "ffmpeg";
   }
 
+  if (jo.contains("single-pass")) {
+    ret.single_pass = jo.at("single-pass");
+  } else {
+    ret.single_pass = true;
+  }
+
   return ret;
 }
 
@@ -260,6 +475,16 @@ full_task parse_fulltask(const njson &jo) noexcept(false) {
     throw std::runtime_error{
         fmt::format("Failed to parse compute. Detail: {}", e.what())};
   }
+  {
+    // such as z-tolerance with z-format other than f64
+    std::string err;
+    if (!libHybractal::hybf_archive::check_save_options(
+            hybf_save_options(task.compute), true, task.compute.z_fmt,
+            libHybractal::age_format_for_maxit(task.common.maxit), &err)) {
+      throw std::runtime_error{
+          fmt::format("Failed to parse compute. Detail: {}", err)};
+    }
+  }
 
   try {
     task.render = parse_render(jo.at("render"));
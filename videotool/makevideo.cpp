@@ -32,13 +32,23 @@ This file is part of Hybractal.
 
 #include <fmt/format.h>
 #include <omp.h>
+#include <stdio.h>
 
 #include <atomic>
 #include <filesystem>
 #include <fstream>
+#include <iostream>
 
 #include "videotool.h"
 
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+constexpr const char *pipe_write_mode = "wb";
+#else
+constexpr const char *pipe_write_mode = "w";
+#endif
+
 namespace stdfs = std::filesystem;
 
 std::string ir_video_name(int frame_idx, bool is_extra, const common_info &ci,
@@ -82,11 +92,164 @@ int run_command(std::string_view command, bool is_dry_run) noexcept {
   return system(command.data());
 }
 
+std::string product_filename(const common_info &ci,
+                             const video_task &vt) noexcept {
+  if (!vt.product_name.empty()) {
+    return vt.product_name + vt.product_config.extension;
+  }
+  return ci.video_prefix + "product" + vt.product_config.extension;
+}
+
 bool write_concate_sources(std::string_view filename,
                            const std::vector<std::string> &mp4s) noexcept;
 
+bool run_makevideo_single_pass(const common_info &ci, const render_task &rt,
+                               const video_task &vt, bool dry_run) noexcept;
+bool run_makevideo_multi_pass(const common_info &ci, const render_task &rt,
+                              const video_task &vt, bool dry_run) noexcept;
+
 bool run_makevideo(const common_info &ci, const render_task &rt,
                    const video_task &vt, bool dry_run) noexcept {
+  if (vt.single_pass) {
+    return run_makevideo_single_pass(ci, rt, vt, dry_run);
+  }
+  return run_makevideo_multi_pass(ci, rt, vt, dry_run);
+}
+
+bool load_and_resize(std::string_view filename,
+                     libHybractal::image_format format,
+                     std::vector<uint8_t> &buffer,
+                     fractal_utils::fractal_map &dst) noexcept {
+  size_t rows{0}, cols{0};
+  if (!libHybractal::read_image_u8c3(filename.data(), format, buffer, rows,
+                                     cols)) {
+    std::cerr << fmt::format("Failed to load {}", filename) << std::endl;
+    return false;
+  }
+
+  const fractal_utils::fractal_map src{rows, cols, 3, buffer.data()};
+  resize_u8c3(src, dst);
+  return true;
+}
+
+std::string encoder_pipe_command(const common_info &ci,
+                                 const render_task &rt,
+                                 const video_task &vt) noexcept {
+  // ffmpeg -f rawvideo -pix_fmt rgb24 -s 960x540 -r 60 -i - -c:v libx265 -crf
+  // 18 -y product.mp4
+  return fmt::format(
+      "{} -loglevel quiet -f rawvideo -pix_fmt rgb24 -s {} -r {} -i - {} -y "
+      "{}",
+      vt.ffmpeg_exe, size_expression(ci), rt.png_per_frame,
+      encode_expr(vt.product_config), product_filename(ci, vt));
+}
+
+FILE *open_encoder_pipe(std::string_view command) noexcept {
+  FILE *const pipe = popen(command.data(), pipe_write_mode);
+  if (pipe == nullptr) {
+    std::cerr << fmt::format("Failed to launch encoder with command: {}",
+                             command)
+              << std::endl;
+  }
+  return pipe;
+}
+
+int close_encoder_pipe(FILE *pipe) noexcept { return pclose(pipe); }
+
+bool run_makevideo_single_pass(const common_info &ci, const render_task &rt,
+                               const video_task &vt, bool dry_run) noexcept {
+  const auto size = video_size(ci);
+  const int fps = rt.png_per_frame;
+  const size_t frame_bytes = size_t(size[0]) * size_t(size[1]) * 3;
+
+  const std::string command = encoder_pipe_command(ci, rt, vt);
+
+  if (dry_run) {
+    std::cout << command << std::endl;
+    return true;
+  }
+
+  FILE *const pipe = open_encoder_pipe(command);
+  if (pipe == nullptr) {
+    return false;
+  }
+
+  omp_set_num_threads(vt.threads);
+
+  // all video frames made from the same hybf frame
+  std::vector<uint8_t> batch(frame_bytes * fps);
+  std::atomic_int err_counter = 0;
+
+  for (int fidx = 0; fidx < ci.frame_num; fidx++) {
+    std::cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : encoding frame {}",
+                             100 * float(fidx) / ci.frame_num, fidx,
+                             ci.frame_num, fidx)
+              << std::endl;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int pngidx = 0; pngidx < fps; pngidx++) {
+      thread_local std::vector<uint8_t> buffer;
+      thread_local std::vector<uint8_t> extra;
+
+      fractal_utils::fractal_map dst{size_t(size[0]), size_t(size[1]), 3,
+                                     batch.data() + pngidx * frame_bytes};
+
+      const std::string common_png = png_filename(ci, fidx, pngidx);
+      if (!load_and_resize(common_png, ci.image_format, buffer, dst)) {
+        err_counter++;
+        continue;
+      }
+
+      // The extra pngs of the previous frame fade out on the first frames,
+      // just like what the geq-alphamerge-overlay filter does.
+      if (fidx <= 0 || pngidx >= rt.extra_png_num) {
+        continue;
+      }
+
+      extra.resize(frame_bytes);
+      fractal_utils::fractal_map extra_map{size_t(size[0]), size_t(size[1]), 3,
+                                           extra.data()};
+      const std::string extra_png = png_filename(ci, fidx - 1, fps + pngidx);
+      if (!load_and_resize(extra_png, ci.image_format, buffer, extra_map)) {
+        err_counter++;
+        continue;
+      }
+
+      const float alpha =
+          float(rt.extra_png_num - pngidx) / (rt.extra_png_num + 1);
+      blend_u8c3(dst, extra_map, alpha);
+    }
+
+    if (err_counter != 0) {
+      break;
+    }
+
+    if (fwrite(batch.data(), 1, batch.size(), pipe) != batch.size()) {
+      std::cerr << "Failed to write frames to encoder." << std::endl;
+      err_counter++;
+      break;
+    }
+  }
+
+  const int ret = close_encoder_pipe(pipe);
+
+  if (err_counter != 0) {
+    std::cerr << fmt::format("Failed to make video, {} images failed to load.",
+                             err_counter.load())
+              << std::endl;
+    return false;
+  }
+
+  if (ret != 0) {
+    std::cerr << fmt::format("Encoder exited with code {}.", ret) << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool run_makevideo_multi_pass(const common_info &ci, const render_task &rt,
+                              const video_task &vt, bool dry_run) noexcept {
   // produce ir videos
 
   const std::string video_size_str = size_expression(ci);
@@ -239,12 +402,7 @@ bool run_makevideo(const common_info &ci, const render_task &rt,
   ///////////////////////
   std::cout << "Making product video..." << std::endl;
   {
-    std::string product_name;
-    if (!vt.product_name.empty()) {
-      product_name = vt.product_name + vt.product_config.extension;
-    } else {
-      product_name = ci.video_prefix + "product" + vt.product_config.extension;
-    }
+    const std::string product_name = product_filename(ci, vt);
 
     std::string product_encode_expr =
         fmt::format("-c:v {} {}", vt.product_config.encoder,
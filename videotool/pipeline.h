@@ -0,0 +1,145 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HYBRACTAL_VIDEOTOOL_PIPELINE_H
+#define HYBRACTAL_VIDEOTOOL_PIPELINE_H
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+
+// A blocking fifo with fixed capacity. push blocks when the queue is full, so
+// a slow stage throttles the stages before it instead of piling up frames in
+// memory. Once every producer has called close, pop drains the remaining
+// elements and then returns nullopt.
+template <typename T>
+class bounded_queue {
+ private:
+  std::deque<T> m_queue;
+  mutable std::mutex m_lock;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+  size_t m_capacity;
+  int m_producers;
+
+ public:
+  explicit bounded_queue(size_t capacity, int producers = 1)
+      : m_capacity{std::max<size_t>(capacity, 1)}, m_producers{producers} {}
+
+  bounded_queue(const bounded_queue &) = delete;
+  bounded_queue &operator=(const bounded_queue &) = delete;
+
+  void push(T &&val) noexcept {
+    std::unique_lock lk{this->m_lock};
+    this->m_not_full.wait(
+        lk, [this]() { return this->m_queue.size() < this->m_capacity; });
+    this->m_queue.emplace_back(std::move(val));
+    lk.unlock();
+    this->m_not_empty.notify_one();
+  }
+
+  std::optional<T> pop() noexcept {
+    std::unique_lock lk{this->m_lock};
+    this->m_not_empty.wait(lk, [this]() {
+      return !this->m_queue.empty() || this->m_producers <= 0;
+    });
+    if (this->m_queue.empty()) {
+      return std::nullopt;
+    }
+    T ret = std::move(this->m_queue.front());
+    this->m_queue.pop_front();
+    lk.unlock();
+    this->m_not_full.notify_one();
+    return ret;
+  }
+
+  // Called by each producer once it will push nothing more.
+  void close() noexcept {
+    {
+      std::lock_guard lk{this->m_lock};
+      this->m_producers--;
+    }
+    this->m_not_empty.notify_all();
+  }
+
+  size_t size() const noexcept {
+    std::lock_guard lk{this->m_lock};
+    return this->m_queue.size();
+  }
+
+  size_t capacity() const noexcept { return this->m_capacity; }
+};
+
+// Accumulates the time that the threads of a stage spent on real work, so that
+// the utilization of each stage can be reported after the pipeline finished.
+class stage_meter {
+ private:
+  std::string m_name;
+  int m_threads;
+  std::atomic<int64_t> m_busy_ns{0};
+  std::atomic<int> m_items{0};
+
+ public:
+  using clock_t = std::chrono::steady_clock;
+
+  stage_meter(std::string_view name, int threads)
+      : m_name{name}, m_threads{threads} {}
+
+  class scope {
+   private:
+    stage_meter *m_meter;
+    clock_t::time_point m_begin;
+
+   public:
+    explicit scope(stage_meter &m) : m_meter{&m}, m_begin{clock_t::now()} {}
+    ~scope() {
+      const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          clock_t::now() - this->m_begin)
+                          .count();
+      this->m_meter->m_busy_ns += ns;
+      this->m_meter->m_items++;
+    }
+  };
+
+  [[nodiscard]] scope measure() noexcept { return scope{*this}; }
+
+  int threads() const noexcept { return this->m_threads; }
+
+  double busy_seconds() const noexcept { return this->m_busy_ns * 1e-9; }
+
+  // busy time divided by the time that all threads of this stage existed.
+  std::string report(double wall_seconds) const noexcept {
+    const double busy = this->m_busy_ns * 1e-9;
+    const double util =
+        (wall_seconds > 0 && this->m_threads > 0)
+            ? 100 * busy / (wall_seconds * this->m_threads)
+            : 0;
+    return fmt::format(
+        "{:<8} : {:>2} threads, {:>5} items, busy {:>9.3f} s, utilization "
+        "{:>5.1f}%",
+        this->m_name, this->m_threads, this->m_items.load(), busy, util);
+  }
+};
+
+#endif  // HYBRACTAL_VIDEOTOOL_PIPELINE_H
@@ -21,17 +21,99 @@ This file is part of Hybractal.
 #include <omp.h>
 #include <png_utils.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <thread>
 
+#include "journal.h"
+#include "lease.h"
+#include "pipeline.h"
 #include "videotool.h"
 
 using std::cout, std::cerr, std::endl;
 
-std::vector<int> pngs_missing(const common_info &ci,
-                              const render_task &rt) noexcept;
+// frames in journaled are finished and not checked again
+std::vector<int> pngs_missing(const common_info &ci, const render_task &rt,
+                              const std::set<int> &journaled) noexcept;
+bool pngs_complete(const common_info &ci, const render_task &rt,
+                   int fidx) noexcept;
+// total size of the pngs of a frame, and xor of their hashes seeded by pngidx
+bool hash_pngs(const common_info &ci, const render_task &rt, int fidx,
+               task_journal::record &rec) noexcept;
+
+namespace {
+
+// Journal records of frames are outdated if this changes.
+uint64_t render_fingerprint(const common_info &ci,
+                            const render_task &rt) noexcept {
+  std::ifstream ifs{rt.config_file};
+  const std::string config{std::istreambuf_iterator<char>{ifs}, {}};
+  return hash_string(fmt::format(
+      "{} {} {} {} {} {} {} {}", ci.png_prefix, ci.rows, ci.cols,
+      ci.frame_num, int(ci.image_format), rt.png_per_frame, rt.extra_png_num,
+      hash_string(config)));
+}
+
+struct loaded_frame {
+  int fidx;
+  libHybractal::hybf_archive archive;
+};
+
+struct rendered_frame {
+  int fidx;
+  std::unique_ptr<fractal_utils::fractal_map> image;
+  std::atomic<int> pngs_left;
+  std::atomic<int> errors{0};
+  // recorded in the journal
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> hash{0};
+};
+
+// Every png of a frame is a job of its own, so that a few large frames still
+// spread over all writer threads.
+struct write_job {
+  std::shared_ptr<rendered_frame> frame;
+  int pngidx;
+};
+
+bool write_png_of_frame(const common_info &ci, const render_task &rt,
+                        int fidx, fractal_utils::fractal_map &mat_u8c3,
+                        int pngidx) noexcept {
+  std::string pfilename = png_filename(ci, fidx, pngidx);
+
+  const int skip_rows =
+      fractal_utils::skip_rows(ci.rows, ci.ratio, rt.png_per_frame, pngidx);
+  const int skip_cols =
+      fractal_utils::skip_cols(ci.cols, ci.ratio, rt.png_per_frame, pngidx);
+  const int image_rows = ci.rows - 2 * skip_rows;
+  const int image_cols = ci.cols - 2 * skip_cols;
+  thread_local std::vector<const void *> row_ptrs;
+  row_ptrs.resize(image_rows);
+
+  for (int idx = 0; idx < image_rows; idx++) {
+    const int r = idx + skip_rows;
+    row_ptrs[idx] = mat_u8c3.address<fractal_utils::pixel_RGB>(r, skip_cols);
+  }
+
+  const bool ok = libHybractal::write_image_u8c3(
+      pfilename.c_str(), ci.image_format, row_ptrs.data(), image_rows,
+      image_cols, rt.png_level);
+  if (!ok) {
+    cerr << fmt::format("Failed to export {} for frame {}", pfilename, fidx)
+         << endl;
+  }
+  return ok;
+}
+
+}  // namespace
 
 bool run_render(const common_info &ci, const render_task &rt) noexcept {
   libHybractal::hsv_render_option render;
@@ -46,95 +128,243 @@ bool run_render(const common_info &ci, const render_task &rt) noexcept {
     render = temp.value();
   }
 
-  // read archives and check
-  // std::vector<libHybractal::hybf_archive> archives;
-  // archives.reserve(ci.frame_num);
+  std::unique_ptr<task_journal> journal{nullptr};
+  std::set<int> journaled;
+  if (!ci.journal_file.empty()) {
+    std::string err;
+    journal = task_journal::open(ci.journal_file, &err);
+    if (journal == nullptr) {
+      // such as a task file in a read-only directory
+      cerr << fmt::format("Warning: {} Frames are checked without a journal.",
+                          err)
+           << endl;
+    } else {
+      journaled = journal->finished(
+          task_journal::stage::render, render_fingerprint(ci, rt),
+          [&ci, &rt](const task_journal::record &rec) {
+            uint64_t bytes = 0;
+            for (int pidx = 0; pidx < rt.png_per_frame + rt.extra_png_num;
+                 pidx++) {
+              std::error_code ec;
+              bytes += std::filesystem::file_size(
+                  png_filename(ci, rec.fidx, pidx), ec);
+              if (ec) {
+                return false;
+              }
+            }
+            return bytes == rec.bytes;
+          },
+          [&ci, &rt](const task_journal::record &rec) {
+            task_journal::record current{rec.fidx};
+            return hash_pngs(ci, rt, rec.fidx, current) &&
+                   current.bytes == rec.bytes && current.hash == rec.hash;
+          });
+    }
+  }
 
-  const auto frames_to_render = pngs_missing(ci, rt);
+  std::unique_ptr<frame_leases> leases{nullptr};
+  auto frames_to_render = pngs_missing(ci, rt, journaled);
+  if (!ci.lease_dir.empty()) {
+    leases = std::make_unique<frame_leases>(ci.lease_dir, "render",
+                                            ci.lease_expiry);
+    if (!leases->ok()) {
+      return false;
+    }
+    cout << fmt::format("Sharing frames through {} as {}", ci.lease_dir,
+                        leases->owner())
+         << endl;
+    // pngs of a crashed process exist but may be partial, so leased frames
+    // are rendered again if their leases expire.
+    const auto leased = leases->leased_frames();
+    std::vector<int> merged;
+    std::set_union(frames_to_render.begin(), frames_to_render.end(),
+                   leased.begin(), leased.end(), std::back_inserter(merged));
+    frames_to_render = std::move(merged);
+  }
+  frame_dispenser frames{frames_to_render, leases.get(),
+                         [&ci, &rt](int fidx, bool recovered) {
+                           return !recovered && pngs_complete(ci, rt, fidx);
+                         }};
+
+  // The render is a pipeline of 3 stages: read and decompress hybf files,
+  // render them on gpu, and encode pngs. Bounded queues between stages keep
+  // the memory usage constant and let the slowest stage set the pace.
+  const auto [load_threads, render_threads, write_threads] =
+      render_stage_threads(rt);
+  const int capacity =
+      (rt.queue_capacity > 0) ? rt.queue_capacity : 2 * render_threads;
+  const int pngs_per_frame = rt.png_per_frame + rt.extra_png_num;
+
+  bounded_queue<loaded_frame> loaded{size_t(capacity), load_threads};
+  bounded_queue<write_job> jobs{size_t(capacity * pngs_per_frame),
+                                render_threads};
+  // rendered images are recycled, a render thread waits here when all writers
+  // fall behind.
+  const int image_num = capacity + render_threads;
+  bounded_queue<std::unique_ptr<fractal_utils::fractal_map>> free_images{
+      size_t(image_num)};
+  for (int i = 0; i < image_num; i++) {
+    free_images.push(
+        std::make_unique<fractal_utils::fractal_map>(ci.rows, ci.cols, 3));
+  }
+
+  stage_meter meter_load{"load", load_threads};
+  stage_meter meter_render{"render", render_threads};
+  stage_meter meter_write{"write", write_threads};
 
-  omp_set_num_threads(rt.threads);
   std::atomic<int> error_counter{0};
   std::atomic<int> rendered_frame_counter =
       ci.frame_num - frames_to_render.size();
   std::mutex cout_lock;
-#pragma omp parallel for schedule(dynamic)
-  for (int taskidx = 0; taskidx < frames_to_render.size(); taskidx++) {
-    const int fidx = frames_to_render[taskidx];
-    if (cout_lock.try_lock()) {
-      cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : rendering {}",
-                          100 * float(rendered_frame_counter) /
-                              std::max(ci.frame_num, 1),
-                          rendered_frame_counter, ci.frame_num,
-                          hybf_filename(ci, fidx))
-           << endl;
-      cout_lock.unlock();
+
+  auto load_worker = [&]() {
+    std::vector<uint8_t> buffer;
+    while (true) {
+      const auto next = frames.next();
+      if (next.st == frame_dispenser::status::exhausted) {
+        break;
+      }
+      if (next.st == frame_dispenser::status::wait) {
+        std::this_thread::sleep_for(
+            std::chrono::duration<double>(frames.poll_seconds()));
+        continue;
+      }
+      const int fidx = next.fidx;
+      if (cout_lock.try_lock()) {
+        cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : rendering {}",
+                            100 * float(rendered_frame_counter) /
+                                std::max(ci.frame_num, 1),
+                            rendered_frame_counter, ci.frame_num,
+                            hybf_filename(ci, fidx))
+             << endl;
+        cout_lock.unlock();
+      }
+
+      loaded_frame frame{fidx, {}};
+      {
+        auto m = meter_load.measure();
+        bool exists;
+        std::string filename = hybf_filename(ci, fidx);
+        check_hybf_option opt;
+        opt.move_archive = &frame.archive;
+        opt.nocheck_sequence = true;
+
+        if (!check_hybf(filename, ci, buffer, exists, opt)) {
+          if (exists) {
+            cerr << fmt::format("Source file {} exists, but it is invalid.",
+                                filename)
+                 << endl;
+          } else {
+            cerr << fmt::format("Source file {} is missing.", filename)
+                 << endl;
+          }
+          frames.done(fidx);
+          continue;
+        }
+      }
+      loaded.push(std::move(frame));
     }
-    thread_local libHybractal::gpu_resource gpu_rcs(ci.rows, ci.cols);
+    loaded.close();
+  };
+
+  auto render_worker = [&]() {
+    libHybractal::gpu_resource gpu_rcs(ci.rows, ci.cols);
     if (!gpu_rcs.ok()) {
       cerr << "Fatal error : failed to initialize gpu resource." << endl;
       exit(1);
     }
-    thread_local fractal_utils::fractal_map mat_u8c3(ci.rows, ci.cols, 3);
-    thread_local std::vector<uint8_t> buffer;
-
-    libHybractal::hybf_archive archive;
-    {
-      bool exists;
-      std::string filename = hybf_filename(ci, fidx);
-      check_hybf_option opt;
-      opt.move_archive = &archive;
-      opt.nocheck_sequence = true;
-
-      if (!check_hybf(filename, ci, buffer, exists, opt)) {
-        if (exists) {
-          cerr << fmt::format("Source file {} exists, but it is invalid.",
-                              filename)
-               << endl;
-        } else {
-          cerr << fmt::format("Source file {} is missing.", filename) << endl;
-        }
-        continue;
+
+    while (true) {
+      auto frame = loaded.pop();
+      if (!frame.has_value()) {
+        break;
       }
-    }
+      auto image = free_images.pop();
+      assert(image.has_value());
 
-    // auto &archive = archives[fidx];
-    libHybractal::render_hsv(archive.map_age(), archive.map_z(), mat_u8c3,
-                             render, gpu_rcs);
-    std::vector<const void *> row_ptrs;
-
-    for (int pngidx = 0; pngidx < rt.png_per_frame + rt.extra_png_num;
-         pngidx++) {
-      std::string pfilename = png_filename(ci, fidx, pngidx);
-
-      const int skip_rows =
-          fractal_utils::skip_rows(ci.rows, ci.ratio, rt.png_per_frame, pngidx);
-      const int skip_cols =
-          fractal_utils::skip_cols(ci.cols, ci.ratio, rt.png_per_frame, pngidx);
-      const int image_rows = ci.rows - 2 * skip_rows;
-      const int image_cols = ci.cols - 2 * skip_cols;
-      row_ptrs.resize(image_rows);
-      for (auto &ptr : row_ptrs) {
-        ptr = nullptr;
+      auto rendered = std::make_shared<rendered_frame>();
+      rendered->fidx = frame->fidx;
+      rendered->image = std::move(image.value());
+      rendered->pngs_left = pngs_per_frame;
+      {
+        auto m = meter_render.measure();
+        libHybractal::render_hsv(frame->archive.map_age(),
+                                 frame->archive.map_z(), *rendered->image,
+                                 render, gpu_rcs);
       }
+      // release the decompressed archive before waiting on writers
+      frame.reset();
 
-      for (int idx = 0; idx < image_rows; idx++) {
-        const int r = idx + skip_rows;
-        row_ptrs[idx] =
-            mat_u8c3.address<fractal_utils::pixel_RGB>(r, skip_cols);
+      for (int pngidx = 0; pngidx < pngs_per_frame; pngidx++) {
+        jobs.push(write_job{rendered, pngidx});
       }
+    }
+    jobs.close();
+  };
 
-      const bool ok = fractal_utils::write_png(
-          pfilename.c_str(), fractal_utils::color_space::u8c3, row_ptrs.data(),
-          image_rows, image_cols);
-      if (!ok) {
-        cerr << fmt::format("Failed to export {} for frame {}", pfilename, fidx)
-             << endl;
-        error_counter++;
-        continue;
+  auto write_worker = [&]() {
+    // writers already run in parallel, nested parallelism in the png encoder
+    // would only oversubscribe cores.
+    omp_set_num_threads(1);
+    while (true) {
+      auto job = jobs.pop();
+      if (!job.has_value()) {
+        break;
+      }
+      rendered_frame &frame = *job->frame;
+      {
+        auto m = meter_write.measure();
+        if (!write_png_of_frame(ci, rt, frame.fidx, *frame.image,
+                                job->pngidx)) {
+          frame.errors++;
+        } else if (journal != nullptr) {
+          uint64_t bytes, hash;
+          if (hash_file(png_filename(ci, frame.fidx, job->pngidx),
+                        job->pngidx, bytes, hash)) {
+            frame.bytes += bytes;
+            frame.hash ^= hash;
+          } else {
+            frame.errors++;
+          }
+        }
       }
+
+      if (--frame.pngs_left == 0) {
+        frames.done(frame.fidx);
+        if (frame.errors > 0) {
+          error_counter++;
+        } else {
+          rendered_frame_counter++;
+          if (journal != nullptr) {
+            journal->append(task_journal::stage::render,
+                            {frame.fidx, frame.bytes, frame.hash});
+          }
+        }
+        free_images.push(std::move(frame.image));
+      }
+    }
+  };
+
+  const auto wall_begin = stage_meter::clock_t::now();
+  {
+    std::vector<std::thread> workers;
+    workers.reserve(load_threads + render_threads + write_threads);
+    for (int i = 0; i < load_threads; i++) {
+      workers.emplace_back(load_worker);
+    }
+    for (int i = 0; i < render_threads; i++) {
+      workers.emplace_back(render_worker);
+    }
+    for (int i = 0; i < write_threads; i++) {
+      workers.emplace_back(write_worker);
+    }
+    for (auto &t : workers) {
+      t.join();
     }
-    rendered_frame_counter++;
   }
+  const double wall_seconds =
+      std::chrono::duration<double>(stage_meter::clock_t::now() - wall_begin)
+          .count();
 
   cout << fmt::format(
               "[{:^6.1f}% : {:^3} / {:^3}] : All tasks finished({} "
@@ -142,28 +372,57 @@ bool run_render(const common_info &ci, const render_task &rt) noexcept {
               100.0f, rendered_frame_counter, ci.frame_num, error_counter)
        << endl;
 
+  if (journal != nullptr) {
+    journal->checkpoint();
+  }
+
+  cout << fmt::format("Pipeline finished in {:.3f} s, queue capacity = {}",
+                      wall_seconds, capacity)
+       << endl;
+  for (const stage_meter *m : {&meter_load, &meter_render, &meter_write}) {
+    cout << "  " << m->report(wall_seconds) << endl;
+  }
+
   return error_counter == 0;
 }
 
-std::vector<int> pngs_missing(const common_info &ci,
-                              const render_task &rt) noexcept {
+std::vector<int> pngs_missing(const common_info &ci, const render_task &rt,
+                              const std::set<int> &journaled) noexcept {
   std::vector<int> ret;
   ret.reserve(ci.frame_num);
 
   for (int fidx = 0; fidx < ci.frame_num; fidx++) {
-    bool have_missing{false};
-    for (int pidx = 0; pidx < rt.png_per_frame + rt.extra_png_num; pidx++) {
-      std::string filename = png_filename(ci, fidx, pidx);
-      if (!std::filesystem::is_regular_file(filename)) {
-        have_missing = true;
-        break;
-      }
-    }
-
-    if (have_missing) {
+    if (!journaled.contains(fidx) && !pngs_complete(ci, rt, fidx)) {
       ret.emplace_back(fidx);
     }
   }
 
   return ret;
+}
+
+bool pngs_complete(const common_info &ci, const render_task &rt,
+                   int fidx) noexcept {
+  for (int pidx = 0; pidx < rt.png_per_frame + rt.extra_png_num; pidx++) {
+    std::string filename = png_filename(ci, fidx, pidx);
+    if (!std::filesystem::is_regular_file(filename)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool hash_pngs(const common_info &ci, const render_task &rt, int fidx,
+               task_journal::record &rec) noexcept {
+  rec.fidx = fidx;
+  rec.bytes = 0;
+  rec.hash = 0;
+  for (int pidx = 0; pidx < rt.png_per_frame + rt.extra_png_num; pidx++) {
+    uint64_t bytes, hash;
+    if (!hash_file(png_filename(ci, fidx, pidx), pidx, bytes, hash)) {
+      return false;
+    }
+    rec.bytes += bytes;
+    rec.hash ^= hash;
+  }
+  return true;
 }
\ No newline at end of file
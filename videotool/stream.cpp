@@ -0,0 +1,290 @@
+/*
+ Copyright © 2023  TokiNoBug
+This file is part of Hybractal.
+
+    Hybractal is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Hybractal is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Hybractal.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <fmt/format.h>
+#include <libRender.h>
+#include <omp.h>
+#include <png_utils.h>
+
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "pipeline.h"
+#include "videotool.h"
+
+using std::cout, std::cerr, std::endl;
+
+namespace {
+
+struct computed_frame {
+  int fidx;
+  libHybractal::hybf_archive archive;
+};
+
+using image_ptr = std::unique_ptr<fractal_utils::fractal_map>;
+
+struct rendered_frame {
+  int fidx;
+  image_ptr image;
+};
+
+// Crop the region that png pngidx would have contained, and scale it to dst.
+void crop_and_resize(const common_info &ci, const render_task &rt,
+                     const fractal_utils::fractal_map &image, int pngidx,
+                     fractal_utils::fractal_map &dst) noexcept {
+  const int skip_rows =
+      fractal_utils::skip_rows(ci.rows, ci.ratio, rt.png_per_frame, pngidx);
+  const int skip_cols =
+      fractal_utils::skip_cols(ci.cols, ci.ratio, rt.png_per_frame, pngidx);
+  const size_t row_bytes = image.cols * 3;
+  const uint8_t *const begin = reinterpret_cast<const uint8_t *>(image.data) +
+                               skip_rows * row_bytes + skip_cols * 3;
+  resize_u8c3(begin, ci.rows - 2 * skip_rows, ci.cols - 2 * skip_cols,
+              row_bytes, dst);
+}
+
+}  // namespace
+
+bool run_stream(const common_info &ci, const compute_task &ct,
+                const render_task &rt, const video_task &vt,
+                bool persist_hybf) noexcept {
+  libHybractal::hsv_render_option render;
+  {
+    auto temp = libHybractal::hsv_render_option::load_from_file(rt.config_file);
+    if (!temp.has_value()) {
+      cerr << fmt::format("Failed to load render json file {}.", rt.config_file)
+           << endl;
+      return false;
+    }
+    render = temp.value();
+  }
+
+  libHybractal::hybf_archive first_frame;
+  if (!init_compute_archive(ci, ct, first_frame)) {
+    return false;
+  }
+
+  const std::string command = encoder_pipe_command(ci, rt, vt);
+  FILE *const pipe = open_encoder_pipe(command);
+  if (pipe == nullptr) {
+    return false;
+  }
+
+  // compute -> render -> encode. Compute and encode each own one thread that
+  // drives an OpenMP team of ct.threads and vt.threads, render owns
+  // render-threads threads. Each queue holds at most queue-capacity frames,
+  // so a slow encoder stalls the computation instead of filling the memory.
+  const int render_threads = render_stage_threads(rt)[1];
+  const int capacity =
+      (rt.queue_capacity > 0) ? rt.queue_capacity : 2 * render_threads;
+
+  bounded_queue<computed_frame> computed{size_t(capacity)};
+  bounded_queue<rendered_frame> rendered{size_t(capacity), render_threads};
+  // A render thread takes its image before the archive, so the frame that
+  // the encoder waits for always has an image, no matter how many later
+  // frames are parked in the reorder buffer.
+  const int image_num = capacity + render_threads + 1;
+  bounded_queue<image_ptr> free_images{size_t(image_num)};
+  for (int i = 0; i < image_num; i++) {
+    free_images.push(std::make_unique<fractal_utils::fractal_map>(ci.rows,
+                                                                  ci.cols, 3));
+  }
+
+  stage_meter meter_compute{"compute", ct.threads};
+  stage_meter meter_render{"render", render_threads};
+  stage_meter meter_encode{"encode", vt.threads};
+
+  std::atomic<int> error_counter{0};
+  // set when any stage fails, others stop at their next frame.
+  std::atomic<bool> abort{false};
+
+  auto compute_worker = [&]() {
+    omp_set_num_threads(ct.threads);
+    std::vector<uint8_t> buffer;
+    // predicted by the previous frame
+    libHybractal::cost_map cost;
+    for (int fidx = 0; fidx < ci.frame_num && !abort; fidx++) {
+      computed_frame frame{fidx, {}};
+      const std::string filename = hybf_filename(ci, fidx);
+      {
+        auto m = meter_compute.measure();
+        bool exists{false};
+        check_hybf_option opt;
+        opt.move_archive = &frame.archive;
+        if (!persist_hybf || !check_hybf(filename, ci, buffer, exists, opt)) {
+          frame.archive = first_frame;
+          set_frame_window(ci, ct, fidx, frame.archive);
+          const int maxit = set_frame_maxit(ci, ct, frame.archive);
+          auto mat_age = frame.archive.map_age();
+          auto mat_z = frame.archive.map_z();
+          libHybractal::frame_stats stats;
+          libHybractal::compute_frame_by_precision(
+              frame.archive.metainfo().window_base(),
+              frame.archive.metainfo().precision(), maxit, mat_age, &mat_z,
+              &stats, &cost);
+          frame.archive.stats() = std::move(stats);
+
+          if (persist_hybf &&
+              !frame.archive.save(filename, hybf_save_options(ct))) {
+            cerr << fmt::format("Failed to export hybf file: {}", filename)
+                 << endl;
+            error_counter++;
+            abort = true;
+            break;
+          }
+        }
+        cost = predict_next_cost(ci, frame.archive);
+      }
+      computed.push(std::move(frame));
+    }
+    computed.close();
+  };
+
+  auto render_worker = [&]() {
+    libHybractal::gpu_resource gpu_rcs(ci.rows, ci.cols);
+    if (!gpu_rcs.ok()) {
+      cerr << "Fatal error : failed to initialize gpu resource." << endl;
+      exit(1);
+    }
+
+    while (true) {
+      image_ptr image = std::move(free_images.pop().value());
+      auto frame = computed.pop();
+      if (!frame.has_value()) {
+        free_images.push(std::move(image));
+        break;
+      }
+      {
+        auto m = meter_render.measure();
+        libHybractal::render_hsv(frame->archive.map_age(),
+                                 frame->archive.map_z(), *image, render,
+                                 gpu_rcs);
+      }
+      rendered.push(rendered_frame{frame->fidx, std::move(image)});
+    }
+    rendered.close();
+  };
+
+  const auto wall_begin = stage_meter::clock_t::now();
+  std::vector<std::thread> workers;
+  workers.reserve(1 + render_threads);
+  workers.emplace_back(compute_worker);
+  for (int i = 0; i < render_threads; i++) {
+    workers.emplace_back(render_worker);
+  }
+
+  // encode on this thread. Frames arrive out of order from the render
+  // threads, and each frame fades out the extra pngs of the previous one.
+  {
+    omp_set_num_threads(vt.threads);
+    const auto size = video_size(ci);
+    const int fps = rt.png_per_frame;
+    const size_t frame_bytes = size_t(size[0]) * size_t(size[1]) * 3;
+    std::vector<uint8_t> batch(frame_bytes * fps);
+
+    std::map<int, image_ptr> reorder;
+    image_ptr prev;
+
+    for (int fidx = 0; fidx < ci.frame_num && !abort; fidx++) {
+      while (!reorder.contains(fidx)) {
+        auto frame = rendered.pop();
+        if (!frame.has_value()) {
+          break;
+        }
+        reorder.emplace(frame->fidx, std::move(frame->image));
+      }
+      if (!reorder.contains(fidx)) {
+        // the computation was aborted
+        break;
+      }
+      image_ptr cur = std::move(reorder.at(fidx));
+      reorder.erase(fidx);
+
+      cout << fmt::format("[{:^6.1f}% : {:^3} / {:^3}] : streaming frame {}",
+                          100 * float(fidx) / ci.frame_num, fidx, ci.frame_num,
+                          fidx)
+           << endl;
+      {
+        auto m = meter_encode.measure();
+#pragma omp parallel for schedule(dynamic)
+        for (int pngidx = 0; pngidx < fps; pngidx++) {
+          thread_local std::vector<uint8_t> extra;
+          fractal_utils::fractal_map dst{size_t(size[0]), size_t(size[1]), 3,
+                                         batch.data() + pngidx * frame_bytes};
+          crop_and_resize(ci, rt, *cur, pngidx, dst);
+
+          if (!prev || pngidx >= rt.extra_png_num) {
+            continue;
+          }
+
+          extra.resize(frame_bytes);
+          fractal_utils::fractal_map extra_map{size_t(size[0]),
+                                               size_t(size[1]), 3, extra.data()};
+          crop_and_resize(ci, rt, *prev, fps + pngidx, extra_map);
+          const float alpha =
+              float(rt.extra_png_num - pngidx) / (rt.extra_png_num + 1);
+          blend_u8c3(dst, extra_map, alpha);
+        }
+
+        if (fwrite(batch.data(), 1, batch.size(), pipe) != batch.size()) {
+          cerr << "Failed to write frames to encoder." << endl;
+          error_counter++;
+          abort = true;
+        }
+      }
+
+      if (prev) {
+        free_images.push(std::move(prev));
+      }
+      prev = std::move(cur);
+    }
+
+    // unblock the other stages if the encoder stopped early
+    while (auto frame = rendered.pop()) {
+      free_images.push(std::move(frame->image));
+    }
+  }
+
+  for (auto &t : workers) {
+    t.join();
+  }
+  const double wall_seconds =
+      std::chrono::duration<double>(stage_meter::clock_t::now() - wall_begin)
+          .count();
+
+  const int ret = close_encoder_pipe(pipe);
+
+  cout << fmt::format("Streaming finished in {:.3f} s, queue capacity = {}",
+                      wall_seconds, capacity)
+       << endl;
+  for (const stage_meter *m : {&meter_compute, &meter_render, &meter_encode}) {
+    cout << "  " << m->report(wall_seconds) << endl;
+  }
+
+  if (error_counter != 0) {
+    return false;
+  }
+  if (ret != 0) {
+    cerr << fmt::format("Encoder exited with code {}.", ret) << endl;
+    return false;
+  }
+  return true;
+}
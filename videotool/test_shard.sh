@@ -0,0 +1,46 @@
+#!/bin/sh
+# Several processes compute the frames of one task through a lease directory,
+# and take over the lease of a crashed process. Then the task is resumed from
+# the journal.
+# usage: test_shard.sh <videotool> <task file>
+set -e
+videotool=$1
+task=$2
+frame_num=8
+
+rm -rf shard
+mkdir -p shard/compute shard/lease
+# the journal is written next to the task file
+cp "$task" shard/task.json
+task=shard/task.json
+echo "crashed-host-1-0" > shard/lease/compute-000002.lease
+# longer than lease-expiry
+sleep 3
+
+pids=""
+for i in 1 2 3; do
+  "$videotool" "$task" compute > "shard/compute-$i.log" 2>&1 &
+  pids="$pids $!"
+done
+for pid in $pids; do
+  wait "$pid"
+done
+
+grep -q "Taking over" shard/compute-*.log
+# every frame is computed exactly once
+test "$(cat shard/compute-*.log | grep -c "maxit =")" -eq $frame_num
+i=0
+while [ $i -lt $frame_num ]; do
+  test -f "$(printf "shard/compute/frame%06d.hybf" $i)"
+  i=$((i + 1))
+done
+test -z "$(ls -A shard/lease)"
+
+"$videotool" "$task" compute > shard/resume.log 2>&1
+grep -q "$frame_num frames of compute are finished" shard/resume.log
+
+# records before a checkpoint are trusted only if the file is still there
+rm shard/compute/frame000003.hybf
+"$videotool" "$task" compute > shard/resume-deleted.log 2>&1
+grep -q "$((frame_num - 1)) frames of compute are finished" shard/resume-deleted.log
+test -f shard/compute/frame000003.hybf
@@ -42,11 +42,29 @@ int main(int argc, char **argv) {
   auto compute = app.add_subcommand("compute");
   auto render = app.add_subcommand("render");
   auto mkvideo = app.add_subcommand("makevideo");
+  auto expmap = app.add_subcommand(
+      "expmap",
+      "Make the video from a single exponential map instead of frames.");
+
+  auto stream = app.add_subcommand(
+      "stream", "Compute, render and encode frames without pngs on disk.");
+
+  bool benchmark{false};
+  compute
+      ->add_flag("--benchmark,--bench", benchmark,
+                 "Show how much saving overlaps with computing.")
+      ->default_val(false);
 
   bool dry_run{false};
   mkvideo->add_flag("--dry-run", dry_run, "Print commands instead of execute.")
       ->default_val(false);
 
+  bool persist_hybf{false};
+  stream
+      ->add_flag("--persist", persist_hybf,
+                 "Save computed frames as hybf files, and reuse valid ones.")
+      ->default_val(false);
+
   CLI11_PARSE(app, argc, argv);
 
   auto taskf_opt = load_task(taskfile);
@@ -64,7 +82,7 @@ int main(int argc, char **argv) {
   }
 
   if (compute->count() > 0) {
-    if (!run_compute(taskf.common, taskf.compute)) {
+    if (!run_compute(taskf.common, taskf.compute, benchmark)) {
       std::cerr << "Computation terminated with error." << std::endl;
       return 1;
     }
@@ -84,6 +102,21 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (expmap->count() > 0) {
+    if (!run_expmap(taskf.common, taskf.compute, taskf.render, taskf.video)) {
+      std::cerr << "Expmap terminated with error." << std::endl;
+      return 1;
+    }
+  }
+
+  if (stream->count() > 0) {
+    if (!run_stream(taskf.common, taskf.compute, taskf.render, taskf.video,
+                    persist_hybf)) {
+      std::cerr << "Stream terminated with error." << std::endl;
+      return 1;
+    }
+  }
+
   std::cout << "Success" << std::endl;
 
   return 0;
@@ -21,8 +21,10 @@ This file is part of Hybractal.
 
 #include <fractal_map.h>
 #include <libHybfile.h>
+#include <libRender.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <optional>
 #include <string>
@@ -34,9 +36,19 @@ struct common_info {
   std::string hybf_prefix;
   std::string png_prefix;
   std::string video_prefix;
+  // format of the images between render and makevideo
+  libHybractal::image_format image_format{libHybractal::image_format::png};
   int maxit;
   int frame_num;
   double ratio;
+  // If not empty, compute and render share frames with other processes
+  // through lease files in this directory, see lease.h.
+  std::string lease_dir;
+  // seconds without heartbeat, after which a lease is taken over
+  double lease_expiry{60};
+  // Finished frames are recorded in this file next to the task file, see
+  // journal.h. Empty means no journal.
+  std::string journal_file;
 };
 
 std::array<int, 2> video_size(const common_info &ci) noexcept;
@@ -53,6 +65,26 @@ struct compute_task {
   double x_span{-1};
   int threads;
   int precision;
+  libHybractal::compress_options compression{};
+  uint8_t age_filters{libHybractal::save_options{}.age_filters};
+  uint8_t z_filters{libHybractal::save_options{}.z_filters};
+  // absolute error bound of lossy mat_z, 0 means lossless
+  double z_tolerance{0};
+  libHybractal::z_format z_fmt{libHybractal::z_format::f64};
+  // If positive, maxit of each frame is estimated by a probe of
+  // maxit_probe_rows rows, so that raising it up to common_info::maxit changes
+  // at most this fraction of pixels. 0 means every frame uses
+  // common_info::maxit.
+  double maxit_tolerance{0};
+  int maxit_probe_rows{64};
+  int maxit_min{64};
+  // Frames computed at the same time by the threads. Frames whose pixels are
+  // all handed out to threads don't count.
+  int frames_in_flight{2};
+  // compute the last frames first, they are the most expensive ones
+  bool deepest_first{false};
+  // threads of the background writer to compress tiles, besides threads
+  int write_threads{1};
 };
 
 struct render_task {
@@ -60,8 +92,20 @@ struct render_task {
   int extra_png_num;
   std::string config_file;
   int threads;
+  // zlib level, low levels are much faster for images that only feed ffmpeg.
+  int png_level{1};
+  // threads of each pipeline stage, 0 means derived from threads.
+  int load_threads{0};
+  int render_threads{0};
+  int write_threads{0};
+  // max frames waiting between two stages, 0 means derived from threads.
+  int queue_capacity{0};
 };
 
+// Split rt.threads among the load, render and write stages for the options
+// that are 0.
+std::array<int, 3> render_stage_threads(const render_task &rt) noexcept;
+
 struct video_task {
   struct video_config {
     std::string extension;
@@ -74,6 +118,9 @@ struct video_task {
   std::string product_name;
   std::string ffmpeg_exe;
   int threads;
+  // blend in-process and pipe raw frames into one encoder, instead of
+  // producing and concatenating intermediate videos.
+  bool single_pass{true};
 };
 
 struct full_task {
@@ -88,7 +135,7 @@ std::optional<full_task> load_task(std::string_view filename) noexcept;
 struct check_hybf_option {
   bool nocheck_sequence{false};
   bool ignore_size{false};
-  libHybractal::hybf_archive *move_archive;
+  libHybractal::hybf_archive *move_archive{nullptr};
 };
 
 bool check_hybf(std::string_view filename, const common_info &ci,
@@ -98,10 +145,76 @@ bool check_hybf(std::string_view filename, const common_info &ci,
 bool check_hybf_size(const libHybractal::hybf_archive &,
                      const std::array<size_t, 2> &expected_size) noexcept;
 
-bool run_compute(const common_info &common, const compute_task &ctask) noexcept;
+// benchmark reports how much saving overlaps with computing
+bool run_compute(const common_info &common, const compute_task &ctask,
+                 bool benchmark = false) noexcept;
+
+// set size, maxit and the window of the first frame
+bool init_compute_archive(const common_info &common, const compute_task &ctask,
+                          libHybractal::hybf_archive &archive) noexcept;
+libHybractal::save_options hybf_save_options(const compute_task &ctask) noexcept;
+// zoom the window of archive to frame fidx
+void set_frame_window(const common_info &common, const compute_task &ctask,
+                      int fidx, libHybractal::hybf_archive &archive) noexcept;
+// set maxit of archive, whose window is already set, and return it
+int set_frame_maxit(const common_info &common, const compute_task &ctask,
+                    libHybractal::hybf_archive &archive) noexcept;
+// Cost of the frame after archive, predicted by its ages. It is empty if the
+// frames don't zoom in.
+libHybractal::cost_map predict_next_cost(
+    const common_info &common, libHybractal::hybf_archive &archive) noexcept;
 bool run_render(const common_info &ci, const render_task &rt) noexcept;
 
 bool run_makevideo(const common_info &ci, const render_task &rt,
                    const video_task &vt, bool dry_run) noexcept;
 
+// compute, render and encode in one process without pngs on disk. hybf files
+// are written and reused only if persist_hybf is true.
+bool run_stream(const common_info &ci, const compute_task &ct,
+                const render_task &rt, const video_task &vt,
+                bool persist_hybf) noexcept;
+
+// ffmpeg command that encodes rgb24 rawvideo from stdin into the product video
+std::string encoder_pipe_command(const common_info &ci, const render_task &rt,
+                                 const video_task &vt) noexcept;
+FILE *open_encoder_pipe(std::string_view command) noexcept;
+int close_encoder_pipe(FILE *pipe) noexcept;
+
+struct expmap_geometry {
+  // rows and cols of video frames
+  std::array<size_t, 2> video;
+  // rows and cols of the log-polar strip
+  size_t rows;
+  size_t cols;
+  // radius of the first and last row of strip
+  double r_max;
+  double r_min;
+  double log_step;
+  // size of a pixel in the first video frame, and in the center frame
+  double pixel_0;
+  double pixel_center;
+};
+
+expmap_geometry make_expmap_geometry(const common_info &ci,
+                                     const compute_task &ct) noexcept;
+
+std::string expmap_filename(const common_info &ci) noexcept;
+
+// Compute an exponential map and the center frame, then remap them into all
+// video frames that are piped into the encoder.
+bool run_expmap(const common_info &ci, const compute_task &ct,
+                const render_task &rt, const video_task &vt) noexcept;
+
+// area-average resampling, dst is expected to be not larger than src.
+void resize_u8c3(const fractal_utils::fractal_map &src,
+                 fractal_utils::fractal_map &dst) noexcept;
+// resize a sub-image whose rows are src_row_bytes apart.
+void resize_u8c3(const uint8_t *src, size_t src_rows, size_t src_cols,
+                 size_t src_row_bytes,
+                 fractal_utils::fractal_map &dst) noexcept;
+
+// dst = alpha * src + (1 - alpha) * dst
+void blend_u8c3(fractal_utils::fractal_map &dst,
+                const fractal_utils::fractal_map &src, float alpha) noexcept;
+
 #endif  // HYBRACTAL_VIDEOTOOL_VIDEOTOOL_H
\ No newline at end of file
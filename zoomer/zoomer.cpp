@@ -63,7 +63,7 @@ metainfo4gui_s get_info_struct(std::string_view filename,
   case (precision):                                                            \
     window_ptr.reset(new fractal_utils::mainwindow(                            \
         float_by_prec_t<(precision)>(0.0), nullptr, window_size,               \
-        sizeof(uint16_t)));                                                    \
+        age_bytes));                                                           \
     break;
 
 int main(int argc, char **argv) {
@@ -97,6 +97,9 @@ int main(int argc, char **argv) {
 
   QApplication qapp(argc, argv);
 
+  const size_t age_bytes = libHybractal::age_element_bytes(
+      libHybractal::age_format_for_maxit(metainfo.info.maxit));
+
   const std::array<int, 2> window_size{(int)metainfo.info.rows,
                                        (int)metainfo.info.cols};
   std::unique_ptr<fractal_utils::mainwindow> window_ptr{nullptr};
@@ -150,7 +153,7 @@ metainfo4gui_s get_info_struct(std::string_view filename,
       archive.metainfo(),
       fractal_utils::fractal_map{
           archive.rows(), archive.cols(),
-          sizeof(std::complex<libHybractal::hybf_store_t>)},
+          uint32_t(libHybractal::z_element_bytes(archive.mat_z_format()))},
       libHybractal::gpu_resource{archive.rows(), archive.cols()},
       renderer.value()};
 }
@@ -194,8 +197,10 @@ bool export_fun(const fractal_utils::fractal_map &map_fractal,
                 const char *filename) {
   auto *metainfo = reinterpret_cast<metainfo4gui_s *>(custom_ptr);
 
-  libHybractal::hybf_archive archive{metainfo->info.rows, metainfo->info.cols,
-                                     true};
+  libHybractal::hybf_archive archive{
+      metainfo->info.rows, metainfo->info.cols, true,
+      libHybractal::z_format_of(metainfo->mat_z.element_bytes).value(),
+      libHybractal::age_format_of(map_fractal.element_bytes).value()};
 
   {
     archive.metainfo().maxit = metainfo->info.maxit;